@@ -0,0 +1,42 @@
+import java.nio.ByteBuffer;
+import java.util.ArrayList;
+import java.util.Collections;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+
+// A traced region that spends nearly all of its time inside collection
+// classes, which jtrace does not trace.
+class CollectionHeavy {
+    static class JTraceReceiver {
+        public static boolean stateOnly = false;
+        public static void start() {}
+        public static void end() {}
+        public static void receive(ByteBuffer trace, int stepCount) {
+            System.out.println("steps: " + stepCount);
+            System.out.println("bytes: " + trace.remaining());
+        }
+    }
+
+    static int work(int size) {
+        List<Integer> list = new ArrayList<>();
+        Map<Integer, Integer> counts = new HashMap<>();
+        for (int i = 0; i < size; ++i) list.add((i * 7919) % size);
+        Collections.sort(list);
+        for (int value : list) counts.merge(value % 100, 1, Integer::sum);
+        return counts.size();
+    }
+
+    public static void main(String[] args) {
+        int size = args.length > 0 ? Integer.parseInt(args[0]) : 20000;
+        long begin = System.nanoTime();
+        JTraceReceiver.start();
+        int result = work(size);
+        long traced = System.nanoTime();
+        JTraceReceiver.end();
+        long done = System.nanoTime();
+        System.out.println("result: " + result);
+        System.out.println("traced ms: " + (traced - begin) / 1e6);
+        System.out.println("end ms: " + (done - traced) / 1e6);
+    }
+}
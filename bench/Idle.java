@@ -0,0 +1,35 @@
+import java.lang.management.ManagementFactory;
+
+// A call-heavy workload that runs entirely outside of a traced region, to
+// measure what loading the agent costs when nothing is being traced: how
+// long the VM takes to reach main, and how fast the workload runs once the
+// JIT has compiled it.
+class Idle {
+    static final int ROUNDS = 5;
+
+    static class JTraceReceiver {
+        public static void start() {}
+        public static void end() {}
+        public static void receive(String trace) {}
+    }
+
+    static int fib(int n) {
+        return n < 2 ? n : fib(n - 1) + fib(n - 2);
+    }
+
+    public static void main(String[] args) {
+        long startup = ManagementFactory.getRuntimeMXBean().getUptime();
+        int n = args.length > 0 ? Integer.parseInt(args[0]) : 32;
+        // Earlier rounds warm up the JIT, the last one is reported.
+        int result = 0;
+        long elapsed = 0;
+        for (int round = 0; round < ROUNDS; ++round) {
+            long begin = System.nanoTime();
+            result = fib(n);
+            elapsed = System.nanoTime() - begin;
+        }
+        System.out.println("result: " + result);
+        System.out.println("startup ms: " + startup);
+        System.out.println("idle ms: " + elapsed / 1e6);
+    }
+}
@@ -0,0 +1,49 @@
+import java.nio.ByteBuffer;
+
+// Methods of a class with many instance and static fields, all of which are
+// part of every step's state.
+class ManyFields {
+    static class JTraceReceiver {
+        public static boolean stateOnly = false;
+        public static void start() {}
+        public static void end() {}
+        public static void receive(ByteBuffer trace, int stepCount) {
+            System.out.println("steps: " + stepCount);
+            System.out.println("bytes: " + trace.remaining());
+        }
+    }
+
+    static int s0, s1, s2, s3, s4, s5, s6, s7, s8, s9;
+    int f0, f1, f2, f3, f4, f5, f6, f7, f8, f9;
+    long g0, g1, g2, g3, g4, g5, g6, g7, g8, g9;
+    double d0, d1, d2, d3, d4, d5, d6, d7, d8, d9;
+    String name = "fields";
+    int[] counts = new int[8];
+
+    void update(int i) {
+        f0 += i;
+        g1 += f0;
+        d2 += g1 * 0.5;
+        counts[i % counts.length]++;
+        s3 = f0 ^ i;
+    }
+
+    static int work(int size) {
+        ManyFields fields = new ManyFields();
+        for (int i = 0; i < size; ++i) fields.update(i);
+        return fields.f0 + s3;
+    }
+
+    public static void main(String[] args) {
+        int size = args.length > 0 ? Integer.parseInt(args[0]) : 2000;
+        long begin = System.nanoTime();
+        JTraceReceiver.start();
+        int result = work(size);
+        long traced = System.nanoTime();
+        JTraceReceiver.end();
+        long done = System.nanoTime();
+        System.out.println("result: " + result);
+        System.out.println("traced ms: " + (traced - begin) / 1e6);
+        System.out.println("end ms: " + (done - traced) / 1e6);
+    }
+}
@@ -0,0 +1,55 @@
+import java.nio.ByteBuffer;
+
+// A method with many locals in nested block scopes, so the set of variables
+// in scope changes from step to step.
+class ManyLocals {
+    static class JTraceReceiver {
+        public static boolean stateOnly = false;
+        public static void start() {}
+        public static void end() {}
+        public static void receive(ByteBuffer trace, int stepCount) {
+            System.out.println("steps: " + stepCount);
+            System.out.println("bytes: " + trace.remaining());
+        }
+    }
+
+    static long step(int i) {
+        long total = i;
+        {
+            int a = i + 1, b = i + 2, c = i + 3, d = i + 4;
+            total += a * b - c * d;
+            {
+                long e = total * 3, f = e - a, g = f + b;
+                total ^= e + f + g;
+            }
+        }
+        {
+            double h = i * 0.25, j = h * h, k = j - h;
+            total += (long)(h + j + k);
+            {
+                int m = (int)k, n = m * 2, o = n - m, p = o + n;
+                total -= m + n + o + p;
+            }
+        }
+        return total;
+    }
+
+    static long work(int size) {
+        long total = 0;
+        for (int i = 0; i < size; ++i) total += step(i);
+        return total;
+    }
+
+    public static void main(String[] args) {
+        int size = args.length > 0 ? Integer.parseInt(args[0]) : 2000;
+        long begin = System.nanoTime();
+        JTraceReceiver.start();
+        long result = work(size);
+        long traced = System.nanoTime();
+        JTraceReceiver.end();
+        long done = System.nanoTime();
+        System.out.println("result: " + result);
+        System.out.println("traced ms: " + (traced - begin) / 1e6);
+        System.out.println("end ms: " + (done - traced) / 1e6);
+    }
+}
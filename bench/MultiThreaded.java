@@ -0,0 +1,51 @@
+import java.nio.ByteBuffer;
+
+// Several threads running traced code at the same time.
+class MultiThreaded {
+    static class JTraceReceiver {
+        public static boolean stateOnly = false;
+        public static void start() {}
+        public static void end() {}
+        public static void receive(ByteBuffer trace, int stepCount) {
+            System.out.println("steps: " + stepCount);
+            System.out.println("bytes: " + trace.remaining());
+        }
+    }
+
+    static final int THREADS = 4;
+    static long[] results = new long[THREADS];
+
+    static long count(int size, int seed) {
+        long total = seed;
+        for (int i = 0; i < size; ++i) total = total * 31 + i;
+        return total;
+    }
+
+    static long work(int size) throws InterruptedException {
+        Thread[] threads = new Thread[THREADS];
+        for (int t = 0; t < THREADS; ++t) {
+            final int seed = t;
+            threads[t] = new Thread(() -> results[seed] = count(size, seed));
+            threads[t].start();
+        }
+        long total = 0;
+        for (int t = 0; t < THREADS; ++t) {
+            threads[t].join();
+            total += results[t];
+        }
+        return total;
+    }
+
+    public static void main(String[] args) throws InterruptedException {
+        int size = args.length > 0 ? Integer.parseInt(args[0]) : 5000;
+        long begin = System.nanoTime();
+        JTraceReceiver.start();
+        long result = work(size);
+        long traced = System.nanoTime();
+        JTraceReceiver.end();
+        long done = System.nanoTime();
+        System.out.println("result: " + result);
+        System.out.println("traced ms: " + (traced - begin) / 1e6);
+        System.out.println("end ms: " + (done - traced) / 1e6);
+    }
+}
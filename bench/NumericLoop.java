@@ -0,0 +1,38 @@
+import java.nio.ByteBuffer;
+
+// Tight numeric loops over a handful of locals, which is the worst case for
+// single-stepping: almost every bytecode is a step.
+class NumericLoop {
+    static class JTraceReceiver {
+        public static boolean stateOnly = false;
+        public static void start() {}
+        public static void end() {}
+        public static void receive(ByteBuffer trace, int stepCount) {
+            System.out.println("steps: " + stepCount);
+            System.out.println("bytes: " + trace.remaining());
+        }
+    }
+
+    static double work(int size) {
+        long sum = 0;
+        double norm = 0;
+        for (int i = 0; i < size; ++i) {
+            sum += (long)i * i;
+            norm += Math.sqrt(i) / (i + 1);
+        }
+        return sum + norm;
+    }
+
+    public static void main(String[] args) {
+        int size = args.length > 0 ? Integer.parseInt(args[0]) : 20000;
+        long begin = System.nanoTime();
+        JTraceReceiver.start();
+        double result = work(size);
+        long traced = System.nanoTime();
+        JTraceReceiver.end();
+        long done = System.nanoTime();
+        System.out.println("result: " + result);
+        System.out.println("traced ms: " + (traced - begin) / 1e6);
+        System.out.println("end ms: " + (done - traced) / 1e6);
+    }
+}
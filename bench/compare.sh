@@ -0,0 +1,81 @@
+#!/bin/sh
+# compare.sh
+#
+# Runs the benchmarks with the agent built from another revision (before)
+# and with the current one (after), and prints the columns that matter side
+# by side. base_ms is the current run without the agent.
+#
+# usage: bench/compare.sh <revision> <path to jtrace> [results file]
+#
+# The agent at <revision> is built in a temporary git worktree with the
+# Makefile of that revision. The workloads are always the current ones,
+# compiled into bench/ (`make bench-compare` does both). JTRACE_BENCH and
+# JTRACE_OPTIONS apply to both runs, and JTRACE_BASE_OPTIONS, if set,
+# replaces JTRACE_OPTIONS for the older agent, whose options may differ.
+# The full tables are kept next to the results as `.before` and `.after`.
+#
+# A revision of `.` uses the current agent for both runs, to compare
+# options instead, e.g. step and call mode:
+#
+#   JTRACE_BASE_OPTIONS= JTRACE_OPTIONS=mode=call bench/compare.sh . ./jtrace
+
+set -e
+
+if [ $# -lt 2 ]; then
+  echo "usage: bench/compare.sh <revision> <path to jtrace> [results file]" >&2
+  exit 2
+fi
+
+revision=$1
+current=$2
+results=${3:-/dev/stdout}
+bench=$(dirname "$0")
+worktree=$(mktemp -d)
+if [ $# -ge 3 ]; then
+  tables=$3
+  trap 'git worktree remove --force "$worktree" > /dev/null 2>&1 || true; rm -rf "$worktree"' EXIT
+else
+  tables=$worktree.tables
+  trap 'git worktree remove --force "$worktree" > /dev/null 2>&1 || true; rm -rf "$worktree" "$tables.before" "$tables.after"' EXIT
+fi
+
+if [ "$revision" = . ]; then
+  before=$current
+else
+  git worktree add --detach "$worktree" "$revision" > /dev/null
+  make -C "$worktree" jtrace > /dev/null
+  before=$worktree/jtrace
+fi
+
+JTRACE_OPTIONS=${JTRACE_BASE_OPTIONS-$JTRACE_OPTIONS} \
+  sh "$bench/run.sh" "$before" "$tables.before"
+sh "$bench/run.sh" "$current" "$tables.after"
+
+# Columns are looked up by name, since older tables may have fewer.
+awk -F '\t' '
+  FNR == 1 {
+    for (i = 1; i <= NF; ++i) column[FILENAME, $i] = i;
+    next;
+  }
+  function get(file, name,    i) {
+    i = column[file, name];
+    return i ? row[file, $1, i] : "NA";
+  }
+  {
+    for (i = 1; i <= NF; ++i) row[FILENAME, $1, i] = $i;
+    if (FILENAME == ARGV[1]) order[++count] = $1;
+  }
+  END {
+    before = ARGV[1];
+    after = ARGV[2];
+    print "workload\tbase_ms\tbefore_ms\tafter_ms\tbefore_rss_kb\tafter_rss_kb\tbefore_bytes\tafter_bytes\tbefore_startup_ms\tafter_startup_ms";
+    for (n = 1; n <= count; ++n) {
+      $1 = order[n];
+      printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n", $1,
+        get(after, "base_ms"), get(before, "traced_ms"),
+        get(after, "traced_ms"), get(before, "rss_kb"), get(after, "rss_kb"),
+        get(before, "bytes"), get(after, "bytes"), get(before, "startup_ms"),
+        get(after, "startup_ms");
+    }
+  }
+' "$tables.before" "$tables.after" > "$results"
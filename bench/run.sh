@@ -0,0 +1,127 @@
+#!/bin/sh
+# run.sh
+#
+# Runs every benchmark workload with and without the agent and writes one
+# tab-separated line of results per workload.
+#
+# usage: bench/run.sh <path to jtrace> [results file]
+#
+# The workloads must already be compiled into bench/ (`make bench` does
+# both). Agent options can be passed in JTRACE_OPTIONS, e.g.
+# `JTRACE_OPTIONS=compare=exact make bench`. Workloads are looked up in
+# bench/ unless JTRACE_CLASSPATH says otherwise. Columns are:
+#
+#   workload      class name
+#   size          argument passed to main
+#   base_ms       traced region without the agent
+#   traced_ms     traced region with the agent
+#   slowdown      traced_ms / base_ms
+#   steps         steps delivered to the receiver
+#   steps_per_s   steps / traced region
+#   bytes         size of the binary trace
+#   bytes_per_step
+#   base_rss_kb   peak RSS without the agent, NA if unknown
+#   rss_kb        peak RSS with the agent, NA if unknown
+#   end_ms        time spent in JTraceReceiver.end()
+#   base_startup_ms  time from VM start to main without the agent, NA if
+#                 the workload doesn't report it
+#   startup_ms    time from VM start to main with the agent
+#
+# Idle measures code outside of a traced region, so it has no steps. It
+# reports its startup time, and its region is the last of several rounds,
+# once the JIT has compiled it.
+
+set -e
+
+if [ $# -lt 1 ]; then
+  echo "usage: bench/run.sh <path to jtrace> [results file]" >&2
+  exit 2
+fi
+
+agent="-agentpath:$1"
+if [ -n "$JTRACE_OPTIONS" ]; then agent="$agent=$JTRACE_OPTIONS"; fi
+results=${2:-/dev/stdout}
+bench=$(dirname "$0")
+classpath=${JTRACE_CLASSPATH:-$bench}
+workloads=${JTRACE_BENCH:-"NumericLoop:20000 Recursion:20 ManyFields:2000 ManyLocals:2000 CollectionHeavy:20000 MultiThreaded:5000 Idle:32"}
+output=$(mktemp)
+trap 'rm -f "$output" "$output.rss"' EXIT
+
+# Peak RSS comes from time(1): GNU reports kilobytes with -f, BSD reports
+# bytes with -l.
+if /usr/bin/time -f %M true > /dev/null 2>&1; then rss=gnu
+elif /usr/bin/time -l true > /dev/null 2>&1; then rss=bsd
+else rss=none
+fi
+
+# Run java with the given arguments, leaving its output in $output and its
+# peak RSS in kilobytes in $peak.
+measure()
+{
+  case $rss in
+    gnu)
+      /usr/bin/time -f %M -o "$output.rss" java "$@" > "$output"
+      peak=$(tail -n 1 "$output.rss")
+      ;;
+    bsd)
+      /usr/bin/time -l java "$@" > "$output" 2> "$output.rss"
+      peak=$(awk '/maximum resident/ { print int($1 / 1024) }' "$output.rss")
+      ;;
+    *)
+      java "$@" > "$output"
+      peak=NA
+      ;;
+  esac
+}
+
+# Print the value of a `key: value` line of the last run, or NA.
+value()
+{
+  line=$(grep "^$1: " "$output" | tail -n 1)
+  if [ -n "$line" ]; then echo "${line#*: }"; else echo NA; fi
+}
+
+# Time of the measured region, which Idle reports under another name.
+region()
+{
+  ms=$(value "traced ms")
+  if [ "$ms" = NA ]; then ms=$(value "idle ms"); fi
+  echo "$ms"
+}
+
+# Divide, or print NA if either operand is unknown or the divisor is zero.
+ratio()
+{
+  awk -v a="$1" -v b="$2" -v scale="${3:-1}" 'BEGIN {
+    if (a == "NA" || b == "NA" || b == 0) print "NA";
+    else printf "%.2f\n", a * scale / b;
+  }'
+}
+
+printf 'workload\tsize\tbase_ms\ttraced_ms\tslowdown\tsteps\tsteps_per_s\tbytes\tbytes_per_step\tbase_rss_kb\trss_kb\tend_ms\tbase_startup_ms\tstartup_ms\n' > "$results"
+for workload in $workloads; do
+  name=${workload%%:*}
+  size=${workload#*:}
+
+  measure -cp "$classpath" "$name" "$size"
+  base_ms=$(region)
+  base_rss=$peak
+  base_startup=$(value "startup ms")
+
+  measure "$agent" -cp "$classpath" "$name" "$size"
+  traced_ms=$(region)
+  traced_rss=$peak
+  steps=$(value steps)
+  bytes=$(value bytes)
+  end_ms=$(value "end ms")
+  startup=$(value "startup ms")
+
+  printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n' \
+    "$name" "$size" "$base_ms" "$traced_ms" \
+    "$(ratio "$traced_ms" "$base_ms")" \
+    "$steps" "$(ratio "$steps" "$traced_ms" 1000)" \
+    "$bytes" "$(ratio "$bytes" "$steps")" \
+    "$base_rss" "$traced_rss" "$end_ms" "$base_startup" "$startup" \
+    >> "$results"
+  echo "$name done" >&2
+done
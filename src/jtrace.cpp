@@ -1,4 +1,3 @@
-
 // jtrace.cpp
 //
 // A native agent that traces Java code execution.
@@ -14,10 +13,26 @@
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <queue>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <cctype>
 #include <jvmti.h>
 #include <jni.h>
+#include "jtrace_format.h"
+#include "jtrace_archive.h"
+#include "jtrace_shm.h"
+#include "jtrace_filter.h"
 
 // For now we don't trace code inside the Java stdlib, there will eventually be
 // a better way to ignore specific classes/packages.
@@ -28,14 +43,23 @@ static const std::vector<std::string> global_java_prefixes = {
 };
 // Receiver class name
 static const std::string global_jtrace_receiver = "JTraceReceiver;";
-// Receiver method signature
+// Receiver method signatures
 static const std::string global_receive_signature = "(Ljava/lang/String;I)V";
+static const std::string global_receive_buffer_signature =
+  "(Ljava/nio/ByteBuffer;I)V";
+static const std::string global_receive_chunk_signature =
+  "(Ljava/nio/ByteBuffer;IIZ)V";
+static const std::string global_receive_stats_signature =
+  "(Ljava/lang/String;)V";
 
-// Every Java value has a type and a signature. The value is stored as a
-// union of all underlying JVMTI types.
+// Every Java value has a name, a type and a signature. The value is stored
+// as a union of all underlying JVMTI types. This is plain old data so that
+// states can be compared and copied as flat memory.
+// Objects are read as local references, which are replaced by the object's
+// tag before the step is recorded.
 struct java_value
 {
-  enum java_type
+  enum java_type : uint8_t
   {
     INT,
     LONG,
@@ -50,6 +74,7 @@ struct java_value
   union _value
   {
     jobject _object;
+    jlong _tag;
     jint _int;
     jshort _short;
     jchar _char;
@@ -60,543 +85,5311 @@ struct java_value
     jfloat _float;
   };
 
+  symbol_id name;
+  symbol_id signature;
   java_type type;
   _value value;
-  std::string signature;
-  java_value() : type(INT) { std::memset(&value, 0, sizeof(value)); }
+  java_value() : name(0), signature(0), type(INT)
+  {
+    std::memset(&value, 0, sizeof(value));
+  }
+};
+
+// State is captured as a vector of values sorted by name.
+typedef std::vector<java_value> state_map;
+
+// The contents of an object referenced by a step. A new version is captured
+// whenever the contents change.
+struct object_version
+{
+  jlong tag;
+  uint64_t version;
+  symbol_id class_name;
+  state_map fields;
+  // Arrays and strings hold up to `global.capture_elements` of their
+  // elements instead of fields, laid out as in the trace format.
+  bool is_array = false;
+  uint64_t length = 0;
+  java_value::java_type element_type = java_value::INT;
+  std::string contents;
 };
 
-// State is captured as a map of identifiers to values.
-typedef std::unordered_map<std::string, java_value> state_map;
+struct method_info;
 
-// Every execution step is inside a method and has local, instance and class
-// state.
+// Every execution step is inside a method, runs on a thread and has local,
+// instance and class state. Sequence numbers order steps across threads.
+// Times are in nanoseconds since tracing started. When tracing calls, steps
+// are method calls and returns instead.
 struct single_step
 {
-  std::string class_name;
-  std::string method_name;
+  uint32_t thread_id = 0;
+  uint64_t sequence = 0;
+  uint64_t time = 0;
+  trace_event event = TRACE_EVENT_STEP;
+  // Steps of this thread that sampling left out right before this one.
+  uint32_t skipped = 0;
+  symbol_id class_name = 0;
+  symbol_id method_name = 0;
+  symbol_id method_signature = 0;
+  // The method being traced, while the step is captured.
+  const method_info *method = NULL;
+  // The depth of the step's frame, which is only read when dropping steps
+  // that don't change state.
+  jint depth = 0;
+  // Where the step is in the source. The line is 0 if unknown.
+  symbol_id source_file = 0;
+  jint line = 0;
   state_map class_state;
   state_map instance_state;
   state_map local_state;
+  // Objects whose contents changed since they were last captured.
+  std::vector<object_version> objects;
 };
 
-// Putting all the global variables in a single struct makes them seem
-// less bad.
-struct global_state
+// A change to one variable between two steps.
+struct state_change
 {
-  bool jvm_started = false;
-  bool state_only = false;
-  jmethodID receiver_method = 0;
-  std::vector<single_step> program_steps;
+  enum scope_type
+  {
+    LOCAL,
+    INSTANCE,
+    CLASS
+  };
+
+  scope_type scope;
+  // Variables that go out of scope are removed.
+  bool removed;
+  java_value value;
 };
-static global_state global;
 
-// We overload this operator to be able to tell whether state changed between
-// two steps.
-bool operator==(const single_step& left, const single_step& right)
+// Steps are stored as the changes since the previous step, which is usually
+// a single value. Every `global_keyframe_interval`th step is a keyframe that
+// holds the full state, so any step can be rebuilt without replaying the
+// whole trace.
+// Changes and objects live in the thread's step log, and are referred to by
+// index.
+struct stored_step
 {
-  if (left.class_name != right.class_name) return false;
-  if (left.method_name != right.method_name) return false;
-  if (left.class_state.size() != right.class_state.size())
-    return false;
-  if (left.instance_state.size() != right.instance_state.size())
-    return false;
-  if (left.local_state.size() != right.local_state.size())
-    return false;
+  uint64_t sequence;
+  uint64_t time;
+  trace_event event;
+  uint32_t skipped;
+  symbol_id class_name;
+  symbol_id method_name;
+  symbol_id method_signature;
+  symbol_id source_file;
+  jint line;
+  bool keyframe;
+  uint64_t first_change;
+  uint32_t change_count;
+  uint32_t object_count;
+  uint64_t first_object;
+};
+static const size_t global_keyframe_interval = 64;
 
-#define COMPARE_MAP(map) {                                      \
-    for (const auto& var : left.map) {                          \
-      if (right.map.count(var.first) == 0)                      \
-        return false;                                           \
-      const java_value& right_val = right.map.at(var.first);    \
-      if (var.second.type != right_val.type)                    \
-        return false;                                           \
-      if (var.second.signature != right_val.signature)          \
-        return false;                                           \
-      if (var.second.value._object != right_val.value._object)  \
-        return false;                                           \
-    }                                                           \
-  }
+// An append-only array of plain old data that is allocated in fixed-size
+// chunks, so that recording a step doesn't touch malloc. Chunks are released
+// all at once when the log is destroyed. When memory runs out, full chunks
+// can be spilled to a temporary file, and are read back one at a time.
+template <typename T>
+struct chunked_log
+{
+  static const size_t chunk_items = 4096;
 
-  COMPARE_MAP(class_state);
-  COMPARE_MAP(instance_state);
-  COMPARE_MAP(local_state);
+  chunked_log() = default;
+  chunked_log(chunked_log&& other) { swap(other); }
+  chunked_log& operator=(chunked_log&& other)
+  {
+    chunked_log moved(std::move(other));
+    swap(moved);
+    return *this;
+  }
+  ~chunked_log();
 
-  return true;
-}
+  void swap(chunked_log& other)
+  {
+    chunks.swap(other.chunks);
+    std::swap(count, other.count);
+    std::swap(spilled, other.spilled);
+    spill_file.swap(other.spill_file);
+    loaded.swap(other.loaded);
+    std::swap(loaded_chunk, other.loaded_chunk);
+  }
 
-// Exceptionally rudimentary error handling.
-void check_jvmti_error(
-  jvmtiEnv *jvmti,
-  jvmtiError errnum,
-  const char *str
-  )
-{
-  if (errnum == JVMTI_ERROR_NONE) return;
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  // Reading spilled chunks isn't safe from more than one thread at a time.
+  bool has_spilled() const { return spilled > 0; }
+  T& push_back();
+  const T& operator[](size_t index) const;
+  void spill();
 
-  char *errnum_str = NULL;
-  jvmti->GetErrorName(errnum, &errnum_str);
-  std::cerr
-    << "ERROR: JVMTI: "
-    << errnum << "("
-    << (errnum_str == NULL ? "Unknown" : errnum_str) << "): "
-    << (str == NULL ? "" : str)
-    << std::endl;
-  jvmti->Deallocate((unsigned char *)errnum_str);
-}
+private:
+  struct file_closer
+  {
+    void operator()(FILE *file) const { std::fclose(file); }
+  };
 
-// Serialize a single state_map into TOML.
-void write_state(std::ostream& output, std::string prefix, const state_map& map)
-{
-  for (const auto& var : map) {
-    output
-      << prefix << "."
-      << "\"" << var.first << "\".signature = "
-      << "\"" << var.second.signature << "\""
-      << std::endl
-      << prefix << "."
-      << "\"" << var.first << "\".value = ";
-    switch (var.second.type) {
-    case java_value::INT: output << var.second.value._int; break;
-    case java_value::SHORT: output << var.second.value._short; break;
-    case java_value::LONG: output << var.second.value._long; break;
-    case java_value::DOUBLE: output << var.second.value._double; break;
-    case java_value::FLOAT: output << var.second.value._float; break;
-    case java_value::BOOLEAN: output << var.second.value._int; break; //
-    case java_value::BYTE: output << var.second.value._byte; break;
-    case java_value::CHAR: output << var.second.value._char; break;
-    default: output << var.second.value._object;
-    }
-    output << std::endl;
-  }
-}
+  std::vector<std::unique_ptr<T[]>> chunks;
+  size_t count = 0;
+  // Chunks before this one are in `spill_file`.
+  size_t spilled = 0;
+  std::unique_ptr<FILE, file_closer> spill_file;
+  // The spilled chunk that was read back last.
+  mutable std::unique_ptr<T[]> loaded;
+  mutable size_t loaded_chunk = 0;
+};
 
-// Send the tracing information to the receiver.
-void send_steps(JNIEnv *jni, jclass receiver)
+// Everything one thread recorded while tracing.
+struct step_log
 {
-  if (receiver == 0 || global.receiver_method == 0)
-    return;
-
-  std::ostringstream output;
+  chunked_log<stored_step> records;
+  chunked_log<state_change> changes;
+  // Objects are rare, so they aren't worth chunking.
+  std::vector<object_version> objects;
+  size_t object_bytes = 0;
+  // The sequence of the first step in each chunk of `records`, so steps can
+  // be found without reading spilled chunks back.
+  std::vector<uint64_t> chunk_sequences;
 
-  for (int i = 0; i < global.program_steps.size(); ++i) {
-    const single_step& step = global.program_steps[i];
-    output
-      << "["
-      << "step" << i << "."
-      << "\"" << step.class_name << "\"."
-      << "\"" << step.method_name << "\""
-      << "]"
-      << std::endl;
-    write_state(output, "local", step.local_state);
-    write_state(output, "instance", step.instance_state);
-    write_state(output, "class", step.class_state);
+  step_log() = default;
+  step_log(step_log&& other) { swap(other); }
+  step_log& operator=(step_log&& other)
+  {
+    step_log moved(std::move(other));
+    swap(moved);
+    return *this;
   }
+  ~step_log();
 
-  std::string outstr = output.str();
-  jchar output_chars[outstr.size()];
-  for (int i = 0; i < outstr.size(); ++i)
-    output_chars[i] = (jchar)outstr[i];
-  jstring output_string = jni->NewString(output_chars, (jsize)outstr.size());
-  jni->CallStaticVoidMethod(
-    receiver,
-    global.receiver_method,
-    output_string,
-    (jint)global.program_steps.size()
-    );
-}
+  void swap(step_log& other)
+  {
+    records.swap(other.records);
+    changes.swap(other.changes);
+    objects.swap(other.objects);
+    std::swap(object_bytes, other.object_bytes);
+    chunk_sequences.swap(other.chunk_sequences);
+  }
+};
 
-// Read the value of a local variable.
-// Every variable exists in a specific `slot` (something like an offset)
-// within a stack frame.
-// `depth` is the depth of the stack frame -- `0` reads from the current
-// stack frame, `1` reads from the previous frame, etc.
-bool get_local_variable(
-  jvmtiEnv *jvmti, jthread thread, int depth, int slot, java_value& value
-  )
+// A local variable from a method's local variable table.
+struct local_variable
 {
-  jvmtiError error;
+  symbol_id name;
+  symbol_id signature;
   java_value::java_type type;
+  jint slot;
+  // `this` is read with `GetLocalInstance`.
+  bool is_this;
+  // The variable is in scope from `start` up to but not including `end`.
+  jlocation start;
+  jlocation end;
+};
 
-#define GET_LOCAL_VARIABLE(method, member) {                            \
-    error = (method)(thread, depth, slot, &(value.value.member));       \
-    if (error == JVMTI_ERROR_INVALID_SLOT)                              \
-      return false;                                                     \
-    check_jvmti_error(jvmti, error, "unable to get local variable");    \
-    value.type = type;                                                  \
-  }
-
-  // yuck
-  if (value.signature == "I") {
-    type = java_value::INT;
-    GET_LOCAL_VARIABLE(jvmti->GetLocalInt, _int);
-  } else if (value.signature == "J") {
-    type = java_value::LONG;
-    GET_LOCAL_VARIABLE(jvmti->GetLocalLong, _long);
-  } else if (value.signature == "F") {
-    type = java_value::FLOAT;
-    GET_LOCAL_VARIABLE(jvmti->GetLocalFloat, _float);
-  } else if (value.signature == "D") {
-    type = java_value::DOUBLE;
-    GET_LOCAL_VARIABLE(jvmti->GetLocalDouble, _double);
-  } else {
-    type = java_value::OBJECT;
-    GET_LOCAL_VARIABLE(jvmti->GetLocalObject, _object);
-  }
+struct field_reader
+{
+  jfieldID field;
+  symbol_id name;
+  symbol_id signature;
+  java_value::java_type type;
+  bool is_static;
+  // The tag of the class that declares the field.
+  jlong class_tag = 0;
+  // Set for an inherited field hidden by a field of the same name, which
+  // isn't part of the state.
+  bool hidden = false;
+};
 
-  return true;
-}
+// Everything we need to know about a method to trace it. These are built
+// once per method and never change afterwards, so any thread can read them
+// without locking.
+// Methods are captured by running a plan that is resolved when the method is
+// first seen: a flat list of readers for its local variables and fields,
+// each of which already knows its symbols and how to read its value.
+struct method_info
+{
+  bool traceable = false;
+  symbol_id class_name = 0;
+  symbol_id method_name = 0;
+  symbol_id method_signature = 0;
+  // The return type, for recording return values. Void methods have no
+  // return signature.
+  symbol_id return_signature = 0;
+  java_value::java_type return_type = java_value::INT;
+  // Only filled in for traceable methods. The declaring class is held as a
+  // global reference, and fields are sorted by name.
+  jclass klass = 0;
+  jlong class_tag = 0;
+  std::vector<local_variable> local_variables;
+  std::vector<field_reader> fields;
+  // The tags of the classes that declare its instance fields, starting
+  // with its own, when watching fields.
+  std::vector<jlong> field_classes;
+  // The source file of the declaring class, and the line number table
+  // sorted by location.
+  symbol_id source_file = 0;
+  std::vector<jvmtiLineNumberEntry> lines;
+  // When sampling, the bytecode ranges of loops (from the target of a
+  // backward branch to the branch), and the locations of returns and
+  // throws, which are always recorded.
+  std::vector<std::pair<jlocation, jlocation>> loops;
+  std::vector<jlocation> exits;
+  // Local variables in scope by location. Locations from `scope_starts[i]`
+  // up to `scope_starts[i + 1]` have the variables whose indices are in
+  // `scope_variables`, from `scope_offsets[i]` up to `scope_offsets[i + 1]`.
+  std::vector<jlocation> scope_starts;
+  std::vector<uint32_t> scope_offsets;
+  std::vector<uint32_t> scope_variables;
+};
 
-// Read a field from an object or class.
-void read_field(
-  jvmtiEnv *jvmti,
-  JNIEnv *jni,
-  single_step& step,
-  jclass klass,
-  jfieldID field
-  )
+// How a filter applies to one method: which rules are in scope, and for
+// each variable node, the local variable table entries by that name (a name
+// can be declared in several scopes) or the field to read.
+struct filter_plan
 {
-  // We know we're in an instance if `this` is bound locally.
-  bool is_instance = step.local_state.count("this");
-  jvmtiError error;
+  struct variable
+  {
+    std::vector<uint32_t> locals;
+    int field = -1;
+  };
+  std::vector<uint32_t> rules;
+  std::vector<variable> variables;
+};
 
-  char *_field_name = NULL;
-  char *_field_signature = NULL;
-  char *_field_generic = NULL;
-  error = jvmti->GetFieldName(
-    klass, field, &_field_name, &_field_signature, &_field_generic
-    );
-  check_jvmti_error(jvmti, error, "unable to get class field");
-  std::string field_name(_field_name);
-  std::string field_signature(_field_signature);
-  jvmti->Deallocate((unsigned char *)_field_name);
-  jvmti->Deallocate((unsigned char *)_field_signature);
-  jvmti->Deallocate((unsigned char *)_field_generic);
+// The value of a filter expression. Objects are local references while
+// evaluating, and tags once remembered by `changed`.
+struct filter_value
+{
+  enum kind_type
+  {
+    ABSENT,
+    INTEGER,
+    REAL,
+    OBJECT
+  };
 
-  jint _field_modifiers = 0;
-  error = jvmti->GetFieldModifiers(klass, field, &_field_modifiers);
-  check_jvmti_error(jvmti, error, "unable to get field modifiers");
+  kind_type kind = ABSENT;
+  int64_t integer = 0;
+  double real = 0;
+  jobject object = NULL;
+};
 
-#define FIELD_STATIC_MODIFIER 0x0008
+// What we need to know about a class to capture its objects.
+struct class_info
+{
+  // Arrays and strings are captured by their contents rather than fields.
+  enum kind_type
+  {
+    PLAIN,
+    ARRAY,
+    STRING
+  };
 
-  // Don't do anything if it's an instance field and we're in a static context.
-  bool is_static = _field_modifiers & FIELD_STATIC_MODIFIER;
-  if (!is_static && !is_instance) return;
+  kind_type kind = PLAIN;
+  java_value::java_type element_type = java_value::INT;
+  bool traceable = false;
+  symbol_id class_name = 0;
+  // Instance fields, sorted by name.
+  std::vector<field_reader> fields;
+};
 
-  java_value field_value;
-  java_value::java_type type;
-  jobject _obj = is_instance ? step.local_state["this"].value._object : 0;
-  field_value.signature = field_signature;
+// The last captured version of an object.
+struct object_snapshot
+{
+  uint64_t version = 0;
+  state_map fields;
+  // Arrays and strings are compared by length and a hash of their contents,
+  // and by their contents when the hash matches.
+  uint64_t length = 0;
+  uint64_t hash = 0;
+  std::string contents;
+};
 
-#define READ_FIELD(s_method, i_method, member) {                        \
-    if (is_static) field_value.value.member = (s_method)(klass, field); \
-    else field_value.value.member = (i_method)(_obj, field);            \
-    field_value.type = type;                                            \
-  }
-
-  // yuck
-  // see: http://ftp.magicsoftware.com/www/help/mg9/How/howto_java_vm_type_signatures.htm
-  if (field_signature == "I") {
-    type = java_value::INT;
-    READ_FIELD(jni->GetStaticIntField, jni->GetIntField, _int);
-  } else if (field_signature == "J") {
-    type = java_value::LONG;
-    READ_FIELD(jni->GetStaticLongField, jni->GetLongField, _long);
-  } else if (field_signature == "F") {
-    type = java_value::FLOAT;
-    READ_FIELD(jni->GetStaticFloatField, jni->GetFloatField, _float);
-  } else if (field_signature == "D") {
-    type = java_value::DOUBLE;
-    READ_FIELD(jni->GetStaticDoubleField, jni->GetDoubleField, _double);
-  } else if (field_signature == "Z") {
-    type = java_value::BOOLEAN;
-    READ_FIELD(jni->GetStaticBooleanField, jni->GetBooleanField, _boolean);
-  } else if (field_signature == "B") {
-    type = java_value::BYTE;
-    READ_FIELD(jni->GetStaticByteField, jni->GetByteField, _byte);
-  } else if (field_signature == "C") {
-    type = java_value::CHAR;
-    READ_FIELD(jni->GetStaticCharField, jni->GetCharField, _char);
-  } else if (field_signature == "S") {
-    type = java_value::SHORT;
-    READ_FIELD(jni->GetStaticShortField, jni->GetShortField, _short);
-  } else {
-    type = java_value::OBJECT;
-    READ_FIELD(jni->GetStaticObjectField, jni->GetObjectField, _object);
+// The last state recorded in a frame, for dropping steps that don't change
+// it. Frames are told apart by method and depth, and forgotten when a new
+// call of the method starts at that depth. States are only kept for an
+// exact comparison.
+typedef std::pair<const method_info *, jint> frame_key;
+struct frame_key_hash
+{
+  size_t operator()(const frame_key& key) const
+  {
+    return std::hash<const method_info *>()(key.first) * 31 + key.second;
   }
-
-  if (is_instance) step.instance_state[field_name] = field_value;
-  else step.class_state[field_name] = field_value;
-}
-
-// Cache class and method names in the global scope because these are used by
-// more than one function.
-static std::unordered_map<jmethodID, std::string> method_classes;
-static std::unordered_map<jmethodID, std::string> method_names;
-
-// Single step callback that records state while tracing.
-void JNICALL cb_single_step(
-  jvmtiEnv *jvmti,
-  JNIEnv *jni,
-  jthread thread,
-  jmethodID method,
-  jlocation location
-  )
+};
+struct frame_state
 {
-  // Cache field and local variable tables to not be slow.
-  static std::unordered_map<jmethodID, bool> method_traceable;
-  static std::unordered_map<jmethodID, std::vector<jfieldID>> method_fields;
-  static std::unordered_map<
-    jmethodID,
-    std::vector<jvmtiLocalVariableEntry>
-    > method_local_variables;
-
-  if (!global.jvm_started) return;
-
-  if (method_traceable.count(method) > 0 && !method_traceable[method])
-    return;
-
-  jvmtiError error;
-  jclass klass;
-  error = jvmti->GetMethodDeclaringClass(method, &klass);
-  check_jvmti_error(jvmti, error, "unable to get class");
+  uint64_t fingerprint = 0;
+  state_map local_state;
+  state_map instance_state;
+  state_map class_state;
+};
 
-  // Cache class name.
-  if (method_classes.count(method) == 0) {
-    char *_class_signature = NULL;
-    char *_class_generic = NULL;
-    error = jvmti->GetClassSignature(klass, &_class_signature, &_class_generic);
-    check_jvmti_error(jvmti, error, "unable to get signature");
-    method_classes[method] = _class_signature;
-    jvmti->Deallocate((unsigned char *)_class_signature);
-    jvmti->Deallocate((unsigned char *)_class_generic);
+// Shadow states are keyed by object tag (0 for static fields) and the tag
+// of the class that declares the fields.
+typedef std::pair<jlong, jlong> shadow_key;
+struct shadow_key_hash
+{
+  size_t operator()(const shadow_key& key) const
+  {
+    return std::hash<jlong>()(key.first * 31 + key.second);
   }
+};
 
-  // Ignore classes within the Java stdlib.
-  std::string class_signature(method_classes[method]);
-  for (const auto& prefix : global_java_prefixes) {
-    const auto cmp_substr = class_signature.substr(0, prefix.size());
-    if (cmp_substr == prefix) {
-      method_traceable[method] = false;
-      return;
-    }
-  }
+// Shadow states are split into shards with a lock each, so that threads
+// stepping through different objects don't wait for each other.
+static const size_t global_shadow_shards = 64;
+struct alignas(64) shadow_shard
+{
+  std::mutex lock;
+  std::unordered_map<shadow_key, state_map, shadow_key_hash> shadows;
+};
 
-  // Ignore the receiver class.
-  if (class_signature.size() >= global_jtrace_receiver.size()) {
-    std::string suffix = class_signature.substr(
-      class_signature.size() - global_jtrace_receiver.size()
-      );
-    if (suffix == global_jtrace_receiver) {
-      method_traceable[method] = false;
-      return;
-    }
-  }
+// Per-thread state for deciding which steps to record when sampling.
+struct sampler_state
+{
+  // The method and location of the last step seen, recorded or not.
+  const method_info *method = NULL;
+  jlocation location = 0;
+  // Steps seen since the last recorded one.
+  uint32_t skipped = 0;
+  // Steps seen per method, for recording every Nth.
+  std::unordered_map<const method_info *, uint32_t> counts;
+  // Token bucket for the per-thread rate cap, holding at most a second's
+  // worth of steps.
+  double tokens = 0;
+  std::chrono::steady_clock::time_point refilled;
+  // The adaptive interval between recorded steps, and the time spent in
+  // the agent during the current measuring window.
+  uint32_t interval = 1;
+  uint32_t countdown = 0;
+  std::chrono::steady_clock::time_point window_start;
+  std::chrono::nanoseconds busy{0};
+};
 
-  method_traceable[method] = true;
+// Each thread records steps into its own buffer, which it finds through
+// JVMTI thread-local storage, so recording a step takes no locks.
+struct thread_buffer
+{
+  uint32_t id = 0;
+  // Set while the owning thread is recording a step, so that `end()` can
+  // wait for it to finish.
+  std::atomic<bool> busy{false};
+  // Set once the thread has exited.
+  bool finished = false;
+  // Whether single-step events are enabled for this thread. While the
+  // thread runs code we don't trace, single-stepping is suspended and we
+  // watch method entries instead, in case that code calls back into traced
+  // code. Other threads set this when tracing starts and ends.
+  enum stepping_mode
+  {
+    STEP_OFF,
+    STEP_ON,
+    STEP_SUSPENDED
+  };
+  std::atomic<stepping_mode> stepping{STEP_OFF};
+  step_log steps;
+  // The full state of the last recorded step, which new steps are
+  // compared against, and space to capture the next one. These are swapped
+  // after every step so that capturing reuses their memory.
+  single_step last_step;
+  single_step next_step;
+  std::vector<state_change> changes;
+  bool has_last_step = false;
+  // The method, line and location of the last step, when recording whole
+  // lines.
+  const method_info *line_method = NULL;
+  jint line = 0;
+  jlocation line_location = 0;
+  // Scratch space for copying the contents of arrays and strings.
+  std::string arena;
+  sampler_state sampler;
+  // Method and class cache entries this thread has already looked up.
+  // Classes are keyed by their tag.
+  std::unordered_map<jmethodID, const method_info *> methods;
+  std::unordered_map<jlong, const class_info *> classes;
+  // The last version of every object this thread captured while tracing.
+  // Every thread captures the objects it sees itself, so this needs no
+  // lock. The contents of arrays and strings count toward the memory
+  // budget.
+  std::unordered_map<jlong, object_snapshot> objects;
+  size_t snapshot_bytes = 0;
+  // The last state of each frame, for dropping steps that don't change
+  // state.
+  std::unordered_map<frame_key, frame_state, frame_key_hash> frames;
+  // Filter plans of the methods this thread has stepped through, and the
+  // values `changed` last saw.
+  std::unordered_map<const method_info *, filter_plan> filter_plans;
+  std::vector<filter_value> filter_memory;
+  // When writing to shared memory, the thread's ring (-1 until it claims
+  // one) and the encoder of its trace, which is open from its first step
+  // until tracing ends. Ending the trace may wait for the consumer, so it
+  // takes `shm_lock` rather than `global.threads_lock`.
+  std::mutex shm_lock;
+  int shm_ring = -1;
+  std::string shm_scratch;
+  std::unique_ptr<trace_encoder> shm_encoder;
+  uint64_t shm_dropped = 0;
 
-  // Cache method name.
-  // TODO: include method signature because name does not uniquely
-  // identify methods.
-  if (method_names.count(method) == 0) {
-    char *_method_name = NULL;
-    char *_method_signature = NULL;
-    char *_method_generic = NULL;
-    error = jvmti->GetMethodName(
-      method, &_method_name, &_method_signature, &_method_generic
-      );
-    check_jvmti_error(jvmti, error, "unable to get method name");
-    method_names[method] = _method_name;
-    jvmti->Deallocate((unsigned char *)_method_name);
-    jvmti->Deallocate((unsigned char *)_method_signature);
-    jvmti->Deallocate((unsigned char *)_method_generic);
-  }
+  ~thread_buffer();
+};
 
-  // Cache local variable table.
-  if (method_local_variables.count(method) == 0) {
-    jvmtiLocalVariableEntry *_var_table = NULL;
-    jint _var_entry_count;
-    error = jvmti->GetLocalVariableTable(
-      method, &_var_entry_count, &_var_table
-      );
-    check_jvmti_error(jvmti, error, "unable to get local variable table");
-    method_local_variables[method].assign(
-      _var_table, _var_table + _var_entry_count
-      );
-    jvmti->Deallocate((unsigned char *)_var_table);
-  }
+// The steps of one thread, taken out of its buffer when tracing ends.
+struct thread_trace
+{
+  uint32_t id;
+  step_log steps;
+};
 
-  single_step current_step;
-  current_step.class_name = class_signature;
-  current_step.method_name = method_names[method];
+// Streaming output. Encoded steps are appended to a bounded ring buffer
+// and written out by a background thread, so memory use stays flat no
+// matter how long tracing runs.
+struct stream_sink
+{
+  // What to do with a step when the ring is full.
+  enum full_policy
+  {
+    BLOCK,
+    DROP
+  };
 
-  // Read all local variables.
-  for (const auto& var : method_local_variables[method]) {
-    java_value var_value;
-    var_value.signature = var.signature;
-    bool exists = get_local_variable(
-      jvmti, thread, 0, var.slot, var_value
-      );
-    if (exists)
-      current_step.local_state[std::string(var.name)] = var_value;
-  }
+  FILE *file = NULL;
+  full_policy policy = BLOCK;
+  std::vector<char> ring;
+  size_t head = 0;
+  size_t used = 0;
+  bool writing = false;
+  bool stopping = false;
+  uint64_t dropped = 0;
+  std::mutex lock;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::thread writer;
 
-  // `this` does not behave like other local variables
-  if (current_step.local_state.count("this")) {
-    jobject _this = 0;
-    error = jvmti->GetLocalInstance(thread, 0, &_this);
-    check_jvmti_error(jvmti, error, "unable to get local instance");
-    current_step.local_state["this"].value._object = _this;
-  }
+  // Each traced region is encoded as a separate trace. Threads take turns
+  // encoding so that symbols are always defined before they are used.
+  std::mutex encode_lock;
+  std::string scratch;
+  std::unique_ptr<trace_encoder> encoder;
+};
 
-  // Cache field table.
-  if (method_fields.count(method) == 0) {
-    jfieldID *_field_table = NULL;
-    jint _field_entry_count;
-    error = jvmti->GetClassFields(klass, &_field_entry_count, &_field_table);
-    check_jvmti_error(jvmti, error, "unable to get class field");
-    method_fields[method].assign(
-      _field_table, _field_table + _field_entry_count
-      );
-    jvmti->Deallocate((unsigned char *)_field_table);
-  }
+// Shared memory output. Every thread encodes its own steps into a ring that
+// only it writes to, and jtrace-consume writes them out, so no steps are
+// held in the JVM and recording a step takes no locks.
+struct shm_sink
+{
+  std::string name;
+  shm_region region;
+  bool block = true;
+  // How long a write to a full ring waits once the consumer stops making
+  // progress. Writes don't wait at all once the VM is exiting.
+  std::chrono::milliseconds stall{1000};
+  std::atomic<bool> closing{false};
+  // Steps lost because a trace couldn't be started.
+  std::atomic<uint64_t> lost{0};
+  // Held while a thread claims a ring.
+  std::mutex claim_lock;
+  std::atomic<bool> warned{false};
+};
 
-  // Read all fields.
-  for (const auto& field : method_fields[method])
-    read_field(jvmti, jni, current_step, klass, field);
+// External control of tracing, for applications without a receiver. A
+// background thread polls a control file for commands. A trigger names
+// methods whose entry starts tracing, and limits how many steps or how much
+// time the traced region may take. Results go to the stream, archive or
+// shared memory.
+struct control_state
+{
+  enum trigger_state
+  {
+    IDLE,
+    // Breakpoints are set on the trigger methods.
+    ARMED,
+    RUNNING
+  };
 
-  // If the receiver wants only state changes, we exclude steps that
-  // don't change state.
-  if (
-    global.state_only
-    && global.program_steps.size() > 0
-    && global.program_steps.back() == current_step
-    ) return;
-  global.program_steps.push_back(current_step);
-}
+  std::string path;
+  std::chrono::milliseconds poll{100};
+  JavaVM *jvm = NULL;
+  jvmtiEnv *jvmti = NULL;
+  std::thread watcher;
+  // Held while starting or ending a triggered region.
+  std::mutex lock;
+  std::condition_variable wake;
+  bool stopping = false;
+  std::atomic<trigger_state> state{IDLE};
+  // Limits of the current trigger, 0 for none. Steps are counted by global
+  // sequence number, and tracing stops at `stop_sequence`.
+  uint64_t step_limit = 0;
+  std::chrono::milliseconds time_limit{0};
+  std::atomic<uint64_t> stop_sequence{0};
+  std::atomic<bool> limit_reached{false};
+  std::chrono::steady_clock::time_point started;
+  // The trigger pattern and the methods we set breakpoints on. Class
+  // prepare events only take this lock.
+  std::mutex methods_lock;
+  std::string pattern;
+  std::vector<jmethodID> methods;
+};
 
-// Method entry callback that starts and stops the tracing.
-void JNICALL cb_method_enter(
-  jvmtiEnv *jvmti,
-  JNIEnv *jni,
-  jthread thread,
-  jmethodID method
-  )
+// Results of a traced region that are being delivered to the receiver in
+// chunks. Each chunk covers a range of sequence numbers and is encoded by a
+// pool of worker threads, and a delivery thread hands the chunks to the
+// receiver in order, so `end()` doesn't wait for any of it. A region that
+// ends while the last one is still being delivered is queued behind it, so
+// `start()` doesn't wait either.
+struct delivery_job
 {
-  if (!global.jvm_started) return;
+  JavaVM *jvm = NULL;
+  // The job delivered before this one, until its delivery thread is joined
+  // and the job freed.
+  delivery_job *previous = NULL;
+  // A global reference to the receiver class.
+  jclass receiver = NULL;
+  std::vector<thread_trace> traces;
+  uint64_t truncated_steps = 0;
+  // Chunk `i` holds the steps with sequence numbers from `bounds[i]` up to
+  // `bounds[i + 1]`.
+  std::vector<uint64_t> bounds;
+  std::vector<std::thread> workers;
+  std::thread deliverer;
+  // Workers stay at most `window` chunks ahead of delivery, which bounds
+  // how much encoded output is held at once.
+  std::mutex lock;
+  std::condition_variable changed;
+  size_t window = 0;
+  size_t next_chunk = 0;
+  size_t delivered = 0;
+  std::vector<std::string> chunks;
+  std::vector<size_t> chunk_steps;
+  std::vector<bool> encoded;
+  // Set by the delivery thread once it is done with the VM.
+  bool finished = false;
+};
 
-  jvmtiError error;
-  jclass klass;
-  error = jvmti->GetMethodDeclaringClass(method, &klass);
-  check_jvmti_error(jvmti, error, "unable to get class");
+// Whether this thread is a delivery thread, which calls the receiver's
+// `receive` and so may run into its `start` and `end`.
+static thread_local bool delivery_thread = false;
 
-  // Cache class name.
-  if (method_classes.count(method) == 0) {
-    char *_class_signature = NULL;
-    char *_class_generic = NULL;
-    error = jvmti->GetClassSignature(klass, &_class_signature, &_class_generic);
-    check_jvmti_error(jvmti, error, "unable to get signature");
-    method_classes[method] = _class_signature;
-    jvmti->Deallocate((unsigned char *)_class_signature);
-    jvmti->Deallocate((unsigned char *)_class_generic);
-  }
-
-  // Ignore classes that aren't the receiver.
-  std::string class_signature(method_classes[method]);
-  if (class_signature.size() < global_jtrace_receiver.size()) return;
-  if (
-    class_signature.substr(
-      class_signature.size() - global_jtrace_receiver.size()
-      ) != global_jtrace_receiver
-    ) return;
-
-  // Cache method name.
-  if (method_names.count(method) == 0) {
-    char *_method_name = NULL;
-    char *_method_signature = NULL;
-    char *_method_generic = NULL;
-    error = jvmti->GetMethodName(
-      method, &_method_name, &_method_signature, &_method_generic
-      );
-    check_jvmti_error(jvmti, error, "unable to get method name");
-    method_names[method] = _method_name;
-    jvmti->Deallocate((unsigned char *)_method_name);
-    jvmti->Deallocate((unsigned char *)_method_signature);
-    jvmti->Deallocate((unsigned char *)_method_generic);
-  }
+// How long the VM's death waits for results still being delivered.
+static const std::chrono::seconds global_delivery_exit_wait(5);
 
-  if (method_names[method] == "start") { // Start tracing.
-    if (global.receiver_method == 0) {
-      jmethodID receive_method = jni->GetStaticMethodID(
-        klass, "receive", global_receive_signature.data()
-        );
-      global.receiver_method = receive_method;
-    }
+// Counters for the agent's own performance, kept when `stats` is on.
+enum stat_counter
+{
+  STAT_STEPS_RECORDED,
+  STAT_STEPS_FILTERED,
+  STAT_STEPS_SAMPLED_OUT,
+  STAT_STEPS_REJECTED,
+  STAT_METHOD_THREAD_HITS,
+  STAT_METHOD_SHARED_HITS,
+  STAT_METHOD_MISSES,
+  STAT_CLASS_HITS,
+  STAT_CLASS_MISSES,
+  STAT_JVMTI_GET_LOCAL,
+  STAT_JVMTI_TAG,
+  STAT_JVMTI_FRAME,
+  STAT_JVMTI_EVENT_MODE,
+  STAT_JNI_GET_FIELD,
+  STAT_JNI_ARRAY,
+  STAT_BYTES_SERIALIZED,
+  STAT_COUNTERS
+};
+static const char *const global_stat_names[STAT_COUNTERS] = {
+  "steps_recorded",
+  "steps_filtered",
+  "steps_sampled_out",
+  "steps_rejected",
+  "method_cache_thread_hits",
+  "method_cache_shared_hits",
+  "method_cache_misses",
+  "class_cache_hits",
+  "class_cache_misses",
+  "jvmti_get_local",
+  "jvmti_tag",
+  "jvmti_frame",
+  "jvmti_event_mode",
+  "jni_get_field",
+  "jni_array",
+  "bytes_serialized"
+};
 
-    // Cache the "filterSteps" field.
-    static jfieldID state_only_field = 0;
-    if (state_only_field == 0)
-      state_only_field = jni->GetStaticFieldID(klass, "stateOnly", "Z");
+// Latencies we measure, as histograms of nanoseconds.
+enum stat_latency
+{
+  STAT_SINGLE_STEP,
+  STAT_METHOD_ENTRY,
+  STAT_METHOD_EXIT,
+  STAT_SEND,
+  STAT_LATENCIES
+};
+static const char *const global_latency_names[STAT_LATENCIES] = {
+  "single_step",
+  "method_entry",
+  "method_exit",
+  "send"
+};
 
-    // Check if the receiver wants to filter recorded steps.
-    if (state_only_field)
-      global.state_only = (bool)jni->GetStaticBooleanField(
-        klass, state_only_field
-        );
+// Each thread has its own counters, which only it writes, so counting is a
+// plain load and store. Bucket `i` of a histogram counts latencies below
+// 2^i ns.
+struct agent_stats
+{
+  std::atomic<uint64_t> counters[STAT_COUNTERS] = {};
+  std::atomic<uint64_t> buckets[STAT_LATENCIES][64] = {};
+  std::atomic<uint64_t> total_ns[STAT_LATENCIES] = {};
+  std::atomic<uint64_t> max_ns[STAT_LATENCIES] = {};
+};
 
-    // Enable VM single-step notifications.
-    error = jvmti->SetEventNotificationMode(
-      JVMTI_ENABLE, JVMTI_EVENT_SINGLE_STEP, (jthread) NULL
-      );
-    check_jvmti_error(jvmti, error, "unable to set event notification");
-  } else if (method_names[method] == "end") { // Stop tracing.
-    // Disable VM single-step notifications.
-    error = jvmti->SetEventNotificationMode(
-      JVMTI_DISABLE, JVMTI_EVENT_SINGLE_STEP, (jthread) NULL
-      );
-    check_jvmti_error(jvmti, error, "unable to set event notification");
+// Putting all the global variables in a single struct makes them seem
+// less bad.
+struct global_state
+{
+  bool jvm_started = false;
+  bool state_only = false;
+  symbol_table symbols;
+  // Names we look for while tracing.
+  symbol_id this_symbol = 0;
+  symbol_id return_symbol = 0;
+  bool toml = false;
+  // Record one step per source line instead of one per bytecode.
+  bool line_steps = false;
+  // Record method calls and returns instead of single-stepping.
+  bool call_mode = false;
+  // Confirm that states with the same fingerprint really are the same
+  // before dropping a step.
+  bool exact_compare = false;
+  // Only steps that pass the filter are captured. The receiver's `filter`
+  // takes precedence over the agent option.
+  filter_program *filter = NULL;
+  std::string filter_option;
+  std::string receiver_filter;
+  // Sampling policies for single steps: record every Nth step of each
+  // method, at most `sample_rate` steps per second per thread, and keep the
+  // time spent in the agent under `sample_cpu` of each thread's time. 0
+  // turns a policy off. Method boundaries and loop exits are always
+  // recorded.
+  bool sampling = false;
+  uint32_t sample_every = 0;
+  double sample_rate = 0;
+  double sample_cpu = 0;
+  jmethodID receiver_method = 0;
+  jmethodID receiver_buffer_method = 0;
+  // The `start` and `end` methods of receiver classes, which have
+  // breakpoints. Breakpoints look them up without a thread buffer.
+  std::mutex receivers_lock;
+  std::vector<jmethodID> receiver_starts;
+  std::vector<jmethodID> receiver_ends;
+  // Thread end events are turned on when tracing first starts, and stay on
+  // to free the buffers of threads that recorded steps.
+  bool thread_end_events = false;
+  // Results go to the chunked `receive` if the receiver has one, in chunks
+  // of `chunk_steps` steps encoded by `chunk_workers` threads.
+  jmethodID receiver_chunk_method = 0;
+  size_t chunk_steps = 16384;
+  size_t chunk_workers = 0;
+  delivery_job *delivery = NULL;
+  std::atomic<bool> tracing{false};
+  std::atomic<uint64_t> sequence{0};
+  std::chrono::steady_clock::time_point trace_start;
+  // Every thread that has recorded steps. Only touched when a thread
+  // records its first step, exits, or when tracing ends.
+  std::mutex threads_lock;
+  std::vector<thread_buffer *> threads;
+  uint32_t next_thread_id = 0;
+  // Set while `collect_steps` finishes traces in shared memory without
+  // holding `threads_lock`. Exiting threads don't free their buffers then.
+  bool collecting = false;
+  // Method metadata, shared by all threads.
+  std::shared_timed_mutex methods_lock;
+  std::unordered_map<jmethodID, method_info *> methods;
+  // Objects are identified by JVMTI tags, which are handed out in order.
+  std::mutex tag_lock;
+  jlong next_tag = 1;
+  // Class metadata by class tag, shared by all threads.
+  std::shared_timed_mutex classes_lock;
+  std::unordered_map<jlong, class_info *> classes;
+  // Object versions are numbered from one counter, so that threads that
+  // capture the same object don't reuse each other's version numbers.
+  std::atomic<uint64_t> next_version{1};
+  // When watching fields, class and instance state is kept up to date by
+  // field modification events instead of being read at every step.
+  bool watch_fields = false;
+  // How many references to follow from a step when capturing objects, and
+  // how many elements of arrays and strings to capture. Arrays and strings
+  // are only captured if the depth is at least 1.
+  int capture_depth = 0;
+  jsize capture_elements = 1024;
+  std::shared_timed_mutex watched_fields_lock;
+  std::unordered_map<jfieldID, field_reader> watched_fields;
+  shadow_shard shadows[global_shadow_shards];
+  // Set if steps are streamed to a file instead of sent to the receiver.
+  stream_sink *stream = NULL;
+  // Set if steps are written to shared memory instead of sent to the
+  // receiver.
+  shm_sink *shm = NULL;
+  // Set if tracing can be triggered through a control file.
+  control_state *control = NULL;
+  // Set if steps are written to a seekable archive instead of sent to the
+  // receiver. Each traced region after the first goes to `<path>.<n>`.
+  std::string archive_path;
+  size_t archive_block_size = 64 << 10;
+  uint32_t archive_count = 0;
+  // Memory used by recorded steps, and how much they may use (0 for no
+  // limit). Over budget, threads either spill their steps to disk or stop
+  // recording, in which case we count the steps that weren't recorded.
+  // Captured objects and snapshots can't be spilled, so they are also
+  // counted on their own.
+  std::atomic<size_t> memory_used{0};
+  std::atomic<size_t> object_memory{0};
+  // The most `memory_used` has been since the last stats report.
+  std::atomic<size_t> memory_peak{0};
+  size_t memory_budget = 0;
+  enum budget_policy
+  {
+    SPILL,
+    TRUNCATE
+  };
+  budget_policy over_budget = SPILL;
+  std::atomic<bool> truncating{false};
+  std::atomic<uint64_t> truncated_steps{0};
+  // Performance counters, if `stats` is on. Counters of threads that have
+  // exited are added to `retired_stats`. Reports go to `stats_path` and
+  // the receiver's `stats` method, if either exists.
+  bool stats = false;
+  std::string stats_path;
+  jmethodID receiver_stats_method = 0;
+  // Where the capabilities that tracing needs are added: when the agent
+  // loads, or when tracing first starts. Set if they haven't been added
+  // yet.
+  enum capability_policy
+  {
+    CAPABILITIES_AUTO,
+    CAPABILITIES_LOAD,
+    CAPABILITIES_START
+  };
+  capability_policy capabilities = CAPABILITIES_AUTO;
+  std::atomic<bool> capabilities_pending{false};
+  std::mutex capabilities_lock;
+  std::mutex stats_lock;
+  std::vector<agent_stats *> thread_stats;
+  agent_stats retired_stats;
+};
+static global_state global;
+static thread_local agent_stats *local_stats = NULL;
 
-    // Send trace info to the receiver.
-    send_steps(jni, klass);
+// Count memory used by recorded steps, keeping track of its peak.
+void count_memory(size_t bytes)
+{
+  size_t used = global.memory_used += bytes;
+  size_t peak = global.memory_peak.load(std::memory_order_relaxed);
+  while (used > peak && !global.memory_peak.compare_exchange_weak(peak, used))
+    ;
+}
 
-    // clear program steps
-    global.program_steps.clear();
+// The calling thread's counters.
+agent_stats& thread_stats()
+{
+  if (local_stats == NULL) {
+    local_stats = new agent_stats;
+    std::lock_guard<std::mutex> guard(global.stats_lock);
+    global.thread_stats.push_back(local_stats);
   }
+  return *local_stats;
+}
 
-  return;
+void stat_add(std::atomic<uint64_t>& stat, uint64_t value)
+{
+  stat.store(stat.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
 }
 
-// VM start callback.
-void JNICALL cb_vm_start(jvmtiEnv *jvmti, JNIEnv *jni)
+// Count something, if stats are on.
+inline void count(stat_counter counter, uint64_t value = 1)
 {
-  global.jvm_started = true;
+  if (global.stats) stat_add(thread_stats().counters[counter], value);
 }
 
-// 'OnLoad' callback that initializes everything.
-JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *jvm, char *options, void *reserved)
+// Measures how long a scope takes, if stats are on.
+struct stat_timer
 {
-  jvmtiEnv *jvmti = NULL;
+  stat_latency latency;
+  bool on;
+  std::chrono::steady_clock::time_point start;
 
-  jint res = jvm->GetEnv((void **)&jvmti, JVMTI_VERSION_1_0);
-  if (res != JNI_OK || jvmti == NULL) {
+  explicit stat_timer(stat_latency latency)
+    : latency(latency), on(global.stats)
+  {
+    if (on) start = std::chrono::steady_clock::now();
+  }
+
+  ~stat_timer()
+  {
+    if (!on) return;
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start
+      ).count();
+    int bucket = 0;
+    while (bucket < 63 && (ns >> bucket) != 0) ++bucket;
+    agent_stats& stats = thread_stats();
+    stat_add(stats.buckets[latency][bucket], 1);
+    stat_add(stats.total_ns[latency], ns);
+    if (ns > stats.max_ns[latency].load(std::memory_order_relaxed))
+      stats.max_ns[latency].store(ns, std::memory_order_relaxed);
+  }
+};
+
+// Add one thread's counters to another's.
+void merge_stats(agent_stats& into, const agent_stats& from)
+{
+  auto merge = [](std::atomic<uint64_t>& to, const std::atomic<uint64_t>& value) {
+    stat_add(to, value.load(std::memory_order_relaxed));
+  };
+  for (int i = 0; i < STAT_COUNTERS; ++i) merge(into.counters[i], from.counters[i]);
+  for (int i = 0; i < STAT_LATENCIES; ++i) {
+    for (int j = 0; j < 64; ++j) merge(into.buckets[i][j], from.buckets[i][j]);
+    merge(into.total_ns[i], from.total_ns[i]);
+    uint64_t max = from.max_ns[i].load(std::memory_order_relaxed);
+    if (max > into.max_ns[i].load(std::memory_order_relaxed))
+      into.max_ns[i].store(max, std::memory_order_relaxed);
+  }
+}
+
+void clear_stats(agent_stats& stats)
+{
+  for (auto& counter : stats.counters) counter.store(0, std::memory_order_relaxed);
+  for (int i = 0; i < STAT_LATENCIES; ++i) {
+    for (auto& bucket : stats.buckets[i]) bucket.store(0, std::memory_order_relaxed);
+    stats.total_ns[i].store(0, std::memory_order_relaxed);
+    stats.max_ns[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+// Fold the calling thread's counters into the retired ones when it exits.
+void retire_thread_stats()
+{
+  if (local_stats == NULL) return;
+  std::lock_guard<std::mutex> guard(global.stats_lock);
+  merge_stats(global.retired_stats, *local_stats);
+  global.thread_stats.erase(
+    std::find(global.thread_stats.begin(), global.thread_stats.end(), local_stats)
+    );
+  delete local_stats;
+  local_stats = NULL;
+}
+
+// Write the counters of all threads as TOML and reset them. Other threads
+// may lose a count that races with the reset. Latency percentiles are the
+// upper bounds of their histogram buckets.
+std::string stats_report()
+{
+  agent_stats total;
+  std::lock_guard<std::mutex> guard(global.stats_lock);
+  merge_stats(total, global.retired_stats);
+  clear_stats(global.retired_stats);
+  for (agent_stats *stats : global.thread_stats) {
+    merge_stats(total, *stats);
+    clear_stats(*stats);
+  }
+
+  std::ostringstream output;
+  output << "[stats]" << std::endl;
+  for (int i = 0; i < STAT_COUNTERS; ++i)
+    output << global_stat_names[i] << " = " << total.counters[i] << std::endl;
+  output << "steps_truncated = " << global.truncated_steps << std::endl;
+  output << "memory_peak = " << global.memory_peak.exchange(global.memory_used)
+         << std::endl;
+
+  for (int i = 0; i < STAT_LATENCIES; ++i) {
+    uint64_t samples = 0;
+    for (const auto& bucket : total.buckets[i]) samples += bucket;
+    output
+      << "[stats." << global_latency_names[i] << "]" << std::endl
+      << "count = " << samples << std::endl
+      << "total_ns = " << total.total_ns[i] << std::endl
+      << "max_ns = " << total.max_ns[i] << std::endl;
+    for (int percentile : { 50, 90, 99 }) {
+      uint64_t seen = 0;
+      int bucket = 0;
+      while (bucket < 63
+             && (seen += total.buckets[i][bucket]) * 100 < samples * percentile)
+        ++bucket;
+      output
+        << "p" << percentile << "_ns = "
+        << (samples == 0 ? 0 : (uint64_t)1 << bucket) << std::endl;
+    }
+  }
+  return output.str();
+}
+
+// Write a stats report to the stats file, and send it to the receiver if
+// `jni` is given.
+void report_stats(JNIEnv *jni, jclass receiver)
+{
+  std::string report = stats_report();
+  if (!global.stats_path.empty()) {
+    FILE *file = std::fopen(global.stats_path.c_str(), "ab");
+    if (file == NULL) {
+      std::cerr
+        << "ERROR: jtrace: unable to open " << global.stats_path << std::endl;
+    } else {
+      std::fwrite(report.data(), 1, report.size(), file);
+      std::fclose(file);
+    }
+  }
+
+  if (receiver == NULL || global.receiver_stats_method == 0) return;
+  jstring report_string = jni->NewStringUTF(report.c_str());
+  jni->CallStaticVoidMethod(
+    receiver, global.receiver_stats_method, report_string
+    );
+  jni->DeleteLocalRef(report_string);
+}
+
+template <typename T>
+chunked_log<T>::~chunked_log()
+{
+  for (const auto& chunk : chunks)
+    if (chunk) global.memory_used -= chunk_items * sizeof(T);
+}
+
+template <typename T>
+T& chunked_log<T>::push_back()
+{
+  size_t chunk = count / chunk_items;
+  if (chunk == chunks.size()) {
+    chunks.emplace_back(new T[chunk_items]);
+    count_memory(chunk_items * sizeof(T));
+  }
+  T& item = chunks[chunk][count % chunk_items];
+  ++count;
+  return item;
+}
+
+template <typename T>
+const T& chunked_log<T>::operator[](size_t index) const
+{
+  size_t chunk = index / chunk_items;
+  if (chunk >= spilled) return chunks[chunk][index % chunk_items];
+
+  if (!loaded || loaded_chunk != chunk) {
+    if (!loaded) loaded.reset(new T[chunk_items]);
+    std::fseek(spill_file.get(), chunk * chunk_items * sizeof(T), SEEK_SET);
+    if (std::fread(loaded.get(), sizeof(T), chunk_items, spill_file.get())
+        != chunk_items)
+      std::cerr << "ERROR: unable to read spilled steps" << std::endl;
+    loaded_chunk = chunk;
+  }
+  return loaded[index % chunk_items];
+}
+
+// Write every full chunk that hasn't been spilled yet to the spill file.
+// Returns quietly if there is nothing to spill.
+template <typename T>
+void chunked_log<T>::spill()
+{
+  size_t full = count / chunk_items;
+  if (spilled == full) return;
+  if (!spill_file) {
+    spill_file.reset(std::tmpfile());
+    if (!spill_file) {
+      std::cerr << "ERROR: unable to create spill file" << std::endl;
+      global.truncating = true;
+      return;
+    }
+  }
+
+  std::fseek(spill_file.get(), 0, SEEK_END);
+  for (; spilled < full; ++spilled) {
+    if (std::fwrite(
+          chunks[spilled].get(), sizeof(T), chunk_items, spill_file.get()
+          ) != chunk_items) {
+      std::cerr << "ERROR: unable to spill steps" << std::endl;
+      global.truncating = true;
+      return;
+    }
+    chunks[spilled].reset();
+    global.memory_used -= chunk_items * sizeof(T);
+  }
+  std::fflush(spill_file.get());
+}
+
+step_log::~step_log()
+{
+  global.memory_used -= object_bytes;
+  global.object_memory -= object_bytes;
+}
+
+thread_buffer::~thread_buffer()
+{
+  global.memory_used -= snapshot_bytes;
+  global.object_memory -= snapshot_bytes;
+}
+
+// Symbol table shorthands.
+symbol_id intern(const std::string& name)
+{
+  return global.symbols.intern(name);
+}
+
+const std::string& symbol_name(symbol_id id)
+{
+  return global.symbols.name(id);
+}
+
+// Find a variable in a state by name, or return NULL.
+java_value *find_var(state_map& map, symbol_id name)
+{
+  auto found = std::lower_bound(
+    map.begin(), map.end(), name,
+    [](const java_value& var, symbol_id id) { return var.name < id; }
+    );
+  if (found == map.end() || found->name != name) return NULL;
+  return &*found;
+}
+
+// Sort a freshly captured state by name. If a name was captured twice, the
+// last value wins.
+void sort_state(state_map& map)
+{
+  std::stable_sort(
+    map.begin(), map.end(),
+    [](const java_value& left, const java_value& right) {
+      return left.name < right.name;
+    });
+  auto last = map.begin();
+  for (auto it = map.begin(); it != map.end(); ++it) {
+    if (it + 1 != map.end() && (it + 1)->name == it->name) continue;
+    *last++ = *it;
+  }
+  map.erase(last, map.end());
+}
+
+// We overload this operator to be able to tell whether a variable changed
+// between two steps.
+bool operator==(const java_value& left, const java_value& right)
+{
+  return left.name == right.name
+    && left.type == right.type
+    && left.value._long == right.value._long
+    && left.signature == right.signature;
+}
+
+bool operator!=(const java_value& left, const java_value& right)
+{
+  return !(left == right);
+}
+
+// Append the changes from `before` to `after` in a single scope. Both states
+// are sorted, so this is a single merge pass.
+void diff_state(
+  state_change::scope_type scope,
+  const state_map& before,
+  const state_map& after,
+  std::vector<state_change>& changes
+  )
+{
+  auto left = before.begin();
+  auto right = after.begin();
+  while (left != before.end() || right != after.end()) {
+    if (right == after.end()
+        || (left != before.end() && left->name < right->name)) {
+      java_value removed;
+      removed.name = left->name;
+      changes.push_back(state_change{ scope, true, removed });
+      ++left;
+    } else if (left == before.end() || right->name < left->name) {
+      changes.push_back(state_change{ scope, false, *right });
+      ++right;
+    } else {
+      if (*left != *right)
+        changes.push_back(state_change{ scope, false, *right });
+      ++left;
+      ++right;
+    }
+  }
+}
+
+// Compute the changes between two steps. A keyframe is the difference from
+// an empty step.
+void diff_steps(
+  const single_step& before,
+  const single_step& after,
+  std::vector<state_change>& changes
+  )
+{
+  diff_state(
+    state_change::LOCAL, before.local_state, after.local_state, changes
+    );
+  diff_state(
+    state_change::INSTANCE, before.instance_state, after.instance_state, changes
+    );
+  diff_state(
+    state_change::CLASS, before.class_state, after.class_state, changes
+    );
+}
+
+// Mix the bits of a 64-bit value (the splitmix64 finalizer).
+uint64_t fingerprint_mix(uint64_t x)
+{
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+// Fingerprint the state of a step. Every variable adds a term that mixes
+// its scope, its position in the state, its name and signature and its
+// value, so equal values in other places don't cancel out. Objects must be
+// tagged first.
+uint64_t state_fingerprint(const single_step& step)
+{
+  uint64_t fingerprint = 0;
+  for (state_change::scope_type scope :
+         { state_change::LOCAL, state_change::INSTANCE, state_change::CLASS }) {
+    const state_map& map = scope == state_change::LOCAL ? step.local_state
+      : scope == state_change::INSTANCE ? step.instance_state
+      : step.class_state;
+    for (size_t i = 0; i < map.size(); ++i) {
+      const java_value& value = map[i];
+      uint64_t key = ((uint64_t)value.name << 32 | value.signature) * 4 + scope;
+      uint64_t place = fingerprint_mix(key ^ fingerprint_mix(i));
+      fingerprint += fingerprint_mix(
+        place ^ fingerprint_mix((uint64_t)value.value._long + value.type)
+        );
+    }
+  }
+  return fingerprint;
+}
+
+// Apply the changes from `begin` up to `end` to one scope. Changes are
+// sorted by name like the state.
+void apply_state(
+  state_map& map,
+  const chunked_log<state_change>& changes,
+  uint64_t begin,
+  uint64_t end
+  )
+{
+  if (begin == end) return;
+  state_map result;
+  result.reserve(map.size() + (end - begin));
+  auto var = map.cbegin();
+  for (uint64_t i = begin; i != end; ++i) {
+    // Copied, since reading a spilled change may replace the last one read.
+    state_change change = changes[i];
+    while (var != map.cend() && var->name < change.value.name)
+      result.push_back(*var++);
+    if (var != map.cend() && var->name == change.value.name) ++var;
+    if (!change.removed) result.push_back(change.value);
+  }
+  result.insert(result.end(), var, map.cend());
+  map.swap(result);
+}
+
+// Advance `state` from the previous step to `stored`.
+void apply_step(
+  single_step& state,
+  const step_log& log,
+  const stored_step& stored
+  )
+{
+  state.sequence = stored.sequence;
+  state.time = stored.time;
+  state.event = stored.event;
+  state.skipped = stored.skipped;
+  state.class_name = stored.class_name;
+  state.method_name = stored.method_name;
+  state.method_signature = stored.method_signature;
+  state.source_file = stored.source_file;
+  state.line = stored.line;
+  state.objects.assign(
+    log.objects.begin() + stored.first_object,
+    log.objects.begin() + stored.first_object + stored.object_count
+    );
+  if (stored.keyframe) {
+    state.local_state.clear();
+    state.instance_state.clear();
+    state.class_state.clear();
+  }
+
+  // Changes are grouped by scope in the order `diff_steps` produces them.
+  uint64_t begin = stored.first_change;
+  uint64_t last = stored.first_change + stored.change_count;
+  for (state_change::scope_type scope :
+         { state_change::LOCAL, state_change::INSTANCE, state_change::CLASS }) {
+    uint64_t end = begin;
+    while (end != last && log.changes[end].scope == scope) ++end;
+    state_map& map = scope == state_change::LOCAL ? state.local_state
+      : scope == state_change::INSTANCE ? state.instance_state
+      : state.class_state;
+    apply_state(map, log.changes, begin, end);
+    begin = end;
+  }
+}
+
+// Rebuild the full state of a recorded step from the closest keyframe.
+single_step rebuild_step(const thread_trace& trace, size_t index)
+{
+  single_step state;
+  size_t keyframe = index - index % global_keyframe_interval;
+  for (size_t i = keyframe; i <= index; ++i)
+    apply_step(state, trace.steps, trace.steps.records[i]);
+  state.thread_id = trace.id;
+  return state;
+}
+
+// The index of a thread's first step with a sequence number of at least
+// `sequence`. A thread's steps are in sequence order. The first step of
+// each chunk is indexed, so at most one chunk is searched.
+size_t find_step(const step_log& log, uint64_t sequence)
+{
+  const chunked_log<stored_step>& records = log.records;
+  size_t chunk = std::lower_bound(
+    log.chunk_sequences.begin(), log.chunk_sequences.end(), sequence
+    ) - log.chunk_sequences.begin();
+  if (chunk == 0) return 0;
+  size_t chunk_items = chunked_log<stored_step>::chunk_items;
+  size_t low = (chunk - 1) * chunk_items;
+  size_t high = std::min(chunk * chunk_items, records.size());
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (records[middle].sequence < sequence) low = middle + 1;
+    else high = middle;
+  }
+  return low;
+}
+
+// Walk the steps of all threads in sequence order, rebuilding each one
+// incrementally from the previous step of the same thread. Only steps with
+// sequence numbers from `first` up to `last` are visited.
+template <typename visitor>
+void for_each_step(
+  const std::vector<thread_trace>& traces,
+  visitor visit,
+  uint64_t first = 0,
+  uint64_t last = UINT64_MAX
+  )
+{
+  typedef std::pair<uint64_t, size_t> pending_step;
+  std::priority_queue<
+    pending_step, std::vector<pending_step>, std::greater<pending_step>
+    > pending;
+  std::vector<size_t> next(traces.size(), 0);
+  std::vector<size_t> end(traces.size(), 0);
+  std::vector<single_step> states(traces.size());
+  for (size_t i = 0; i < traces.size(); ++i) {
+    const chunked_log<stored_step>& records = traces[i].steps.records;
+    const step_log& log = traces[i].steps;
+    next[i] = first == 0 ? 0 : find_step(log, first);
+    end[i] = last == UINT64_MAX ? records.size() : find_step(log, last);
+    states[i].thread_id = traces[i].id;
+    if (next[i] >= end[i]) continue;
+    // Starting in the middle, the state is rebuilt from a keyframe.
+    if (next[i] > 0 && !records[next[i]].keyframe)
+      states[i] = rebuild_step(traces[i], next[i] - 1);
+    pending.push(pending_step(records[next[i]].sequence, i));
+  }
+
+  while (!pending.empty()) {
+    size_t i = pending.top().second;
+    pending.pop();
+    const step_log& log = traces[i].steps;
+    apply_step(states[i], log, log.records[next[i]]);
+    visit(states[i]);
+    if (++next[i] < end[i])
+      pending.push(pending_step(log.records[next[i]].sequence, i));
+  }
+}
+
+// Exceptionally rudimentary error handling.
+void check_jvmti_error(
+  jvmtiEnv *jvmti,
+  jvmtiError errnum,
+  const char *str
+  )
+{
+  if (errnum == JVMTI_ERROR_NONE) return;
+
+  char *errnum_str = NULL;
+  jvmti->GetErrorName(errnum, &errnum_str);
+  std::cerr
+    << "ERROR: JVMTI: "
+    << errnum << "("
+    << (errnum_str == NULL ? "Unknown" : errnum_str) << "): "
+    << (str == NULL ? "" : str)
+    << std::endl;
+  jvmti->Deallocate((unsigned char *)errnum_str);
+}
+
+// Serialize a single state_map into TOML.
+void write_state(std::ostream& output, std::string prefix, const state_map& map)
+{
+  for (const auto& var : map) {
+    const std::string& name = symbol_name(var.name);
+    output
+      << prefix << "."
+      << "\"" << name << "\".signature = "
+      << "\"" << symbol_name(var.signature) << "\""
+      << std::endl
+      << prefix << "."
+      << "\"" << name << "\".value = ";
+    switch (var.type) {
+    case java_value::INT: output << var.value._int; break;
+    case java_value::SHORT: output << var.value._short; break;
+    case java_value::LONG: output << var.value._long; break;
+    case java_value::DOUBLE: output << var.value._double; break;
+    case java_value::FLOAT: output << var.value._float; break;
+    case java_value::BOOLEAN: output << var.value._int; break; //
+    case java_value::BYTE: output << (int)var.value._byte; break;
+    case java_value::CHAR: output << var.value._char; break;
+    default: output << var.value._tag;
+    }
+    output << std::endl;
+  }
+}
+
+// Convert a value into its representation in the binary trace format.
+trace_value to_trace_value(const java_value& value)
+{
+  trace_value result;
+  result.type = (trace_type)value.type;
+  switch (value.type) {
+  case java_value::INT: result.bits = (uint64_t)value.value._int; break;
+  case java_value::SHORT: result.bits = (uint64_t)value.value._short; break;
+  case java_value::LONG: result.bits = (uint64_t)value.value._long; break;
+  case java_value::BOOLEAN: result.bits = value.value._boolean; break;
+  case java_value::BYTE: result.bits = (uint64_t)value.value._byte; break;
+  case java_value::CHAR: result.bits = value.value._char; break;
+  case java_value::FLOAT: {
+    uint32_t bits;
+    std::memcpy(&bits, &value.value._float, sizeof(bits));
+    result.bits = bits;
+    break;
+  }
+  case java_value::DOUBLE:
+    std::memcpy(&result.bits, &value.value._double, sizeof(result.bits));
+    break;
+  default: result.bits = (uint64_t)value.value._tag;
+  }
+  return result;
+}
+
+// Serialize a single state_map into the binary trace format.
+void encode_state(trace_encoder& encoder, const state_map& map)
+{
+  encoder.begin_state(map.size());
+  for (const auto& var : map)
+    encoder.var(var.name, var.signature, to_trace_value(var));
+}
+
+// Serialize a single step into the binary trace format.
+void encode_step(trace_encoder& encoder, const single_step& step)
+{
+  // Symbols must be defined before the step that uses them.
+  encoder.symbol(step.class_name, symbol_name(step.class_name));
+  encoder.symbol(step.method_name, symbol_name(step.method_name));
+  encoder.symbol(step.method_signature, symbol_name(step.method_signature));
+  encoder.symbol(step.source_file, symbol_name(step.source_file));
+  for (const state_map *map :
+         { &step.local_state, &step.instance_state, &step.class_state })
+    for (const auto& var : *map) {
+      encoder.symbol(var.name, symbol_name(var.name));
+      encoder.symbol(var.signature, symbol_name(var.signature));
+    }
+  for (const auto& object : step.objects) {
+    encoder.symbol(object.class_name, symbol_name(object.class_name));
+    for (const auto& var : object.fields) {
+      encoder.symbol(var.name, symbol_name(var.name));
+      encoder.symbol(var.signature, symbol_name(var.signature));
+    }
+  }
+
+  for (const auto& object : step.objects) {
+    if (object.is_array) {
+      encoder.array(
+        object.tag,
+        object.version,
+        object.class_name,
+        object.length,
+        (trace_type)object.element_type,
+        object.contents
+        );
+    } else {
+      encoder.object(object.tag, object.version, object.class_name);
+      encode_state(encoder, object.fields);
+    }
+  }
+
+  encoder.begin_step(
+    step.thread_id,
+    step.sequence,
+    step.time,
+    step.event,
+    step.skipped,
+    step.class_name,
+    step.method_name,
+    step.method_signature,
+    step.source_file,
+    step.line
+    );
+  encode_state(encoder, step.local_state);
+  encode_state(encoder, step.instance_state);
+  encode_state(encoder, step.class_state);
+}
+
+// Serialize all recorded steps into the binary trace format.
+void encode_steps(std::string& output, const std::vector<thread_trace>& traces)
+{
+  trace_encoder encoder(output);
+  for_each_step(traces, [&](const single_step& step) {
+      encode_step(encoder, step);
+    });
+  if (global.truncated_steps > 0) encoder.truncated(global.truncated_steps);
+  encoder.end();
+}
+
+// Worker thread that encodes chunks of a delivery job. Each chunk is a
+// complete trace that defines the symbols it uses, and truncation is
+// reported in the last one.
+void delivery_encode(delivery_job *job)
+{
+  size_t chunk_count = job->chunks.size();
+  std::unique_lock<std::mutex> guard(job->lock);
+  while (true) {
+    job->changed.wait(guard, [&] {
+        return job->next_chunk >= chunk_count
+          || job->next_chunk < job->delivered + job->window;
+      });
+    if (job->next_chunk >= chunk_count) {
+      retire_thread_stats();
+      return;
+    }
+    size_t chunk = job->next_chunk++;
+    guard.unlock();
+
+    std::string output;
+    size_t step_count = 0;
+    trace_encoder encoder(output);
+    for_each_step(
+      job->traces,
+      [&](const single_step& step) {
+        encode_step(encoder, step);
+        ++step_count;
+      },
+      job->bounds[chunk],
+      job->bounds[chunk + 1]
+      );
+    if (chunk + 1 == chunk_count && job->truncated_steps > 0)
+      encoder.truncated(job->truncated_steps);
+    encoder.end();
+    count(STAT_BYTES_SERIALIZED, output.size());
+
+    guard.lock();
+    job->chunks[chunk].swap(output);
+    job->chunk_steps[chunk] = step_count;
+    job->encoded[chunk] = true;
+    job->changed.notify_all();
+  }
+}
+
+// Free a job whose delivery thread has been joined, with the jobs before
+// it that haven't been freed yet.
+void delivery_free(JNIEnv *jni, delivery_job *job)
+{
+  while (job) {
+    delivery_job *previous = job->previous;
+    jni->DeleteGlobalRef(job->receiver);
+    delete job;
+    job = previous;
+  }
+}
+
+// Background thread that hands encoded chunks to the receiver in order. It
+// is attached as a regular Java thread, so the VM waits for it to finish
+// before exiting normally. Delivery is timed from here, and stats for the
+// region are reported once it is done. The receiver's global reference is
+// deleted by whoever joins this thread, even if it couldn't attach.
+void delivery_send(delivery_job *job)
+{
+  delivery_thread = true;
+  JNIEnv *jni = NULL;
+  JavaVMAttachArgs args = {
+    JNI_VERSION_1_6, (char *)"jtrace delivery", NULL
+  };
+  jint res = job->jvm->AttachCurrentThread((void **)&jni, &args);
+  if (res != JNI_OK) {
+    std::cerr << "ERROR: jtrace: unable to attach delivery thread" << std::endl;
+    jni = NULL;
+  }
+
+  // Chunks of different regions don't interleave. Without a JNI
+  // environment, the previous job is left for `delivery_wait` to free.
+  if (job->previous) {
+    job->previous->deliverer.join();
+    if (jni != NULL) {
+      delivery_free(jni, job->previous);
+      job->previous = NULL;
+    }
+  }
+  std::unique_ptr<stat_timer> timer(new stat_timer(STAT_SEND));
+
+  size_t chunk_count = job->chunks.size();
+  for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+    std::string output;
+    size_t step_count;
+    {
+      std::unique_lock<std::mutex> guard(job->lock);
+      job->changed.wait(guard, [&] { return job->encoded[chunk]; });
+      output.swap(job->chunks[chunk]);
+      step_count = job->chunk_steps[chunk];
+    }
+
+    // As with the whole trace, the buffer is only valid until the receiver
+    // returns.
+    jobject buffer = jni == NULL ? NULL : jni->NewDirectByteBuffer(
+      (void *)output.data(), (jlong)output.size()
+      );
+    if (buffer == NULL) {
+      if (jni != NULL) jni->ExceptionClear();
+      std::cerr << "ERROR: JNI: unable to allocate direct buffer" << std::endl;
+    } else {
+      jni->CallStaticVoidMethod(
+        job->receiver,
+        global.receiver_chunk_method,
+        buffer,
+        (jint)step_count,
+        (jint)chunk,
+        (jboolean)(chunk + 1 == chunk_count)
+        );
+      // An exception would otherwise be pending in every later call.
+      if (jni->ExceptionCheck()) {
+        jni->ExceptionDescribe();
+        jni->ExceptionClear();
+      }
+      jni->DeleteLocalRef(buffer);
+    }
+
+    std::lock_guard<std::mutex> guard(job->lock);
+    ++job->delivered;
+    job->changed.notify_all();
+  }
+
+  for (auto& worker : job->workers) worker.join();
+  job->traces.clear();
+  timer.reset();
+  if (global.stats) report_stats(jni, jni == NULL ? NULL : job->receiver);
+  retire_thread_stats();
+  if (jni != NULL) job->jvm->DetachCurrentThread();
+
+  std::lock_guard<std::mutex> guard(job->lock);
+  job->finished = true;
+  job->changed.notify_all();
+}
+
+// Wait until the results of every traced region have been delivered.
+// Tracing can't start or end on the delivery thread (see `start_tracing`),
+// so it never waits for itself.
+void delivery_wait(JNIEnv *jni)
+{
+  delivery_job *job = global.delivery;
+  if (job == NULL) return;
+  job->deliverer.join();
+  delivery_free(jni, job);
+  global.delivery = NULL;
+}
+
+// At VM death, the delivery thread may never finish: it is a Java thread,
+// so it can be stuck in the receiver or stopped by the VM on its way out.
+// Wait for it for a while, and otherwise leave it with its job.
+void delivery_wait_at_exit(JNIEnv *jni)
+{
+  delivery_job *job = global.delivery;
+  if (job == NULL) return;
+  bool finished;
+  {
+    std::unique_lock<std::mutex> guard(job->lock);
+    finished = job->changed.wait_for(
+      guard, global_delivery_exit_wait, [&] { return job->finished; }
+      );
+  }
+  if (finished) {
+    delivery_wait(jni);
+    return;
+  }
+  std::cerr << "WARNING: jtrace: results are still being delivered at exit"
+            << std::endl;
+  job->deliverer.detach();
+  global.delivery = NULL;
+}
+
+// Deliver results through the chunked `receive`, taking the traces. Steps
+// are split by sequence number into chunks of about `global.chunk_steps`,
+// which are even as long as few steps were left out of the sequence.
+void delivery_start(
+  JNIEnv *jni,
+  jclass receiver,
+  std::vector<thread_trace>& traces
+  )
+{
+  delivery_job *job = new delivery_job;
+  job->previous = global.delivery;
+  jni->GetJavaVM(&job->jvm);
+  job->receiver = (jclass)jni->NewGlobalRef(receiver);
+  job->truncated_steps = global.truncated_steps;
+  job->traces.swap(traces);
+
+  size_t step_count = 0;
+  uint64_t first = UINT64_MAX;
+  uint64_t last = 0;
+  bool spilled = false;
+  for (const auto& trace : job->traces) {
+    const chunked_log<stored_step>& records = trace.steps.records;
+    if (records.empty()) continue;
+    step_count += records.size();
+    first = std::min(first, records[0].sequence);
+    last = std::max(last, records[records.size() - 1].sequence + 1);
+    spilled = spilled || records.has_spilled()
+      || trace.steps.changes.has_spilled();
+  }
+  if (step_count == 0) first = last = 0;
+
+  size_t chunk_count = std::max<size_t>(
+    1, (step_count + global.chunk_steps - 1) / global.chunk_steps
+    );
+  for (size_t i = 0; i < chunk_count; ++i)
+    job->bounds.push_back(
+      first + (uint64_t)((double)(last - first) * i / chunk_count)
+      );
+  job->bounds.push_back(last);
+  job->chunks.resize(chunk_count);
+  job->chunk_steps.resize(chunk_count);
+  job->encoded.resize(chunk_count);
+
+  size_t worker_count = global.chunk_workers;
+  if (worker_count == 0)
+    worker_count = std::min(
+      4u, std::max(1u, std::thread::hardware_concurrency())
+      );
+  if (spilled) worker_count = 1;
+  worker_count = std::min(worker_count, chunk_count);
+  job->window = 2 * worker_count;
+  for (size_t i = 0; i < worker_count; ++i)
+    job->workers.emplace_back(delivery_encode, job);
+  job->deliverer = std::thread(delivery_send, job);
+  global.delivery = job;
+}
+
+// Send the tracing information to the receiver. Steps from all threads are
+// interleaved in the order they were executed. Chunked delivery takes the
+// traces and finishes in the background.
+void send_steps(
+  JNIEnv *jni,
+  jclass receiver,
+  std::vector<thread_trace>& traces
+  )
+{
+  stat_timer timer(STAT_SEND);
+  size_t step_count = 0;
+  for (const auto& trace : traces) step_count += trace.steps.records.size();
+
+  if (receiver == 0) return;
+
+  // Tell the receiver how many steps didn't fit in the memory budget.
+  static jfieldID truncated_field = 0;
+  if (truncated_field == 0) {
+    truncated_field = jni->GetStaticFieldID(receiver, "truncatedSteps", "J");
+    if (truncated_field == 0) jni->ExceptionClear();
+  }
+  if (truncated_field)
+    jni->SetStaticLongField(
+      receiver, truncated_field, (jlong)global.truncated_steps
+      );
+
+  // Prefer the binary format unless the receiver asked for TOML or can only
+  // accept a string, and chunks over one buffer.
+  bool binary =
+    (global.receiver_buffer_method != 0 || global.receiver_chunk_method != 0)
+    && (!global.toml || global.receiver_method == 0);
+
+  if (binary && global.receiver_chunk_method != 0) {
+    // The delivery thread times the delivery itself.
+    timer.on = false;
+    delivery_start(jni, receiver, traces);
+    return;
+  }
+  if (binary) {
+    std::string output;
+    encode_steps(output, traces);
+    count(STAT_BYTES_SERIALIZED, output.size());
+
+    // The buffer points directly at `output`, so it is only valid until the
+    // receiver returns.
+    jobject buffer = jni->NewDirectByteBuffer(
+      (void *)output.data(), (jlong)output.size()
+      );
+    if (buffer == 0) {
+      jni->ExceptionClear();
+      std::cerr << "ERROR: JNI: unable to allocate direct buffer" << std::endl;
+      return;
+    }
+    jni->CallStaticVoidMethod(
+      receiver,
+      global.receiver_buffer_method,
+      buffer,
+      (jint)step_count
+      );
+    jni->DeleteLocalRef(buffer);
+    return;
+  }
+
+  if (global.receiver_method == 0) return;
+
+  std::ostringstream output;
+  if (global.truncated_steps > 0)
+    output << "truncated = " << global.truncated_steps << std::endl;
+
+  size_t i = 0;
+  for_each_step(traces, [&](const single_step& step) {
+      for (const auto& object : step.objects) {
+        output
+          << "[object." << object.tag << "." << object.version << "]"
+          << std::endl
+          << "class = \"" << symbol_name(object.class_name) << "\""
+          << std::endl;
+        if (object.is_array)
+          trace_write_contents(
+            output,
+            object.length,
+            (trace_type)object.element_type,
+            object.contents,
+            symbol_name(object.class_name) == "Ljava/lang/String;"
+            );
+        else write_state(output, "field", object.fields);
+      }
+      output
+        << "["
+        << "step" << i++ << "."
+        << "\"" << symbol_name(step.class_name) << "\"."
+        << "\"" << symbol_name(step.method_name) << "\""
+        << "]"
+        << std::endl
+        << "thread = " << step.thread_id << std::endl
+        << "sequence = " << step.sequence << std::endl
+        << "time = " << step.time << std::endl
+        << "event = \"" << trace_event_name(step.event) << "\"" << std::endl
+        << "signature = \"" << symbol_name(step.method_signature) << "\""
+        << std::endl
+        << "file = \"" << symbol_name(step.source_file) << "\"" << std::endl
+        << "line = " << step.line << std::endl;
+      if (step.skipped > 0)
+        output << "skipped = " << step.skipped << std::endl;
+      write_state(output, "local", step.local_state);
+      write_state(output, "instance", step.instance_state);
+      write_state(output, "class", step.class_state);
+    });
+
+  // Names reported by JVMTI are already modified UTF-8, which is what
+  // `NewStringUTF` expects.
+  std::string output_toml = output.str();
+  count(STAT_BYTES_SERIALIZED, output_toml.size());
+  jstring output_string = jni->NewStringUTF(output_toml.c_str());
+  jni->CallStaticVoidMethod(
+    receiver,
+    global.receiver_method,
+    output_string,
+    (jint)step_count
+    );
+  jni->DeleteLocalRef(output_string);
+}
+
+// Write all recorded steps to a seekable archive, split into blocks of
+// roughly `global.archive_block_size` bytes before compression.
+void write_archive(const std::vector<thread_trace>& traces)
+{
+  stat_timer timer(STAT_SEND);
+  std::string path = global.archive_path;
+  if (global.archive_count > 0)
+    path += "." + std::to_string(global.archive_count);
+  ++global.archive_count;
+
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (file == NULL) {
+    std::cerr << "ERROR: jtrace: unable to open " << path << std::endl;
+    return;
+  }
+
+  archive_writer writer(file, global.archive_block_size);
+  for_each_step(traces, [&](const single_step& step) {
+      encode_step(writer.encoder(), step);
+      writer.step(step.thread_id, step.time);
+    });
+  // Truncation applies to the whole region, so it is reported in the last
+  // block.
+  if (global.truncated_steps > 0)
+    writer.encoder().truncated(global.truncated_steps);
+  bool ok = writer.close();
+  count(STAT_BYTES_SERIALIZED, std::ftell(file));
+  if (std::fclose(file) != 0 || !ok)
+    std::cerr << "ERROR: jtrace: unable to write " << path << std::endl;
+}
+
+// Background thread that drains the stream ring into the output file.
+void stream_write(stream_sink *stream)
+{
+  std::unique_lock<std::mutex> guard(stream->lock);
+  while (true) {
+    stream->not_empty.wait(
+      guard, [stream] { return stream->used > 0 || stream->stopping; }
+      );
+    if (stream->used == 0) break;
+
+    // Write the contiguous part of the ring without holding the lock.
+    // Producers can't touch it until `used` goes down.
+    size_t size = std::min(stream->used, stream->ring.size() - stream->head);
+    const char *data = stream->ring.data() + stream->head;
+    stream->writing = true;
+    guard.unlock();
+    std::fwrite(data, 1, size, stream->file);
+    std::fflush(stream->file);
+    guard.lock();
+    stream->writing = false;
+    stream->head = (stream->head + size) % stream->ring.size();
+    stream->used -= size;
+    stream->not_full.notify_all();
+  }
+}
+
+// Append encoded bytes to the stream ring. Returns false if they were
+// dropped because the ring is full. `must_block` ignores the drop policy,
+// which we use for trace headers and trailers.
+bool stream_push(stream_sink *stream, const std::string& data, bool must_block)
+{
+  std::unique_lock<std::mutex> guard(stream->lock);
+  size_t capacity = stream->ring.size();
+  if (data.size() > capacity) return false;
+
+  if (stream->policy == stream_sink::BLOCK || must_block)
+    stream->not_full.wait(
+      guard, [&] { return capacity - stream->used >= data.size(); }
+      );
+  else if (capacity - stream->used < data.size())
+    return false;
+
+  size_t tail = (stream->head + stream->used) % capacity;
+  size_t first = std::min(data.size(), capacity - tail);
+  std::memcpy(stream->ring.data() + tail, data.data(), first);
+  std::memcpy(stream->ring.data(), data.data() + first, data.size() - first);
+  stream->used += data.size();
+  stream->not_empty.notify_one();
+  return true;
+}
+
+// Start a new trace in the stream.
+void stream_begin(stream_sink *stream)
+{
+  std::lock_guard<std::mutex> guard(stream->encode_lock);
+  stream->scratch.clear();
+  stream->encoder.reset(new trace_encoder(stream->scratch));
+  stream->dropped = 0;
+  stream_push(stream, stream->scratch, true);
+  stream->scratch.clear();
+}
+
+// Encode a step and append it to the stream.
+void stream_step(stream_sink *stream, const single_step& step)
+{
+  std::lock_guard<std::mutex> guard(stream->encode_lock);
+  trace_mark mark = stream->encoder->mark();
+  encode_step(*stream->encoder, step);
+  count(STAT_BYTES_SERIALIZED, stream->scratch.size());
+  if (!stream_push(stream, stream->scratch, false)) {
+    // Symbols defined by a dropped step have to be defined again later.
+    stream->encoder->rollback(mark);
+    ++stream->dropped;
+  }
+  stream->scratch.clear();
+}
+
+// Finish the current trace and wait until it is all written out.
+void stream_end(stream_sink *stream)
+{
+  std::unique_lock<std::mutex> encode_guard(stream->encode_lock);
+  if (!stream->encoder) return;
+  if (stream->dropped > 0) {
+    stream->encoder->dropped(stream->dropped);
+    std::cerr
+      << "WARNING: jtrace: dropped " << stream->dropped
+      << " steps because the stream ring was full" << std::endl;
+  }
+  stream->encoder->end();
+  stream_push(stream, stream->scratch, true);
+  stream->scratch.clear();
+  stream->encoder.reset();
+  encode_guard.unlock();
+
+  std::unique_lock<std::mutex> guard(stream->lock);
+  stream->not_full.wait(
+    guard, [stream] { return stream->used == 0 && !stream->writing; }
+    );
+}
+
+// Stop the writer thread once everything has been written.
+void stream_stop(stream_sink *stream)
+{
+  {
+    std::lock_guard<std::mutex> guard(stream->lock);
+    stream->stopping = true;
+  }
+  stream->not_empty.notify_one();
+  if (stream->writer.joinable()) stream->writer.join();
+  std::fclose(stream->file);
+  stream->file = NULL;
+}
+
+// Claim a free ring for a thread. Returns false if they are all taken.
+bool shm_claim(shm_sink *shm, thread_buffer& buffer)
+{
+  std::lock_guard<std::mutex> guard(shm->claim_lock);
+  for (uint32_t i = 0; i < shm->region.ring_count(); ++i) {
+    shm_ring& ring = shm->region.ring(i);
+    if (ring.state.load(std::memory_order_acquire) != SHM_RING_FREE) continue;
+    ring.owner = buffer.id;
+    ring.state.store(SHM_RING_ACTIVE, std::memory_order_release);
+    buffer.shm_ring = i;
+    return true;
+  }
+  return false;
+}
+
+// How long a write may wait for the consumer. Steps only wait with
+// `full=block`, but the start and end of a trace always do.
+std::chrono::nanoseconds shm_wait(const shm_sink *shm, bool step)
+{
+  if (shm->closing || (step && !shm->block))
+    return std::chrono::nanoseconds(0);
+  return shm->stall;
+}
+
+// Encode a step into its thread's ring, starting a trace for the thread if
+// this is its first step since tracing started.
+void shm_step(shm_sink *shm, thread_buffer& buffer, const single_step& step)
+{
+  if (buffer.shm_ring < 0 && !shm_claim(shm, buffer)) {
+    if (!shm->warned.exchange(true))
+      std::cerr
+        << "WARNING: jtrace: no free shared memory rings, steps of some "
+        << "threads are not recorded" << std::endl;
+    return;
+  }
+
+  std::string& scratch = buffer.shm_scratch;
+  if (!buffer.shm_encoder) {
+    buffer.shm_encoder.reset(new trace_encoder(scratch));
+    buffer.shm_dropped = 0;
+    bool started = shm_write(
+      shm->region, buffer.shm_ring, scratch.data(), scratch.size(),
+      shm_wait(shm, false)
+      );
+    scratch.clear();
+    // Try again with the next step.
+    if (!started) {
+      buffer.shm_encoder.reset();
+      ++shm->lost;
+      return;
+    }
+  }
+
+  trace_mark mark = buffer.shm_encoder->mark();
+  encode_step(*buffer.shm_encoder, step);
+  count(STAT_BYTES_SERIALIZED, scratch.size());
+  bool written = shm_write(
+    shm->region, buffer.shm_ring, scratch.data(), scratch.size(),
+    shm_wait(shm, true)
+    );
+  if (!written) {
+    // Symbols defined by a dropped step have to be defined again later.
+    buffer.shm_encoder->rollback(mark);
+    ++buffer.shm_dropped;
+  }
+  scratch.clear();
+}
+
+// Give a thread's ring back, retired or broken. The consumer frees it once
+// it is drained.
+void shm_release(
+  shm_sink *shm,
+  thread_buffer& buffer,
+  shm_ring_state state = SHM_RING_RETIRED
+  )
+{
+  if (buffer.shm_ring < 0) return;
+  shm->region.ring(buffer.shm_ring).state.store(
+    state, std::memory_order_release
+    );
+  buffer.shm_ring = -1;
+}
+
+// Finish a thread's trace, if it has one open. Only the thread itself, or
+// `end()` while the thread isn't recording, may call this, with the
+// buffer's `shm_lock` held.
+void shm_end(shm_sink *shm, thread_buffer& buffer)
+{
+  if (!buffer.shm_encoder) return;
+  if (buffer.shm_dropped > 0) {
+    buffer.shm_encoder->dropped(buffer.shm_dropped);
+    std::cerr
+      << "WARNING: jtrace: dropped " << buffer.shm_dropped
+      << " steps because a shared memory ring was full" << std::endl;
+  }
+  buffer.shm_encoder->end();
+  bool written = shm_write(
+    shm->region, buffer.shm_ring, buffer.shm_scratch.data(),
+    buffer.shm_scratch.size(), shm_wait(shm, false)
+    );
+  buffer.shm_scratch.clear();
+  buffer.shm_encoder.reset();
+  // The trace is cut short, so nothing more may follow it in the ring. The
+  // thread claims a new ring for its next trace, which the consumer writes
+  // to a new file.
+  if (!written) {
+    std::cerr
+      << "WARNING: jtrace: unable to finish a trace in shared memory, the "
+      << "consumer isn't reading" << std::endl;
+    shm_release(shm, buffer, SHM_RING_BROKEN);
+  }
+}
+
+// The type we read a local variable as, given its signature. Booleans,
+// bytes, chars and shorts are ints on the stack, and are read with
+// `GetLocalInt`, but keep their own type so that they decode as declared.
+java_value::java_type local_type(const char *signature)
+{
+  switch (signature[0]) {
+  case 'I': return java_value::INT;
+  case 'J': return java_value::LONG;
+  case 'F': return java_value::FLOAT;
+  case 'D': return java_value::DOUBLE;
+  case 'Z': return java_value::BOOLEAN;
+  case 'B': return java_value::BYTE;
+  case 'C': return java_value::CHAR;
+  case 'S': return java_value::SHORT;
+  default: return java_value::OBJECT;
+  }
+}
+
+// The type we read a field as, given its signature.
+// see: http://ftp.magicsoftware.com/www/help/mg9/How/howto_java_vm_type_signatures.htm
+java_value::java_type field_type(const char *signature)
+{
+  switch (signature[0]) {
+  case 'I': return java_value::INT;
+  case 'J': return java_value::LONG;
+  case 'F': return java_value::FLOAT;
+  case 'D': return java_value::DOUBLE;
+  case 'Z': return java_value::BOOLEAN;
+  case 'B': return java_value::BYTE;
+  case 'C': return java_value::CHAR;
+  case 'S': return java_value::SHORT;
+  default: return java_value::OBJECT;
+  }
+}
+
+// Read the value of a local variable.
+// Every variable exists in a specific `slot` (something like an offset)
+// within a stack frame.
+// `depth` is the depth of the stack frame -- `0` reads from the current
+// stack frame, `1` reads from the previous frame, etc.
+bool get_local_variable(
+  jvmtiEnv *jvmti,
+  jthread thread,
+  int depth,
+  const local_variable& var,
+  java_value& value
+  )
+{
+  jvmtiError error;
+  value.name = var.name;
+  value.signature = var.signature;
+  value.type = var.type;
+  count(STAT_JVMTI_GET_LOCAL);
+
+  if (var.is_this) {
+    error = jvmti->GetLocalInstance(thread, depth, &value.value._object);
+  } else {
+    switch (var.type) {
+    case java_value::INT:
+      error = jvmti->GetLocalInt(thread, depth, var.slot, &value.value._int);
+      break;
+    case java_value::LONG:
+      error = jvmti->GetLocalLong(thread, depth, var.slot, &value.value._long);
+      break;
+    case java_value::FLOAT:
+      error = jvmti->GetLocalFloat(
+        thread, depth, var.slot, &value.value._float
+        );
+      break;
+    case java_value::DOUBLE:
+      error = jvmti->GetLocalDouble(
+        thread, depth, var.slot, &value.value._double
+        );
+      break;
+    case java_value::BOOLEAN:
+    case java_value::BYTE:
+    case java_value::CHAR:
+    case java_value::SHORT: {
+      jint bits = 0;
+      error = jvmti->GetLocalInt(thread, depth, var.slot, &bits);
+      // The rest of the union is compared and fingerprinted too.
+      value.value._long = 0;
+      switch (var.type) {
+      case java_value::BOOLEAN: value.value._boolean = (jboolean)bits; break;
+      case java_value::BYTE: value.value._byte = (jbyte)bits; break;
+      case java_value::CHAR: value.value._char = (jchar)bits; break;
+      default: value.value._short = (jshort)bits;
+      }
+      break;
+    }
+    default:
+      error = jvmti->GetLocalObject(
+        thread, depth, var.slot, &value.value._object
+        );
+    }
+  }
+
+  if (error == JVMTI_ERROR_INVALID_SLOT) return false;
+  check_jvmti_error(jvmti, error, "unable to get local variable");
+  return true;
+}
+
+// Read a field from a class, or from `object` if it is an instance field.
+void read_field(
+  JNIEnv *jni,
+  jclass klass,
+  jobject object,
+  const field_reader& reader,
+  java_value& value
+  )
+{
+  value.name = reader.name;
+  value.signature = reader.signature;
+  value.type = reader.type;
+  count(STAT_JNI_GET_FIELD);
+
+#define READ_FIELD(s_method, i_method, member) {                        \
+    if (reader.is_static)                                               \
+      value.value.member = jni->s_method(klass, reader.field);          \
+    else value.value.member = jni->i_method(object, reader.field);      \
+  }
+
+  switch (reader.type) {
+  case java_value::INT: READ_FIELD(GetStaticIntField, GetIntField, _int); break;
+  case java_value::LONG:
+    READ_FIELD(GetStaticLongField, GetLongField, _long);
+    break;
+  case java_value::FLOAT:
+    READ_FIELD(GetStaticFloatField, GetFloatField, _float);
+    break;
+  case java_value::DOUBLE:
+    READ_FIELD(GetStaticDoubleField, GetDoubleField, _double);
+    break;
+  case java_value::BOOLEAN:
+    READ_FIELD(GetStaticBooleanField, GetBooleanField, _boolean);
+    break;
+  case java_value::BYTE:
+    READ_FIELD(GetStaticByteField, GetByteField, _byte);
+    break;
+  case java_value::CHAR:
+    READ_FIELD(GetStaticCharField, GetCharField, _char);
+    break;
+  case java_value::SHORT:
+    READ_FIELD(GetStaticShortField, GetShortField, _short);
+    break;
+  default: READ_FIELD(GetStaticObjectField, GetObjectField, _object);
+  }
+
+#undef READ_FIELD
+}
+
+// Whether a step has the same state as the last step recorded in the same
+// frame on its thread, going by their fingerprints. Steps that capture new
+// object versions, calls and returns always count as changes. With an exact
+// comparison, a matching fingerprint is only trusted if the frame's last
+// state really is the same.
+bool unchanged_state(thread_buffer& buffer, const single_step& step)
+{
+  if (step.event != TRACE_EVENT_STEP) return false;
+  uint64_t fingerprint = state_fingerprint(step);
+  auto inserted = buffer.frames.insert(
+    std::make_pair(frame_key(step.method, step.depth), frame_state())
+    );
+  frame_state& frame = inserted.first->second;
+  bool unchanged = !inserted.second && frame.fingerprint == fingerprint
+    && step.objects.empty()
+    && (!global.exact_compare
+        || (frame.local_state == step.local_state
+            && frame.instance_state == step.instance_state
+            && frame.class_state == step.class_state));
+  if (unchanged) return true;
+
+  frame.fingerprint = fingerprint;
+  if (global.exact_compare) {
+    frame.local_state = step.local_state;
+    frame.instance_state = step.instance_state;
+    frame.class_state = step.class_state;
+  }
+  return false;
+}
+
+// Forget the last state of a frame at its first bytecode, which starts a
+// new call of its method, so that a call isn't compared with the previous
+// call at the same depth. A loop back to the first bytecode only records
+// one step more than needed.
+void forget_frame(
+  jvmtiEnv *jvmti,
+  thread_buffer& buffer,
+  jthread thread,
+  const method_info& info
+  )
+{
+  jint depth = 0;
+  count(STAT_JVMTI_FRAME);
+  jvmtiError error = jvmti->GetFrameCount(thread, &depth);
+  check_jvmti_error(jvmti, error, "unable to get frame count");
+  buffer.frames.erase(frame_key(&info, depth));
+}
+
+// Whether a triggered region has recorded as many steps as it may. The
+// first thread to notice wakes the control thread to end the region.
+bool control_limit_reached(control_state& control)
+{
+  uint64_t stop = control.stop_sequence;
+  if (stop == 0 || global.sequence < stop) return false;
+  if (!control.limit_reached.exchange(true)) control.wake.notify_one();
+  return true;
+}
+
+// Record a captured step into the thread's buffer, the stream or shared
+// memory.
+void record_step(thread_buffer& buffer, single_step& current_step)
+{
+  // If the receiver wants only state changes, we exclude steps that don't
+  // change state.
+  if (global.state_only && unchanged_state(buffer, current_step)) {
+    count(STAT_STEPS_FILTERED);
+    return;
+  }
+
+  // Once over budget, count the steps we would have recorded.
+  if (!global.stream && !global.shm && global.truncating) {
+    ++global.truncated_steps;
+    return;
+  }
+
+  // Steps past the limit of a triggered region are dropped until the
+  // control thread ends it.
+  if (global.control && control_limit_reached(*global.control)) return;
+
+  // Steps we keep in memory are stored as what changed since the thread's
+  // last step.
+  std::vector<state_change>& changes = buffer.changes;
+  changes.clear();
+  if (!global.stream && !global.shm)
+    diff_steps(
+      buffer.has_last_step ? buffer.last_step : single_step(),
+      current_step,
+      changes
+      );
+
+  count(STAT_STEPS_RECORDED);
+  current_step.thread_id = buffer.id;
+  current_step.sequence = global.sequence++;
+  current_step.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - global.trace_start
+    ).count();
+
+  if (global.stream) {
+    stream_step(global.stream, current_step);
+  } else if (global.shm) {
+    shm_step(global.shm, buffer, current_step);
+  } else {
+    step_log& log = buffer.steps;
+    bool keyframe = log.records.size() % global_keyframe_interval == 0;
+    if (keyframe && buffer.has_last_step) {
+      changes.clear();
+      diff_steps(single_step(), current_step, changes);
+    }
+
+    if (log.records.size() % chunked_log<stored_step>::chunk_items == 0)
+      log.chunk_sequences.push_back(current_step.sequence);
+    stored_step& stored = log.records.push_back();
+    stored.sequence = current_step.sequence;
+    stored.time = current_step.time;
+    stored.event = current_step.event;
+    stored.skipped = current_step.skipped;
+    stored.class_name = current_step.class_name;
+    stored.method_name = current_step.method_name;
+    stored.method_signature = current_step.method_signature;
+    stored.source_file = current_step.source_file;
+    stored.line = current_step.line;
+    stored.keyframe = keyframe;
+    stored.first_change = log.changes.size();
+    stored.change_count = changes.size();
+    for (const auto& change : changes) log.changes.push_back() = change;
+    stored.first_object = log.objects.size();
+    stored.object_count = current_step.objects.size();
+    for (auto& object : current_step.objects) {
+      size_t bytes = sizeof(object_version) + object.contents.size()
+        + object.fields.size() * sizeof(java_value);
+      log.object_bytes += bytes;
+      count_memory(bytes);
+      global.object_memory += bytes;
+      log.objects.push_back(std::move(object));
+    }
+    current_step.objects.clear();
+
+    if (global.memory_budget != 0
+        && global.memory_used > global.memory_budget) {
+      if (global.over_budget == global_state::SPILL) {
+        // Captured objects and snapshots stay in memory, so once they
+        // alone are over budget, spilling can't help and we truncate.
+        log.records.spill();
+        log.changes.spill();
+        if (global.object_memory > global.memory_budget)
+          global.truncating = true;
+      } else {
+        global.truncating = true;
+      }
+    }
+  }
+
+  std::swap(buffer.last_step, current_step);
+  buffer.has_last_step = true;
+}
+
+// Find a thread's buffer, or NULL if it has none yet.
+thread_buffer *find_thread_buffer(jvmtiEnv *jvmti, jthread thread)
+{
+  void *data = NULL;
+  jvmtiError error = jvmti->GetThreadLocalStorage(thread, &data);
+  check_jvmti_error(jvmti, error, "unable to get thread local storage");
+  return (thread_buffer *)data;
+}
+
+// Find the calling thread's buffer, creating it on first use. Buffers are
+// only created while tracing, by the thread's first event. Threads that
+// single-step are already stepping by then.
+thread_buffer *get_thread_buffer(jvmtiEnv *jvmti, jthread thread)
+{
+  thread_buffer *buffer = find_thread_buffer(jvmti, thread);
+  if (buffer) return buffer;
+
+  jvmtiError error;
+  buffer = new thread_buffer;
+  if (!global.call_mode) buffer->stepping = thread_buffer::STEP_ON;
+  {
+    std::lock_guard<std::mutex> guard(global.threads_lock);
+    buffer->id = global.next_thread_id++;
+    global.threads.push_back(buffer);
+  }
+  error = jvmti->SetThreadLocalStorage(thread, buffer);
+  check_jvmti_error(jvmti, error, "unable to set thread local storage");
+  return buffer;
+}
+
+// Take every thread's steps out of its buffer, and finish its trace in
+// shared memory. Buffers of threads that have exited are freed.
+std::vector<thread_trace> collect_steps()
+{
+  std::vector<thread_trace> traces;
+  std::unique_lock<std::mutex> guard(global.threads_lock);
+  auto last = global.threads.begin();
+  for (thread_buffer *buffer : global.threads) {
+    // Wait for the thread to finish recording its current step.
+    while (buffer->busy) std::this_thread::yield();
+
+    if (!buffer->steps.records.empty())
+      traces.push_back(thread_trace{ buffer->id, std::move(buffer->steps) });
+    buffer->steps = step_log();
+    buffer->has_last_step = false;
+    buffer->line_method = NULL;
+    buffer->sampler = sampler_state();
+    buffer->frames.clear();
+    buffer->filter_plans.clear();
+    buffer->filter_memory.clear();
+    // The next trace captures every object afresh.
+    buffer->objects.clear();
+    global.memory_used -= buffer->snapshot_bytes;
+    global.object_memory -= buffer->snapshot_bytes;
+    buffer->snapshot_bytes = 0;
+
+    if (buffer->finished) delete buffer;
+    else *last++ = buffer;
+  }
+  global.threads.erase(last, global.threads.end());
+
+  // Finishing traces in shared memory may wait for the consumer, so new
+  // threads and exiting ones don't wait for it. Threads that exit
+  // meanwhile finish their own trace, and their buffers are freed here.
+  if (global.shm) {
+    std::vector<thread_buffer *> threads = global.threads;
+    global.collecting = true;
+    guard.unlock();
+    for (thread_buffer *buffer : threads) {
+      std::lock_guard<std::mutex> shm_guard(buffer->shm_lock);
+      shm_end(global.shm, *buffer);
+    }
+    guard.lock();
+    global.collecting = false;
+    auto last = global.threads.begin();
+    for (thread_buffer *buffer : global.threads) {
+      if (buffer->finished && buffer->steps.records.empty()) delete buffer;
+      else *last++ = buffer;
+    }
+    global.threads.erase(last, global.threads.end());
+  }
+
+  // Shadow states are only kept up to date while tracing.
+  global.next_version = 1;
+  for (shadow_shard& shard : global.shadows) {
+    std::lock_guard<std::mutex> shard_guard(shard.lock);
+    shard.shadows.clear();
+  }
+  return traces;
+}
+
+// Whether a class is the receiver, from its signature.
+bool is_receiver_class(const std::string& class_signature)
+{
+  if (class_signature.size() < global_jtrace_receiver.size()) return false;
+  return class_signature.compare(
+    class_signature.size() - global_jtrace_receiver.size(),
+    global_jtrace_receiver.size(),
+    global_jtrace_receiver
+    ) == 0;
+}
+
+// Whether we trace code in a class. We ignore classes within the Java stdlib
+// and the receiver class.
+bool is_traceable_class(const std::string& class_signature)
+{
+  if (is_receiver_class(class_signature)) return false;
+  for (const auto& prefix : global_java_prefixes)
+    if (class_signature.compare(0, prefix.size(), prefix) == 0)
+      return false;
+  return true;
+}
+
+// Whether a JVMTI error just means that the information isn't there, like
+// the local variable table of a class compiled without `-g`.
+bool is_absent_information(jvmtiError error)
+{
+  return error == JVMTI_ERROR_ABSENT_INFORMATION
+    || error == JVMTI_ERROR_NATIVE_METHOD;
+}
+
+// Index a method's local variables by the locations where they are in
+// scope, so that steps only read variables that exist.
+void build_scopes(method_info& info)
+{
+  for (const auto& var : info.local_variables) {
+    info.scope_starts.push_back(var.start);
+    info.scope_starts.push_back(var.end);
+  }
+  std::sort(info.scope_starts.begin(), info.scope_starts.end());
+  info.scope_starts.erase(
+    std::unique(info.scope_starts.begin(), info.scope_starts.end()),
+    info.scope_starts.end()
+    );
+
+  for (jlocation start : info.scope_starts) {
+    info.scope_offsets.push_back(info.scope_variables.size());
+    for (uint32_t i = 0; i < info.local_variables.size(); ++i) {
+      const local_variable& var = info.local_variables[i];
+      if (var.start <= start && start < var.end)
+        info.scope_variables.push_back(i);
+    }
+  }
+  info.scope_offsets.push_back(info.scope_variables.size());
+}
+
+// Find the range of `scope_variables` that is in scope at `location`.
+std::pair<const uint32_t *, const uint32_t *> variables_in_scope(
+  const method_info& info,
+  jlocation location
+  )
+{
+  auto found = std::upper_bound(
+    info.scope_starts.begin(), info.scope_starts.end(), location
+    );
+  if (found == info.scope_starts.begin()) return std::make_pair(nullptr, nullptr);
+  size_t range = found - info.scope_starts.begin() - 1;
+  const uint32_t *variables = info.scope_variables.data();
+  return std::make_pair(
+    variables + info.scope_offsets[range],
+    variables + info.scope_offsets[range + 1]
+    );
+}
+
+// Find the tag that identifies an object, tagging it if we haven't seen it
+// before. Tags are never reused and follow objects as the GC moves them, so
+// they identify objects across steps. `0` is null.
+jlong object_tag(jvmtiEnv *jvmti, jobject object)
+{
+  if (object == 0) return 0;
+  jlong tag = 0;
+  count(STAT_JVMTI_TAG);
+  jvmtiError error = jvmti->GetTag(object, &tag);
+  check_jvmti_error(jvmti, error, "unable to get object tag");
+  if (tag != 0) return tag;
+
+  // Another thread may be tagging the same object.
+  std::lock_guard<std::mutex> guard(global.tag_lock);
+  error = jvmti->GetTag(object, &tag);
+  check_jvmti_error(jvmti, error, "unable to get object tag");
+  count(STAT_JVMTI_TAG);
+  if (tag == 0) {
+    count(STAT_JVMTI_TAG);
+    tag = global.next_tag++;
+    error = jvmti->SetTag(object, tag);
+    check_jvmti_error(jvmti, error, "unable to set object tag");
+  }
+  return tag;
+}
+
+// Find the tag of an object without tagging it. `0` is null or untagged.
+jlong existing_tag(jvmtiEnv *jvmti, jobject object)
+{
+  if (object == 0) return 0;
+  jlong tag = 0;
+  count(STAT_JVMTI_TAG);
+  jvmtiError error = jvmti->GetTag(object, &tag);
+  check_jvmti_error(jvmti, error, "unable to get object tag");
+  return tag;
+}
+
+// Ask to be told about writes to the fields of a class.
+void watch_fields(
+  jvmtiEnv *jvmti,
+  jclass klass,
+  const std::vector<field_reader>& fields
+  )
+{
+  {
+    std::lock_guard<std::shared_timed_mutex> guard(global.watched_fields_lock);
+    for (const auto& field : fields)
+      global.watched_fields.insert(std::make_pair(field.field, field));
+  }
+
+  for (const auto& field : fields) {
+    jvmtiError error = jvmti->SetFieldModificationWatch(klass, field.field);
+    if (error != JVMTI_ERROR_DUPLICATE)
+      check_jvmti_error(jvmti, error, "unable to watch field");
+  }
+}
+
+// Build readers for the fields declared by a class, in no particular
+// order.
+std::vector<field_reader> build_declared_fields(jvmtiEnv *jvmti, jclass klass)
+{
+  std::vector<field_reader> fields;
+  jvmtiError error;
+  jlong class_tag = object_tag(jvmti, klass);
+
+  jfieldID *_field_table = NULL;
+  jint _field_entry_count = 0;
+  error = jvmti->GetClassFields(klass, &_field_entry_count, &_field_table);
+  check_jvmti_error(jvmti, error, "unable to get class field");
+  for (jint i = 0; i < _field_entry_count; ++i) {
+    jfieldID field = _field_table[i];
+    char *_field_name = NULL;
+    char *_field_signature = NULL;
+    char *_field_generic = NULL;
+    error = jvmti->GetFieldName(
+      klass, field, &_field_name, &_field_signature, &_field_generic
+      );
+    check_jvmti_error(jvmti, error, "unable to get class field");
+
+    jint _field_modifiers = 0;
+    error = jvmti->GetFieldModifiers(klass, field, &_field_modifiers);
+    check_jvmti_error(jvmti, error, "unable to get field modifiers");
+
+#define FIELD_STATIC_MODIFIER 0x0008
+
+    fields.push_back(field_reader{
+        field,
+        intern(_field_name),
+        intern(_field_signature),
+        field_type(_field_signature),
+        (_field_modifiers & FIELD_STATIC_MODIFIER) != 0,
+        class_tag
+      });
+    jvmti->Deallocate((unsigned char *)_field_name);
+    jvmti->Deallocate((unsigned char *)_field_signature);
+    jvmti->Deallocate((unsigned char *)_field_generic);
+  }
+  jvmti->Deallocate((unsigned char *)_field_table);
+  return fields;
+}
+
+// Build readers for the fields of a class: the static fields it declares,
+// and the instance fields it declares or inherits from traced
+// superclasses. Inherited fields hidden by a field of the same name are
+// kept for shadow states, but marked hidden. When watching fields, writes
+// to all of them are watched.
+std::vector<field_reader> build_field_readers(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  jclass klass,
+  bool watch
+  )
+{
+  std::vector<field_reader> fields;
+  jvmtiError error;
+  jclass level = klass;
+  while (true) {
+    std::vector<field_reader> declared = build_declared_fields(jvmti, level);
+    if (level != klass)
+      declared.erase(
+        std::remove_if(
+          declared.begin(), declared.end(),
+          [](const field_reader& field) { return field.is_static; }
+          ),
+        declared.end()
+        );
+    for (auto& field : declared)
+      for (const auto& other : fields)
+        if (other.name == field.name) field.hidden = true;
+    if (watch) watch_fields(jvmti, level, declared);
+    fields.insert(fields.end(), declared.begin(), declared.end());
+
+    jclass super = jni->GetSuperclass(level);
+    if (level != klass) jni->DeleteLocalRef(level);
+    if (super == NULL) break;
+    char *_super_signature = NULL;
+    error = jvmti->GetClassSignature(super, &_super_signature, NULL);
+    check_jvmti_error(jvmti, error, "unable to get signature");
+    bool traced = _super_signature != NULL
+      && is_traceable_class(_super_signature);
+    jvmti->Deallocate((unsigned char *)_super_signature);
+    if (!traced) {
+      jni->DeleteLocalRef(super);
+      break;
+    }
+    level = super;
+  }
+
+  // Field names are unique within a class, so states built by reading
+  // the fields that aren't hidden in this order are already sorted.
+  std::stable_sort(
+    fields.begin(), fields.end(),
+    [](const field_reader& left, const field_reader& right) {
+      return left.name < right.name;
+    });
+
+  return fields;
+}
+
+// Find the source line of a location in a method.
+jint line_at(const method_info& info, jlocation location)
+{
+  auto found = std::upper_bound(
+    info.lines.begin(), info.lines.end(), location,
+    [](jlocation location, const jvmtiLineNumberEntry& entry) {
+      return location < entry.start_location;
+    });
+  if (found == info.lines.begin()) return 0;
+  return (found - 1)->line_number;
+}
+
+// Read a big-endian signed integer from bytecode.
+int32_t read_branch_offset(const unsigned char *code, int bytes)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < bytes; ++i) value = (value << 8) | code[i];
+  if (bytes == 2) return (int16_t)value;
+  return (int32_t)value;
+}
+
+// Find the loops, returns and throws in a method's bytecode.
+// see: https://docs.oracle.com/javase/specs/jvms/se8/html/jvms-6.html
+void scan_bytecodes(const unsigned char *code, jint size, method_info& info)
+{
+  jint pc = 0;
+  while (pc < size) {
+    unsigned char op = code[pc];
+    jint length = 1;
+    int32_t branch = 0;
+    if ((op >= 0x99 && op <= 0xa8) || op == 0xc6 || op == 0xc7) {
+      // if<cond>, goto, jsr, ifnull and ifnonnull.
+      length = 3;
+      if (pc + 2 < size) branch = read_branch_offset(code + pc + 1, 2);
+    } else if (op == 0xc8 || op == 0xc9) {
+      // goto_w and jsr_w.
+      length = 5;
+      if (pc + 4 < size) branch = read_branch_offset(code + pc + 1, 4);
+    } else if (op == 0xaa || op == 0xab) {
+      // tableswitch and lookupswitch are padded to a multiple of 4 bytes.
+      jint operands = (pc + 4) & ~3;
+      if (operands + 12 > size) break;
+      if (op == 0xaa) {
+        int32_t low = read_branch_offset(code + operands + 4, 4);
+        int32_t high = read_branch_offset(code + operands + 8, 4);
+        length = operands - pc + 12 + (high - low + 1) * 4;
+      } else {
+        int32_t pairs = read_branch_offset(code + operands + 4, 4);
+        length = operands - pc + 8 + pairs * 8;
+      }
+    } else if (op == 0xc4) {
+      // wide iinc has a two byte constant.
+      length = pc + 1 < size && code[pc + 1] == 0x84 ? 6 : 4;
+    } else if (op == 0xb9 || op == 0xba) {
+      length = 5;
+    } else if (op == 0xc5) {
+      length = 4;
+    } else if (op == 0x11 || op == 0x13 || op == 0x14 || op == 0x84
+               || (op >= 0xb2 && op <= 0xb8) || op == 0xbb || op == 0xbd
+               || op == 0xc0 || op == 0xc1) {
+      length = 3;
+    } else if (op == 0x10 || op == 0x12 || (op >= 0x15 && op <= 0x19)
+               || (op >= 0x36 && op <= 0x3a) || op == 0xa9 || op == 0xbc) {
+      length = 2;
+    }
+
+    if (branch < 0) info.loops.push_back(std::make_pair(pc + branch, pc));
+    if ((op >= 0xac && op <= 0xb1) || op == 0xbf) info.exits.push_back(pc);
+    if (length <= 0) break;
+    pc += length;
+  }
+}
+
+// Build the metadata for a method.
+method_info *build_method_info(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  jmethodID method
+  )
+{
+  method_info *info = new method_info;
+  jvmtiError error;
+
+  jclass klass;
+  error = jvmti->GetMethodDeclaringClass(method, &klass);
+  check_jvmti_error(jvmti, error, "unable to get class");
+
+  char *_class_signature = NULL;
+  char *_class_generic = NULL;
+  error = jvmti->GetClassSignature(klass, &_class_signature, &_class_generic);
+  check_jvmti_error(jvmti, error, "unable to get signature");
+  info->class_name = intern(_class_signature);
+  jvmti->Deallocate((unsigned char *)_class_signature);
+  jvmti->Deallocate((unsigned char *)_class_generic);
+
+  // Methods of untraced classes are only looked at again by name if they
+  // belong to the receiver, so skip the rest of the lookups for the others.
+  const std::string& class_signature = symbol_name(info->class_name);
+  info->traceable = is_traceable_class(class_signature);
+  if (!info->traceable && !is_receiver_class(class_signature)) return info;
+
+  // Methods are identified by name and signature, since names alone can be
+  // overloaded.
+  char *_method_name = NULL;
+  char *_method_signature = NULL;
+  char *_method_generic = NULL;
+  error = jvmti->GetMethodName(
+    method, &_method_name, &_method_signature, &_method_generic
+    );
+  check_jvmti_error(jvmti, error, "unable to get method name");
+  info->method_name = intern(_method_name);
+  info->method_signature = intern(_method_signature);
+  const char *return_signature = std::strrchr(_method_signature, ')') + 1;
+  if (*return_signature != 'V') {
+    info->return_signature = intern(return_signature);
+    info->return_type = field_type(return_signature);
+  }
+  jvmti->Deallocate((unsigned char *)_method_name);
+  jvmti->Deallocate((unsigned char *)_method_signature);
+  jvmti->Deallocate((unsigned char *)_method_generic);
+
+  if (!info->traceable) return info;
+
+  // Local variable table.
+  jvmtiLocalVariableEntry *_var_table = NULL;
+  jint _var_entry_count = 0;
+  error = jvmti->GetLocalVariableTable(method, &_var_entry_count, &_var_table);
+  if (!is_absent_information(error))
+    check_jvmti_error(jvmti, error, "unable to get local variable table");
+  for (jint i = 0; i < _var_entry_count; ++i) {
+    symbol_id var_name = intern(_var_table[i].name);
+    info->local_variables.push_back(local_variable{
+        var_name,
+        intern(_var_table[i].signature),
+        local_type(_var_table[i].signature),
+        _var_table[i].slot,
+        var_name == global.this_symbol,
+        _var_table[i].start_location,
+        _var_table[i].start_location + _var_table[i].length
+      });
+    jvmti->Deallocate((unsigned char *)_var_table[i].name);
+    jvmti->Deallocate((unsigned char *)_var_table[i].signature);
+    jvmti->Deallocate((unsigned char *)_var_table[i].generic_signature);
+  }
+  jvmti->Deallocate((unsigned char *)_var_table);
+  build_scopes(*info);
+
+  // Line number table and source file.
+  jvmtiLineNumberEntry *_line_table = NULL;
+  jint _line_entry_count = 0;
+  error = jvmti->GetLineNumberTable(method, &_line_entry_count, &_line_table);
+  if (!is_absent_information(error))
+    check_jvmti_error(jvmti, error, "unable to get line number table");
+  info->lines.assign(_line_table, _line_table + _line_entry_count);
+  jvmti->Deallocate((unsigned char *)_line_table);
+  std::sort(
+    info->lines.begin(), info->lines.end(),
+    [](const jvmtiLineNumberEntry& left, const jvmtiLineNumberEntry& right) {
+      return left.start_location < right.start_location;
+    });
+
+  char *_source_file = NULL;
+  error = jvmti->GetSourceFileName(klass, &_source_file);
+  if (!is_absent_information(error))
+    check_jvmti_error(jvmti, error, "unable to get source file name");
+  info->source_file = intern(_source_file ? _source_file : "");
+  jvmti->Deallocate((unsigned char *)_source_file);
+
+  if (global.sampling) {
+    unsigned char *_bytecodes = NULL;
+    jint _bytecode_count = 0;
+    error = jvmti->GetBytecodes(method, &_bytecode_count, &_bytecodes);
+    if (!is_absent_information(error))
+      check_jvmti_error(jvmti, error, "unable to get bytecodes");
+    if (_bytecodes) scan_bytecodes(_bytecodes, _bytecode_count, *info);
+    jvmti->Deallocate(_bytecodes);
+  }
+
+  info->fields = build_field_readers(jvmti, jni, klass, global.watch_fields);
+  info->class_tag = object_tag(jvmti, klass);
+  info->field_classes.push_back(info->class_tag);
+  for (const auto& field : info->fields)
+    if (std::find(
+          info->field_classes.begin(), info->field_classes.end(),
+          field.class_tag
+          ) == info->field_classes.end())
+      info->field_classes.push_back(field.class_tag);
+  info->klass = (jclass)jni->NewGlobalRef(klass);
+
+  return info;
+}
+
+// Find the metadata for a method. Each thread remembers the methods it has
+// seen, so the shared cache is only consulted once per thread and method.
+const method_info *get_method_info(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  thread_buffer& buffer,
+  jmethodID method
+  )
+{
+  auto cached = buffer.methods.find(method);
+  if (cached != buffer.methods.end()) {
+    count(STAT_METHOD_THREAD_HITS);
+    return cached->second;
+  }
+
+  const method_info *info = NULL;
+  {
+    std::shared_lock<std::shared_timed_mutex> guard(global.methods_lock);
+    auto found = global.methods.find(method);
+    if (found != global.methods.end()) info = found->second;
+  }
+
+  if (info) {
+    count(STAT_METHOD_SHARED_HITS);
+  } else {
+    count(STAT_METHOD_MISSES);
+    // Build the entry without holding the lock. If another thread got there
+    // first, use theirs.
+    method_info *built = build_method_info(jvmti, jni, method);
+    std::lock_guard<std::shared_timed_mutex> guard(global.methods_lock);
+    auto inserted = global.methods.insert(std::make_pair(method, built));
+    if (!inserted.second) delete built;
+    info = inserted.first->second;
+  }
+
+  buffer.methods[method] = info;
+  return info;
+}
+
+// Build the metadata for a class.
+class_info *build_class_info(jvmtiEnv *jvmti, JNIEnv *jni, jclass klass)
+{
+  class_info *info = new class_info;
+  jvmtiError error;
+
+  char *_class_signature = NULL;
+  char *_class_generic = NULL;
+  error = jvmti->GetClassSignature(klass, &_class_signature, &_class_generic);
+  check_jvmti_error(jvmti, error, "unable to get signature");
+  info->class_name = intern(_class_signature);
+  jvmti->Deallocate((unsigned char *)_class_signature);
+  jvmti->Deallocate((unsigned char *)_class_generic);
+
+  info->traceable = is_traceable_class(symbol_name(info->class_name));
+  const std::string& class_signature = symbol_name(info->class_name);
+  if (class_signature[0] == '[') {
+    info->kind = class_info::ARRAY;
+    info->element_type = field_type(class_signature.c_str() + 1);
+  } else if (class_signature == "Ljava/lang/String;") {
+    info->kind = class_info::STRING;
+  }
+  if (!info->traceable) return info;
+
+  for (const auto& field : build_field_readers(jvmti, jni, klass, false))
+    if (!field.is_static && !field.hidden) info->fields.push_back(field);
+  return info;
+}
+
+// Find the metadata for a class. Classes are keyed by their tag. Like
+// methods, each thread remembers the classes it has seen.
+const class_info *get_class_info(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  thread_buffer& buffer,
+  jclass klass
+  )
+{
+  jlong tag = object_tag(jvmti, klass);
+  auto cached = buffer.classes.find(tag);
+  if (cached != buffer.classes.end()) {
+    count(STAT_CLASS_HITS);
+    return cached->second;
+  }
+
+  const class_info *info = NULL;
+  {
+    std::shared_lock<std::shared_timed_mutex> guard(global.classes_lock);
+    auto found = global.classes.find(tag);
+    if (found != global.classes.end()) info = found->second;
+  }
+
+  if (info) {
+    count(STAT_CLASS_HITS);
+  } else {
+    count(STAT_CLASS_MISSES);
+    class_info *built = build_class_info(jvmti, jni, klass);
+    std::lock_guard<std::shared_timed_mutex> guard(global.classes_lock);
+    auto inserted = global.classes.insert(std::make_pair(tag, built));
+    if (!inserted.second) delete built;
+    info = inserted.first->second;
+  }
+
+  buffer.classes[tag] = info;
+  return info;
+}
+
+// FNV-1a hash of the contents of an array or string.
+uint64_t content_hash(const std::string& contents)
+{
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : contents) {
+    hash ^= (uint8_t)c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+void capture_reference(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  thread_buffer& buffer,
+  jobject object,
+  jlong tag,
+  int level,
+  single_step& step
+  );
+
+// Replace a local reference read while capturing an object with its tag,
+// following it if we haven't reached the capture depth.
+jlong capture_element(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  thread_buffer& buffer,
+  jobject object,
+  int level,
+  single_step& step
+  )
+{
+  jlong tag = object_tag(jvmti, object);
+  if (object == 0) return tag;
+  if (level < global.capture_depth)
+    capture_reference(jvmti, jni, buffer, object, tag, level + 1, step);
+  jni->DeleteLocalRef(object);
+  return tag;
+}
+
+// Capture the fields of an object, if they changed since we last captured
+// them.
+void capture_fields(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  thread_buffer& buffer,
+  jobject object,
+  jlong tag,
+  const class_info& info,
+  int level,
+  single_step& step
+  )
+{
+  state_map fields;
+  fields.reserve(info.fields.size());
+  for (const auto& field : info.fields) {
+    java_value value;
+    read_field(jni, 0, object, field, value);
+    if (value.type == java_value::OBJECT)
+      value.value._tag = capture_element(
+        jvmti, jni, buffer, value.value._object, level, step
+        );
+    fields.push_back(value);
+  }
+
+  object_snapshot& snapshot = buffer.objects[tag];
+  if (snapshot.version != 0 && snapshot.fields == fields) return;
+  snapshot.version = global.next_version++;
+  snapshot.fields = fields;
+  object_version version;
+  version.tag = tag;
+  version.version = snapshot.version;
+  version.class_name = info.class_name;
+  version.fields = std::move(fields);
+  step.objects.push_back(std::move(version));
+}
+
+// Capture the contents of an array or string, if they changed since we last
+// captured them. Primitive arrays and strings are copied in bulk into the
+// thread's arena and only copied out if they changed.
+void capture_contents(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  thread_buffer& buffer,
+  jobject object,
+  jlong tag,
+  const class_info& info,
+  int level,
+  single_step& step
+  )
+{
+  // Following the elements of object arrays may capture other arrays, which
+  // use the arena.
+  std::string elements;
+  std::string& contents = info.kind == class_info::ARRAY
+    && info.element_type == java_value::OBJECT ? elements : buffer.arena;
+  contents.clear();
+
+  jsize length = 0;
+  if (info.kind == class_info::STRING) {
+    jstring string = (jstring)object;
+    length = jni->GetStringLength(string);
+    jsize count = std::min(length, global.capture_elements);
+    // Modified UTF-8 takes at most 3 bytes per char.
+    contents.resize(3 * count + 1);
+    jni->GetStringUTFRegion(string, 0, count, &contents[0]);
+    contents.resize(std::strlen(contents.data()));
+    ::count(STAT_JNI_ARRAY, 2);
+  } else {
+    jarray array = (jarray)object;
+    length = jni->GetArrayLength(array);
+    jsize count = std::min(length, global.capture_elements);
+    ::count(STAT_JNI_ARRAY, 2);
+
+#define COPY_ARRAY(type, array_type, method) {                          \
+      contents.resize(count * sizeof(type));                            \
+      if (count > 0)                                                    \
+        jni->method((array_type)array, 0, count, (type *)&contents[0]); \
+    }
+
+    switch (info.element_type) {
+    case java_value::INT: COPY_ARRAY(jint, jintArray, GetIntArrayRegion); break;
+    case java_value::LONG:
+      COPY_ARRAY(jlong, jlongArray, GetLongArrayRegion);
+      break;
+    case java_value::FLOAT:
+      COPY_ARRAY(jfloat, jfloatArray, GetFloatArrayRegion);
+      break;
+    case java_value::DOUBLE:
+      COPY_ARRAY(jdouble, jdoubleArray, GetDoubleArrayRegion);
+      break;
+    case java_value::BOOLEAN:
+      COPY_ARRAY(jboolean, jbooleanArray, GetBooleanArrayRegion);
+      break;
+    case java_value::BYTE:
+      COPY_ARRAY(jbyte, jbyteArray, GetByteArrayRegion);
+      break;
+    case java_value::CHAR:
+      COPY_ARRAY(jchar, jcharArray, GetCharArrayRegion);
+      break;
+    case java_value::SHORT:
+      COPY_ARRAY(jshort, jshortArray, GetShortArrayRegion);
+      break;
+    default:
+      for (jsize i = 0; i < count; ++i) {
+        jobject element = jni->GetObjectArrayElement((jobjectArray)array, i);
+        ::count(STAT_JNI_ARRAY);
+        trace_put_varint(
+          contents,
+          (uint64_t)capture_element(jvmti, jni, buffer, element, level, step)
+          );
+      }
+    }
+
+#undef COPY_ARRAY
+  }
+
+  uint64_t hash = content_hash(contents);
+  object_snapshot& snapshot = buffer.objects[tag];
+  if (snapshot.version != 0
+      && snapshot.length == (uint64_t)length
+      && snapshot.hash == hash
+      && snapshot.contents == contents)
+    return;
+  snapshot.version = global.next_version++;
+  snapshot.length = length;
+  snapshot.hash = hash;
+  // The snapshot takes the arena's buffer, and the arena reuses the old
+  // snapshot's. The version needs its own copy, since the snapshot changes
+  // with the next version.
+  snapshot.contents.swap(contents);
+  size_t grown = snapshot.contents.size() - contents.size();
+  buffer.snapshot_bytes += grown;
+  count_memory(grown);
+  global.object_memory += grown;
+  object_version version;
+  version.tag = tag;
+  version.version = snapshot.version;
+  version.class_name = info.class_name;
+  version.is_array = true;
+  version.length = length;
+  version.element_type = info.kind == class_info::STRING
+    ? java_value::CHAR : info.element_type;
+  version.contents = snapshot.contents;
+  step.objects.push_back(std::move(version));
+}
+
+// Capture an object that is `level` references away from a step. Objects of
+// traced classes are always captured if the step refers to them directly.
+// Arrays, strings and objects further away are captured up to the capture
+// depth. Objects of other classes are only identified.
+void capture_reference(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  thread_buffer& buffer,
+  jobject object,
+  jlong tag,
+  int level,
+  single_step& step
+  )
+{
+  jclass klass = jni->GetObjectClass(object);
+  const class_info *info = get_class_info(jvmti, jni, buffer, klass);
+  jni->DeleteLocalRef(klass);
+
+  if (info->kind != class_info::PLAIN) {
+    if (level <= global.capture_depth)
+      capture_contents(jvmti, jni, buffer, object, tag, *info, level, step);
+  } else if (info->traceable && level <= std::max(1, global.capture_depth)) {
+    capture_fields(jvmti, jni, buffer, object, tag, *info, level, step);
+  }
+}
+
+// Replace the object references in one scope of a step's state with tags,
+// capturing the objects along the way.
+void capture_objects(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  thread_buffer& buffer,
+  state_map& map,
+  single_step& step
+  )
+{
+  for (auto& var : map) {
+    if (var.type != java_value::OBJECT) continue;
+    jobject object = var.value._object;
+    var.value._tag = object_tag(jvmti, object);
+    if (object == 0) continue;
+    // `this` is already captured as the instance state.
+    if (var.name != global.this_symbol)
+      capture_reference(jvmti, jni, buffer, object, var.value._tag, 1, step);
+    jni->DeleteLocalRef(object);
+  }
+}
+
+// The shard that holds a shadow state.
+shadow_shard& get_shadow_shard(const shadow_key& key)
+{
+  return global.shadows[shadow_key_hash()(key) % global_shadow_shards];
+}
+
+// Append the fields of one shadow state that aren't hidden to `state`.
+void copy_fields(
+  const method_info& info,
+  state_map& shadow,
+  const shadow_key& key,
+  bool is_static,
+  state_map& state
+  )
+{
+  for (const auto& field : info.fields) {
+    if (field.is_static != is_static || field.class_tag != key.second
+        || field.hidden)
+      continue;
+    const java_value *value = find_var(shadow, field.name);
+    if (value) state.push_back(*value);
+  }
+}
+
+// Append one shadow state to `state`. A shadow holds the static fields of a
+// class, or the instance fields one class declares in an object. Its fields
+// are read the first time the class or object is seen while tracing.
+void copy_shadow(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  const method_info& info,
+  jobject object,
+  const shadow_key& key,
+  bool is_static,
+  state_map& state
+  )
+{
+  shadow_shard& shard = get_shadow_shard(key);
+  {
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto found = shard.shadows.find(key);
+    if (found != shard.shadows.end()) {
+      copy_fields(info, found->second, key, is_static, state);
+      return;
+    }
+  }
+
+  // Fields are read without the shard's lock, so that field modifications
+  // on other threads don't wait for JNI. If another thread got there first,
+  // its shadow is kept.
+  state_map shadow;
+  for (const auto& field : info.fields) {
+    if (field.is_static != is_static || field.class_tag != key.second)
+      continue;
+    java_value value;
+    read_field(jni, info.klass, object, field, value);
+    if (value.type == java_value::OBJECT) {
+      jobject field_object = value.value._object;
+      value.value._tag = object_tag(jvmti, field_object);
+      if (field_object) jni->DeleteLocalRef(field_object);
+    }
+    shadow.push_back(value);
+  }
+  std::lock_guard<std::mutex> guard(shard.lock);
+  auto found = shard.shadows.emplace(key, std::move(shadow)).first;
+  copy_fields(info, found->second, key, is_static, state);
+}
+
+// Copy the class and instance state of a step from their shadows. A write
+// by another thread that races with the first read of a shadow can be
+// missed. Object values in shadow states are already tags.
+void read_shadow_state(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  const method_info& info,
+  jobject object,
+  single_step& step
+  )
+{
+  step.class_state.clear();
+  step.instance_state.clear();
+  copy_shadow(
+    jvmti, jni, info, object, shadow_key(0, info.class_tag), true,
+    step.class_state
+    );
+  if (object != 0) {
+    jlong tag = object_tag(jvmti, object);
+    for (jlong class_tag : info.field_classes)
+      copy_shadow(
+        jvmti, jni, info, object, shadow_key(tag, class_tag), false,
+        step.instance_state
+        );
+    if (info.field_classes.size() > 1) sort_state(step.instance_state);
+  }
+}
+
+// Clears a thread buffer's `busy` flag when a callback returns.
+struct busy_guard
+{
+  thread_buffer *buffer;
+  explicit busy_guard(thread_buffer *buffer) : buffer(buffer)
+  {
+    buffer->busy = true;
+  }
+  ~busy_guard() { buffer->busy = false; }
+};
+
+// Change the single-stepping mode of one thread.
+void set_stepping(
+  jvmtiEnv *jvmti,
+  thread_buffer& buffer,
+  jthread thread,
+  thread_buffer::stepping_mode mode
+  )
+{
+  thread_buffer::stepping_mode old_mode = buffer.stepping.exchange(mode);
+  if (old_mode == mode) return;
+  jvmtiError error;
+
+  bool was_stepping = old_mode == thread_buffer::STEP_ON;
+  bool stepping = mode == thread_buffer::STEP_ON;
+  if (was_stepping != stepping) {
+    count(STAT_JVMTI_EVENT_MODE);
+    error = jvmti->SetEventNotificationMode(
+      stepping ? JVMTI_ENABLE : JVMTI_DISABLE, JVMTI_EVENT_SINGLE_STEP, thread
+      );
+    check_jvmti_error(jvmti, error, "unable to set event notification");
+  }
+
+  bool was_watching = old_mode == thread_buffer::STEP_SUSPENDED;
+  bool watching = mode == thread_buffer::STEP_SUSPENDED;
+  if (was_watching != watching) {
+    count(STAT_JVMTI_EVENT_MODE);
+    error = jvmti->SetEventNotificationMode(
+      watching ? JVMTI_ENABLE : JVMTI_DISABLE, JVMTI_EVENT_METHOD_ENTRY, thread
+      );
+    check_jvmti_error(jvmti, error, "unable to set event notification");
+  }
+}
+
+// Stop single-stepping a thread that has entered a method we don't trace,
+// until that method's frame returns. Without this, every bytecode of
+// library code would still cost us a callback.
+void suspend_stepping(jvmtiEnv *jvmti, thread_buffer& buffer, jthread thread)
+{
+  // The frame may already have a pending notification if a traced callee
+  // returned into it.
+  count(STAT_JVMTI_FRAME);
+  jvmtiError error = jvmti->NotifyFramePop(thread, 0);
+  if (error == JVMTI_ERROR_OPAQUE_FRAME) return;
+  if (error != JVMTI_ERROR_DUPLICATE)
+    check_jvmti_error(jvmti, error, "unable to request frame pop");
+  set_stepping(jvmti, buffer, thread, thread_buffer::STEP_SUSPENDED);
+}
+
+// Change the single-stepping mode of every live thread.
+void set_stepping_all(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  thread_buffer::stepping_mode mode
+  )
+{
+  jint thread_count = 0;
+  jthread *threads = NULL;
+  jvmtiError error = jvmti->GetAllThreads(&thread_count, &threads);
+  check_jvmti_error(jvmti, error, "unable to get threads");
+  for (jint i = 0; i < thread_count; ++i) {
+    // Threads without a buffer have never stepped through traced code, and
+    // get one when they first do.
+    thread_buffer *buffer = find_thread_buffer(jvmti, threads[i]);
+    if (buffer) {
+      set_stepping(jvmti, *buffer, threads[i], mode);
+    } else {
+      count(STAT_JVMTI_EVENT_MODE);
+      error = jvmti->SetEventNotificationMode(
+        mode == thread_buffer::STEP_ON ? JVMTI_ENABLE : JVMTI_DISABLE,
+        JVMTI_EVENT_SINGLE_STEP, threads[i]
+        );
+      check_jvmti_error(jvmti, error, "unable to set event notification");
+    }
+    jni->DeleteLocalRef(threads[i]);
+  }
+  jvmti->Deallocate((unsigned char *)threads);
+}
+
+// Whether a step must be recorded even when sampling: the first step in a
+// method after a call or return, returns and throws, and the first step
+// after leaving a loop.
+bool is_boundary(
+  const sampler_state& sampler,
+  const method_info& info,
+  jlocation location
+  )
+{
+  if (sampler.method != &info) return true;
+  if (std::binary_search(info.exits.begin(), info.exits.end(), location))
+    return true;
+  for (const auto& loop : info.loops) {
+    bool was_inside = loop.first <= sampler.location
+      && sampler.location <= loop.second;
+    bool inside = loop.first <= location && location <= loop.second;
+    if (was_inside && !inside) return true;
+  }
+  return false;
+}
+
+// Whether sampling lets a step that isn't a boundary through. Every policy
+// that is turned on has to agree.
+bool sample_step(sampler_state& sampler, const method_info& info)
+{
+  if (global.sample_every > 1
+      && ++sampler.counts[&info] % global.sample_every != 0)
+    return false;
+
+  if (global.sample_rate > 0) {
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - sampler.refilled;
+    sampler.refilled = now;
+    sampler.tokens = std::min(
+      global.sample_rate, sampler.tokens + elapsed.count() * global.sample_rate
+      );
+    if (sampler.tokens < 1) return false;
+    sampler.tokens -= 1;
+  }
+
+  if (global.sample_cpu > 0) {
+    if (sampler.countdown > 0) {
+      --sampler.countdown;
+      return false;
+    }
+    sampler.countdown = sampler.interval - 1;
+  }
+  return true;
+}
+
+// Measures the time a thread spends in the single step callback, and
+// adapts its sampling interval to keep that under the CPU target. The
+// interval doubles while the agent is over target and halves while it is
+// well under.
+struct cpu_meter
+{
+  sampler_state *sampler;
+  std::chrono::steady_clock::time_point start;
+
+  explicit cpu_meter(sampler_state *sampler) : sampler(sampler)
+  {
+    if (sampler) start = std::chrono::steady_clock::now();
+  }
+
+  ~cpu_meter()
+  {
+    if (!sampler) return;
+    auto now = std::chrono::steady_clock::now();
+    sampler->busy += now - start;
+
+    static const std::chrono::milliseconds window(10);
+    auto elapsed = now - sampler->window_start;
+    if (elapsed < window) return;
+    double share = (double)sampler->busy.count()
+      / std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    if (share > global.sample_cpu && sampler->interval < (1u << 20))
+      sampler->interval *= 2;
+    else if (share < global.sample_cpu / 2 && sampler->interval > 1)
+      sampler->interval /= 2;
+    sampler->window_start = now;
+    sampler->busy = std::chrono::nanoseconds(0);
+  }
+};
+
+// Start capturing the next step of a thread in `info`'s method.
+single_step& begin_step(
+  thread_buffer& buffer,
+  const method_info& info,
+  trace_event event,
+  jint line
+  )
+{
+  single_step& step = buffer.next_step;
+  step.local_state.clear();
+  step.instance_state.clear();
+  step.class_state.clear();
+  step.objects.clear();
+  step.event = event;
+  step.skipped = 0;
+  step.method = &info;
+  step.depth = 0;
+  step.class_name = info.class_name;
+  step.method_name = info.method_name;
+  step.method_signature = info.method_signature;
+  step.source_file = info.source_file;
+  step.line = line;
+  return step;
+}
+
+// Read the local variables of the current frame that are in scope at
+// `location`.
+void read_locals(
+  jvmtiEnv *jvmti,
+  jthread thread,
+  const method_info& info,
+  jlocation location,
+  single_step& step
+  )
+{
+  auto scope = variables_in_scope(info, location);
+  step.local_state.reserve(scope.second - scope.first);
+  for (const uint32_t *it = scope.first; it != scope.second; ++it) {
+    java_value var_value;
+    const local_variable& var = info.local_variables[*it];
+    if (!get_local_variable(jvmti, thread, 0, var, var_value)) continue;
+    step.local_state.push_back(var_value);
+  }
+  sort_state(step.local_state);
+}
+
+// Record a call to a traced method. Its arguments are the local variables
+// in scope where it begins.
+void record_call(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  thread_buffer& buffer,
+  jthread thread,
+  const method_info& info
+  )
+{
+  single_step& current_step = begin_step(
+    buffer, info, TRACE_EVENT_CALL, line_at(info, 0)
+    );
+  read_locals(jvmti, thread, info, 0, current_step);
+  capture_objects(jvmti, jni, buffer, current_step.local_state, current_step);
+  record_step(buffer, current_step);
+}
+
+// Record a return from a traced method, with its return value unless it
+// is void or threw.
+void record_return(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  thread_buffer& buffer,
+  jthread thread,
+  const method_info& info,
+  bool threw,
+  jvalue return_value
+  )
+{
+  jmethodID method;
+  jlocation location;
+  count(STAT_JVMTI_FRAME);
+  jvmtiError error = jvmti->GetFrameLocation(thread, 0, &method, &location);
+  check_jvmti_error(jvmti, error, "unable to get frame location");
+  single_step& current_step = begin_step(
+    buffer, info, TRACE_EVENT_RETURN, line_at(info, location)
+    );
+
+  if (info.return_signature != 0 && !threw) {
+    java_value value;
+    value.name = global.return_symbol;
+    value.signature = info.return_signature;
+    value.type = info.return_type;
+    switch (info.return_type) {
+    case java_value::INT: value.value._int = return_value.i; break;
+    case java_value::LONG: value.value._long = return_value.j; break;
+    case java_value::FLOAT: value.value._float = return_value.f; break;
+    case java_value::DOUBLE: value.value._double = return_value.d; break;
+    case java_value::BOOLEAN: value.value._boolean = return_value.z; break;
+    case java_value::BYTE: value.value._byte = return_value.b; break;
+    case java_value::CHAR: value.value._char = return_value.c; break;
+    case java_value::SHORT: value.value._short = return_value.s; break;
+    default: value.value._object = return_value.l;
+    }
+    current_step.local_state.push_back(value);
+    capture_objects(
+      jvmti, jni, buffer, current_step.local_state, current_step
+      );
+  }
+  record_step(buffer, current_step);
+}
+
+// The Java name of a class, like `com.example.Server`, from its signature.
+std::string java_class_name(const std::string& class_signature)
+{
+  std::string name = class_signature.substr(1, class_signature.size() - 2);
+  std::replace(name.begin(), name.end(), '/', '.');
+  return name;
+}
+
+// Compile the filter for the next traced region, unless it is the one we
+// already have. Invalid filters are reported and ignored.
+void use_filter(const std::string& source)
+{
+  if (global.filter && global.filter->source == source) return;
+  delete global.filter;
+  global.filter = NULL;
+  if (source.empty()) return;
+
+  filter_program *program = new filter_program;
+  std::string error;
+  if (!compile_filter(source, *program, global.symbols, error)) {
+    std::cerr << "ERROR: jtrace: invalid filter: " << error << std::endl;
+    delete program;
+    return;
+  }
+  global.filter = program;
+}
+
+// Resolve how the filter applies to a method, the first time this thread
+// steps through it.
+const filter_plan& get_filter_plan(
+  thread_buffer& buffer,
+  const method_info& info
+  )
+{
+  auto found = buffer.filter_plans.find(&info);
+  if (found != buffer.filter_plans.end()) return found->second;
+
+  const filter_program& program = *global.filter;
+  filter_plan& plan = buffer.filter_plans[&info];
+  std::string name = java_class_name(symbol_name(info.class_name)) + "."
+    + symbol_name(info.method_name);
+  for (uint32_t i = 0; i < program.rules.size(); ++i) {
+    const std::string& scope = program.rules[i].scope;
+    if (scope.empty() || glob_match(scope.c_str(), name.c_str()))
+      plan.rules.push_back(i);
+  }
+  if (plan.rules.empty()) return plan;
+
+  plan.variables.resize(program.nodes.size());
+  for (uint32_t i = 0; i < program.nodes.size(); ++i) {
+    const filter_node& node = program.nodes[i];
+    if (node.kind != filter_node::VARIABLE
+        && node.kind != filter_node::THIS_FIELD)
+      continue;
+    filter_plan::variable& variable = plan.variables[i];
+    if (node.kind == filter_node::VARIABLE)
+      for (uint32_t j = 0; j < info.local_variables.size(); ++j)
+        if (info.local_variables[j].name == node.name)
+          variable.locals.push_back(j);
+    if (!variable.locals.empty()) continue;
+    for (uint32_t j = 0; j < info.fields.size(); ++j) {
+      const field_reader& field = info.fields[j];
+      if (field.name != node.name || field.hidden) continue;
+      if (node.kind == filter_node::THIS_FIELD && field.is_static) continue;
+      variable.field = j;
+    }
+  }
+  return plan;
+}
+
+// What a filter needs to evaluate at one step.
+struct filter_context
+{
+  jvmtiEnv *jvmti;
+  JNIEnv *jni;
+  jthread thread;
+  thread_buffer& buffer;
+  const method_info& info;
+  const filter_plan& plan;
+  jlocation location;
+  // `this`, read the first time an instance field is.
+  bool read_this;
+  jobject _this;
+};
+
+filter_value to_filter_value(const java_value& value)
+{
+  filter_value result;
+  switch (value.type) {
+  case java_value::INT: result.integer = value.value._int; break;
+  case java_value::LONG: result.integer = value.value._long; break;
+  case java_value::SHORT: result.integer = value.value._short; break;
+  case java_value::CHAR: result.integer = value.value._char; break;
+  case java_value::BYTE: result.integer = value.value._byte; break;
+  case java_value::BOOLEAN: result.integer = value.value._boolean; break;
+  case java_value::FLOAT:
+    result.kind = filter_value::REAL;
+    result.real = value.value._float;
+    return result;
+  case java_value::DOUBLE:
+    result.kind = filter_value::REAL;
+    result.real = value.value._double;
+    return result;
+  default:
+    result.kind = filter_value::OBJECT;
+    result.object = value.value._object;
+    return result;
+  }
+  result.kind = filter_value::INTEGER;
+  return result;
+}
+
+// Read `this` once per step, or NULL in static methods.
+jobject read_filter_this(filter_context& context)
+{
+  if (context.read_this) return context._this;
+  count(STAT_JVMTI_GET_LOCAL);
+  jvmtiError error = context.jvmti->GetLocalInstance(
+    context.thread, 0, &context._this
+    );
+  if (error != JVMTI_ERROR_NONE) context._this = NULL;
+  context.read_this = true;
+  return context._this;
+}
+
+// Read the variable a node refers to, which is absent if it isn't in scope
+// or doesn't exist.
+filter_value read_filter_variable(filter_context& context, uint32_t index)
+{
+  const filter_plan::variable& variable = context.plan.variables[index];
+  java_value value;
+  for (uint32_t local : variable.locals) {
+    const local_variable& var = context.info.local_variables[local];
+    if (context.location < var.start || context.location >= var.end) continue;
+    if (!get_local_variable(context.jvmti, context.thread, 0, var, value))
+      return filter_value();
+    return to_filter_value(value);
+  }
+
+  // `this` is there even without a local variable table.
+  if (variable.locals.empty()
+      && global.filter->nodes[index].name == global.this_symbol
+      && global.filter->nodes[index].kind == filter_node::VARIABLE) {
+    jobject _this = read_filter_this(context);
+    if (_this == NULL) return filter_value();
+    value.type = java_value::OBJECT;
+    value.value._object = _this;
+    return to_filter_value(value);
+  }
+  if (variable.field < 0) return filter_value();
+
+  const field_reader& field = context.info.fields[variable.field];
+  jobject _this = NULL;
+  if (!field.is_static && (_this = read_filter_this(context)) == NULL)
+    return filter_value();
+  read_field(context.jni, context.info.klass, _this, field, value);
+  return to_filter_value(value);
+}
+
+bool filter_truth(const filter_value& value)
+{
+  switch (value.kind) {
+  case filter_value::INTEGER: return value.integer != 0;
+  case filter_value::REAL: return value.real != 0;
+  case filter_value::OBJECT: return value.object != NULL;
+  default: return false;
+  }
+}
+
+filter_value filter_bool(bool truth)
+{
+  filter_value result;
+  result.kind = filter_value::INTEGER;
+  result.integer = truth;
+  return result;
+}
+
+// Compare two values. Comparisons with absent values are false, and
+// objects can only be compared for identity.
+bool filter_compare(
+  JNIEnv *jni,
+  filter_node::kind_type op,
+  const filter_value& left,
+  const filter_value& right
+  )
+{
+  if (left.kind == filter_value::ABSENT || right.kind == filter_value::ABSENT)
+    return false;
+  bool left_object = left.kind == filter_value::OBJECT;
+  bool right_object = right.kind == filter_value::OBJECT;
+  if (left_object || right_object) {
+    if (!left_object || !right_object) return false;
+    bool same = jni->IsSameObject(left.object, right.object);
+    if (op == filter_node::EQUAL) return same;
+    if (op == filter_node::NOT_EQUAL) return !same;
+    return false;
+  }
+
+  int order;
+  if (left.kind == filter_value::INTEGER && right.kind == filter_value::INTEGER)
+    order = left.integer < right.integer ? -1 : left.integer > right.integer;
+  else {
+    double l = left.kind == filter_value::INTEGER ? left.integer : left.real;
+    double r = right.kind == filter_value::INTEGER ? right.integer : right.real;
+    if (l != l || r != r) return op == filter_node::NOT_EQUAL;
+    order = l < r ? -1 : l > r;
+  }
+  switch (op) {
+  case filter_node::EQUAL: return order == 0;
+  case filter_node::NOT_EQUAL: return order != 0;
+  case filter_node::LESS: return order < 0;
+  case filter_node::LESS_EQUAL: return order <= 0;
+  case filter_node::GREATER: return order > 0;
+  default: return order >= 0;
+  }
+}
+
+// Whether a variable differs from the last value this node saw on this
+// thread. The first value seen is not a change.
+bool filter_changed(
+  filter_context& context,
+  const filter_node& node,
+  filter_value value
+  )
+{
+  if (value.kind == filter_value::OBJECT) {
+    value.integer = object_tag(context.jvmti, value.object);
+    value.object = NULL;
+  }
+  std::vector<filter_value>& memory = context.buffer.filter_memory;
+  if (memory.size() <= node.slot) memory.resize(node.slot + 1);
+  filter_value& last = memory[node.slot];
+  bool changed = last.kind != filter_value::ABSENT
+    && (last.kind != value.kind || last.integer != value.integer
+        || std::memcmp(&last.real, &value.real, sizeof(double)) != 0);
+  last = value;
+  return changed;
+}
+
+filter_value evaluate_filter(filter_context& context, uint32_t index)
+{
+  const filter_node& node = global.filter->nodes[index];
+  filter_value result;
+  switch (node.kind) {
+  case filter_node::NUMBER:
+    result.kind = node.integral ? filter_value::INTEGER : filter_value::REAL;
+    result.integer = node.integer;
+    result.real = node.real;
+    return result;
+  case filter_node::NULL_VALUE:
+    result.kind = filter_value::OBJECT;
+    return result;
+  case filter_node::VARIABLE:
+  case filter_node::THIS_FIELD:
+    return read_filter_variable(context, index);
+  case filter_node::CHANGED: {
+    filter_value value = read_filter_variable(context, node.left);
+    if (value.kind == filter_value::ABSENT) return result;
+    return filter_bool(filter_changed(context, node, value));
+  }
+  case filter_node::NOT:
+    return filter_bool(!filter_truth(evaluate_filter(context, node.left)));
+  case filter_node::AND:
+    return filter_bool(
+      filter_truth(evaluate_filter(context, node.left))
+      && filter_truth(evaluate_filter(context, node.right))
+      );
+  case filter_node::OR:
+    return filter_bool(
+      filter_truth(evaluate_filter(context, node.left))
+      || filter_truth(evaluate_filter(context, node.right))
+      );
+  default:
+    return filter_bool(
+      filter_compare(
+        context.jni, node.kind, evaluate_filter(context, node.left),
+        evaluate_filter(context, node.right)
+        )
+      );
+  }
+}
+
+// Whether a step passes the filter: some rule in scope for its method is
+// true. Only the variables the rules refer to are read.
+bool filter_passes(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  jthread thread,
+  thread_buffer& buffer,
+  const method_info& info,
+  jlocation location
+  )
+{
+  const filter_plan& plan = get_filter_plan(buffer, info);
+  filter_context context = {
+    jvmti, jni, thread, buffer, info, plan, location, false, NULL
+  };
+  for (uint32_t rule : plan.rules)
+    if (filter_truth(evaluate_filter(context, global.filter->rules[rule].root)))
+      return true;
+  return false;
+}
+
+// Single step callback that records state while tracing.
+void JNICALL cb_single_step(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  jthread thread,
+  jmethodID method,
+  jlocation location
+  )
+{
+  if (!global.jvm_started || !global.tracing) return;
+  stat_timer timer(STAT_SINGLE_STEP);
+
+  thread_buffer *buffer = get_thread_buffer(jvmti, thread);
+  busy_guard busy(buffer);
+  // `end()` may have started collecting steps before we marked ourselves
+  // busy.
+  if (!global.tracing) return;
+
+  cpu_meter meter(global.sample_cpu > 0 ? &buffer->sampler : NULL);
+  const method_info *info = get_method_info(jvmti, jni, *buffer, method);
+  if (!info->traceable) {
+    suspend_stepping(jvmti, *buffer, thread);
+    return;
+  }
+  if (global.state_only && location == 0)
+    forget_frame(jvmti, *buffer, thread, *info);
+
+  // Boundaries depend on the previous step, even if it wasn't recorded.
+  bool boundary = false;
+  if (global.sampling) {
+    sampler_state& sampler = buffer->sampler;
+    boundary = is_boundary(sampler, *info, location);
+    sampler.method = info;
+    sampler.location = location;
+  }
+
+  // When recording whole lines, only capture the first step of each line.
+  // A step that doesn't move forward in the same method and line starts
+  // the line over, in a loop or in a recursive call.
+  jint line = line_at(*info, location);
+  if (global.line_steps) {
+    bool same_line = buffer->line_method == info && buffer->line == line
+      && location > buffer->line_location;
+    buffer->line_method = info;
+    buffer->line = line;
+    buffer->line_location = location;
+    if (same_line) return;
+  }
+
+  if (global.sampling && !boundary && !sample_step(buffer->sampler, *info)) {
+    ++buffer->sampler.skipped;
+    count(STAT_STEPS_SAMPLED_OUT);
+    return;
+  }
+
+  // With a filter, steps are only captured if it passes, which only reads
+  // the variables it refers to.
+  if (global.filter
+      && !filter_passes(jvmti, jni, thread, *buffer, *info, location)) {
+    count(STAT_STEPS_REJECTED);
+    return;
+  }
+
+  single_step& current_step = begin_step(*buffer, *info, TRACE_EVENT_STEP, line);
+  current_step.skipped = buffer->sampler.skipped;
+  buffer->sampler.skipped = 0;
+  if (global.state_only) {
+    count(STAT_JVMTI_FRAME);
+    jvmtiError error = jvmti->GetFrameCount(thread, &current_step.depth);
+    check_jvmti_error(jvmti, error, "unable to get frame count");
+  }
+  read_locals(jvmti, thread, *info, location, current_step);
+
+  // Read all fields. We know we're in an instance if `this` is bound
+  // locally; otherwise instance fields are skipped.
+  const java_value *_this = find_var(current_step.local_state, global.this_symbol);
+  jobject _obj = _this ? _this->value._object : 0;
+  if (global.watch_fields) {
+    read_shadow_state(jvmti, jni, *info, _obj, current_step);
+  } else {
+    for (const auto& field : info->fields) {
+      if (field.hidden || (!field.is_static && _this == NULL)) continue;
+      java_value field_value;
+      read_field(jni, info->klass, _obj, field, field_value);
+      if (field.is_static) current_step.class_state.push_back(field_value);
+      else current_step.instance_state.push_back(field_value);
+    }
+  }
+
+  // Identify objects by their tags. Nothing may use the references after
+  // this. Shadow states hold tags already, so objects that are only
+  // referenced from fields aren't captured when watching fields.
+  capture_objects(jvmti, jni, *buffer, current_step.local_state, current_step);
+  if (!global.watch_fields) {
+    capture_objects(
+      jvmti, jni, *buffer, current_step.instance_state, current_step
+      );
+    capture_objects(
+      jvmti, jni, *buffer, current_step.class_state, current_step
+      );
+  }
+
+  record_step(*buffer, current_step);
+}
+
+// Turn method entry and exit events on or off for every thread, when
+// tracing calls.
+void set_call_events(jvmtiEnv *jvmti, jvmtiEventMode mode)
+{
+  jvmtiError error;
+  error = jvmti->SetEventNotificationMode(
+    mode, JVMTI_EVENT_METHOD_ENTRY, (jthread) NULL
+    );
+  check_jvmti_error(jvmti, error, "unable to set event notification");
+  error = jvmti->SetEventNotificationMode(
+    mode, JVMTI_EVENT_METHOD_EXIT, (jthread) NULL
+    );
+  check_jvmti_error(jvmti, error, "unable to set event notification");
+}
+
+// Look up the receiver's methods and read its options.
+void read_receiver(JNIEnv *jni, jclass klass)
+{
+  // Look up the `receive` overloads. A missing overload raises
+  // NoSuchMethodError, which we don't want to leak into the tracee.
+  if (global.receiver_method == 0 && global.receiver_buffer_method == 0
+      && global.receiver_chunk_method == 0) {
+    global.receiver_chunk_method = jni->GetStaticMethodID(
+      klass, "receive", global_receive_chunk_signature.data()
+      );
+    if (global.receiver_chunk_method == 0) jni->ExceptionClear();
+    global.receiver_buffer_method = jni->GetStaticMethodID(
+      klass, "receive", global_receive_buffer_signature.data()
+      );
+    if (global.receiver_buffer_method == 0) jni->ExceptionClear();
+    global.receiver_method = jni->GetStaticMethodID(
+      klass, "receive", global_receive_signature.data()
+      );
+    if (global.receiver_method == 0) jni->ExceptionClear();
+  }
+
+  // The receiver may also take stats reports.
+  if (global.stats && global.receiver_stats_method == 0) {
+    global.receiver_stats_method = jni->GetStaticMethodID(
+      klass, "stats", global_receive_stats_signature.data()
+      );
+    if (global.receiver_stats_method == 0) jni->ExceptionClear();
+  }
+
+  // Cache the "filterSteps" field.
+  static jfieldID state_only_field = 0;
+  if (state_only_field == 0) {
+    state_only_field = jni->GetStaticFieldID(klass, "stateOnly", "Z");
+    if (state_only_field == 0) jni->ExceptionClear();
+  }
+
+  // Check if the receiver wants to filter recorded steps.
+  if (state_only_field)
+    global.state_only = (bool)jni->GetStaticBooleanField(
+      klass, state_only_field
+      );
+
+  // Check if the receiver wants results as TOML.
+  static jfieldID toml_field = 0;
+  if (toml_field == 0) {
+    toml_field = jni->GetStaticFieldID(klass, "toml", "Z");
+    if (toml_field == 0) jni->ExceptionClear();
+  }
+  if (toml_field)
+    global.toml = (bool)jni->GetStaticBooleanField(klass, toml_field);
+
+  // Check if the receiver wants one step per source line.
+  static jfieldID line_steps_field = 0;
+  if (line_steps_field == 0) {
+    line_steps_field = jni->GetStaticFieldID(klass, "lineSteps", "Z");
+    if (line_steps_field == 0) jni->ExceptionClear();
+  }
+  if (line_steps_field)
+    global.line_steps = (bool)jni->GetStaticBooleanField(
+      klass, line_steps_field
+      );
+
+  // Check if the receiver wants only steps that pass a filter.
+  static jfieldID filter_field = 0;
+  if (filter_field == 0) {
+    filter_field = jni->GetStaticFieldID(klass, "filter", "Ljava/lang/String;");
+    if (filter_field == 0) jni->ExceptionClear();
+  }
+  jstring filter = filter_field
+    ? (jstring)jni->GetStaticObjectField(klass, filter_field) : NULL;
+  if (filter) {
+    const char *chars = jni->GetStringUTFChars(filter, NULL);
+    global.receiver_filter = chars;
+    jni->ReleaseStringUTFChars(filter, chars);
+    jni->DeleteLocalRef(filter);
+  }
+}
+
+// Add the capabilities that tracing needs to `capa`.
+void add_tracing_capabilities(jvmtiCapabilities& capa)
+{
+  capa.can_generate_single_step_events = 1;
+  capa.can_generate_frame_pop_events = 1;
+  capa.can_generate_method_entry_events = 1;
+  capa.can_access_local_variables = 1;
+  if (global.watch_fields) capa.can_generate_field_modification_events = 1;
+  if (global.call_mode) capa.can_generate_method_exit_events = 1;
+}
+
+// Whether the VM can grant the capabilities that tracing needs now.
+bool tracing_capabilities_potential(jvmtiEnv *jvmti)
+{
+  jvmtiCapabilities potential;
+  std::memset(&potential, 0, sizeof(potential));
+  jvmtiCapabilities tracing;
+  std::memset(&tracing, 0, sizeof(tracing));
+  add_tracing_capabilities(tracing);
+  jvmtiError error = jvmti->GetPotentialCapabilities(&potential);
+  check_jvmti_error(jvmti, error, "unable to get potential capabilities");
+  if (error != JVMTI_ERROR_NONE) return false;
+  // Capabilities are bit fields, so compare them a byte at a time.
+  const unsigned char *have = (const unsigned char *)&potential;
+  const unsigned char *need = (const unsigned char *)&tracing;
+  for (size_t i = 0; i < sizeof(jvmtiCapabilities); ++i)
+    if ((have[i] & need[i]) != need[i]) return false;
+  return true;
+}
+
+// Whether the capabilities that tracing needs can wait until tracing
+// starts. While the agent loads, the VM can only say what it grants now,
+// not what it will grant later. HotSpot only grants them while agents
+// load, so they have to be added then, unless `capabilities=start` says
+// otherwise.
+bool defer_capabilities(jvmtiEnv *jvmti)
+{
+  if (global.capabilities != global_state::CAPABILITIES_AUTO)
+    return global.capabilities == global_state::CAPABILITIES_START;
+  char *name = NULL;
+  jvmtiError error = jvmti->GetSystemProperty("java.vm.name", &name);
+  if (error != JVMTI_ERROR_NONE || name == NULL) return false;
+  bool hotspot = std::strstr(name, "HotSpot") != NULL
+    || std::strstr(name, "OpenJDK") != NULL;
+  jvmti->Deallocate((unsigned char *)name);
+  return !hotspot;
+}
+
+// Add the capabilities that tracing needs, if they were deferred and
+// haven't been added yet. Returns false if they can't be added.
+bool acquire_tracing_capabilities(jvmtiEnv *jvmti)
+{
+  if (!global.capabilities_pending) return true;
+  std::lock_guard<std::mutex> guard(global.capabilities_lock);
+  if (!global.capabilities_pending) return true;
+
+  jvmtiCapabilities capa;
+  std::memset(&capa, 0, sizeof(capa));
+  add_tracing_capabilities(capa);
+  jvmtiError error = jvmti->AddCapabilities(&capa);
+  check_jvmti_error(jvmti, error, "unable to set necessary capabilities");
+  if (error != JVMTI_ERROR_NONE) return false;
+  global.capabilities_pending = false;
+  return true;
+}
+
+// Start tracing when the receiver's `start` is called, or when a trigger
+// fires, in which case there is no receiver.
+void start_tracing(jvmtiEnv *jvmti, JNIEnv *jni, jclass klass)
+{
+  jvmtiError error;
+
+  // Results are delivered one region at a time, so a region can't start
+  // from `receive` while another one is being delivered.
+  if (delivery_thread) {
+    std::cerr << "ERROR: jtrace: start() called from receive() is ignored"
+              << std::endl;
+    return;
+  }
+  if (!acquire_tracing_capabilities(jvmti)) return;
+  global.receiver_filter.clear();
+  if (klass != NULL) read_receiver(jni, klass);
+  use_filter(
+    global.receiver_filter.empty() ? global.filter_option
+    : global.receiver_filter
+    );
+
+  if (global.stream) stream_begin(global.stream);
+  global.truncating = false;
+  global.truncated_steps = 0;
+  global.trace_start = std::chrono::steady_clock::now();
+  global.tracing = true;
+
+  if (global.watch_fields) {
+    error = jvmti->SetEventNotificationMode(
+      JVMTI_ENABLE, JVMTI_EVENT_FIELD_MODIFICATION, (jthread) NULL
+      );
+    check_jvmti_error(jvmti, error, "unable to set event notification");
+  }
+  if (!global.thread_end_events) {
+    error = jvmti->SetEventNotificationMode(
+      JVMTI_ENABLE, JVMTI_EVENT_THREAD_END, (jthread) NULL
+      );
+    check_jvmti_error(jvmti, error, "unable to set event notification");
+    global.thread_end_events = true;
+  }
+  if (global.call_mode) {
+    set_call_events(jvmti, JVMTI_ENABLE);
+    return;
+  }
+
+  // Enable VM single-step notifications for every thread, frame pop
+  // notifications so that threads can skip over untraced frames, and thread
+  // start notifications to step new threads.
+  error = jvmti->SetEventNotificationMode(
+    JVMTI_ENABLE, JVMTI_EVENT_FRAME_POP, (jthread) NULL
+    );
+  check_jvmti_error(jvmti, error, "unable to set event notification");
+  error = jvmti->SetEventNotificationMode(
+    JVMTI_ENABLE, JVMTI_EVENT_THREAD_START, (jthread) NULL
+    );
+  check_jvmti_error(jvmti, error, "unable to set event notification");
+  set_stepping_all(jvmti, jni, thread_buffer::STEP_ON);
+}
+
+// Stop tracing when the receiver's `end` is called or a triggered region
+// ends, and deliver results.
+void stop_tracing(jvmtiEnv *jvmti, JNIEnv *jni, jclass klass)
+{
+  jvmtiError error;
+
+  // Nor can one end there (see `start_tracing`).
+  if (delivery_thread) {
+    std::cerr << "ERROR: jtrace: end() called from receive() is ignored"
+              << std::endl;
+    return;
+  }
+
+  // Other threads may still be recording their last step. Once they are
+  // done, none of them will turn single-stepping back on.
+  global.tracing = false;
+  std::vector<thread_trace> traces = collect_steps();
+
+  // Disable VM single-step notifications.
+  if (global.call_mode) {
+    set_call_events(jvmti, JVMTI_DISABLE);
+  } else {
+    error = jvmti->SetEventNotificationMode(
+      JVMTI_DISABLE, JVMTI_EVENT_THREAD_START, (jthread) NULL
+      );
+    check_jvmti_error(jvmti, error, "unable to set event notification");
+    set_stepping_all(jvmti, jni, thread_buffer::STEP_OFF);
+    error = jvmti->SetEventNotificationMode(
+      JVMTI_DISABLE, JVMTI_EVENT_FRAME_POP, (jthread) NULL
+      );
+    check_jvmti_error(jvmti, error, "unable to set event notification");
+  }
+  if (global.watch_fields) {
+    error = jvmti->SetEventNotificationMode(
+      JVMTI_DISABLE, JVMTI_EVENT_FIELD_MODIFICATION, (jthread) NULL
+      );
+    check_jvmti_error(jvmti, error, "unable to set event notification");
+  }
+
+  // Send trace info to the receiver, or finish the streamed trace. Traces
+  // in shared memory were finished as steps were collected.
+  if (global.stream) stream_end(global.stream);
+  else if (!global.archive_path.empty()) write_archive(traces);
+  else if (global.shm == NULL) send_steps(jni, klass, traces);
+  // Chunked delivery reports once the last chunk is delivered.
+  if (global.stats && global.delivery == NULL) report_stats(jni, klass);
+}
+
+// Parse agent options, which look like `key=value,key=value`.
+std::unordered_map<std::string, std::string> parse_options(const char *options)
+{
+  std::unordered_map<std::string, std::string> result;
+  if (options == NULL) return result;
+
+  std::istringstream input(options);
+  std::string option;
+  while (std::getline(input, option, ',')) {
+    size_t equals = option.find('=');
+    if (equals == std::string::npos) result[option] = "";
+    else result[option.substr(0, equals)] = option.substr(equals + 1);
+  }
+  return result;
+}
+
+// Parse a size like `4096`, `64k` or `1m`.
+size_t parse_size(const std::string& str)
+{
+  char *suffix = NULL;
+  size_t size = std::strtoull(str.c_str(), &suffix, 10);
+  if (*suffix == 'k' || *suffix == 'K') size <<= 10;
+  else if (*suffix == 'm' || *suffix == 'M') size <<= 20;
+  return size;
+}
+
+// Set breakpoints on the methods of a class that match the trigger
+// pattern, which looks like `com.example.Server.handle`. Call with the
+// control's methods lock held.
+void arm_class(jvmtiEnv *jvmti, control_state& control, jclass klass)
+{
+  jvmtiError error;
+  char *_class_signature = NULL;
+  error = jvmti->GetClassSignature(klass, &_class_signature, NULL);
+  check_jvmti_error(jvmti, error, "unable to get signature");
+  std::string class_signature = _class_signature;
+  jvmti->Deallocate((unsigned char *)_class_signature);
+  if (class_signature[0] != 'L' || is_receiver_class(class_signature)) return;
+
+  std::string class_name = java_class_name(class_signature);
+
+  // If the method part of the pattern has no wildcard, the rest must match
+  // the class name, which rules out most classes without looking at their
+  // methods.
+  size_t dot = control.pattern.rfind('.');
+  if (dot != std::string::npos
+      && control.pattern.find('*', dot) == std::string::npos
+      && !glob_match(
+        control.pattern.substr(0, dot).c_str(), class_name.c_str()
+        ))
+    return;
+
+  // Classes that aren't prepared yet are armed by their class prepare
+  // event.
+  jint method_count = 0;
+  jmethodID *methods = NULL;
+  error = jvmti->GetClassMethods(klass, &method_count, &methods);
+  if (error == JVMTI_ERROR_CLASS_NOT_PREPARED) return;
+  check_jvmti_error(jvmti, error, "unable to get class methods");
+  for (jint i = 0; i < method_count; ++i) {
+    char *_method_name = NULL;
+    error = jvmti->GetMethodName(methods[i], &_method_name, NULL, NULL);
+    check_jvmti_error(jvmti, error, "unable to get method name");
+    bool match = glob_match(
+      control.pattern.c_str(), (class_name + "." + _method_name).c_str()
+      );
+    jvmti->Deallocate((unsigned char *)_method_name);
+    if (!match) continue;
+
+    // Native and abstract methods have no code to break in.
+    jlocation start_location, end_location;
+    error = jvmti->GetMethodLocation(
+      methods[i], &start_location, &end_location
+      );
+    if (error != JVMTI_ERROR_NONE || start_location < 0) continue;
+    error = jvmti->SetBreakpoint(methods[i], start_location);
+    if (error == JVMTI_ERROR_DUPLICATE) continue;
+    check_jvmti_error(jvmti, error, "unable to set breakpoint");
+    if (error == JVMTI_ERROR_NONE) control.methods.push_back(methods[i]);
+  }
+  jvmti->Deallocate((unsigned char *)methods);
+}
+
+// Set breakpoints on every loaded method that matches `pattern`.
+void arm_trigger(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  control_state& control,
+  const std::string& pattern
+  )
+{
+  // Classes prepared while we look at the loaded ones wait for the lock
+  // and are armed afterwards.
+  std::lock_guard<std::mutex> guard(control.methods_lock);
+  control.pattern = pattern;
+  control.state = control_state::ARMED;
+  jvmtiError error = jvmti->SetEventNotificationMode(
+    JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, (jthread) NULL
+    );
+  check_jvmti_error(jvmti, error, "unable to set event notification");
+  jint class_count = 0;
+  jclass *classes = NULL;
+  error = jvmti->GetLoadedClasses(&class_count, &classes);
+  check_jvmti_error(jvmti, error, "unable to get loaded classes");
+  for (jint i = 0; i < class_count; ++i) {
+    arm_class(jvmti, control, classes[i]);
+    jni->DeleteLocalRef(classes[i]);
+  }
+  jvmti->Deallocate((unsigned char *)classes);
+}
+
+// Clear the trigger breakpoints.
+void disarm_trigger(jvmtiEnv *jvmti, control_state& control)
+{
+  std::lock_guard<std::mutex> guard(control.methods_lock);
+  if (control.state == control_state::ARMED) {
+    jvmtiError error = jvmti->SetEventNotificationMode(
+      JVMTI_DISABLE, JVMTI_EVENT_CLASS_PREPARE, (jthread) NULL
+      );
+    check_jvmti_error(jvmti, error, "unable to set event notification");
+  }
+  for (jmethodID method : control.methods) {
+    jlocation start_location, end_location;
+    jvmtiError error = jvmti->GetMethodLocation(
+      method, &start_location, &end_location
+      );
+    // The class may have been unloaded.
+    if (error == JVMTI_ERROR_NONE) jvmti->ClearBreakpoint(method, start_location);
+  }
+  control.methods.clear();
+  control.pattern.clear();
+  control.state = control_state::IDLE;
+}
+
+// Whether a breakpoint is one of the trigger's.
+bool is_trigger_method(control_state& control, jmethodID method)
+{
+  std::lock_guard<std::mutex> guard(control.methods_lock);
+  return std::find(control.methods.begin(), control.methods.end(), method)
+    != control.methods.end();
+}
+
+// Start a triggered region. Call with the control lock held. Nothing
+// happens while the receiver is tracing.
+void begin_trigger(jvmtiEnv *jvmti, JNIEnv *jni, control_state& control)
+{
+  if (global.tracing) return;
+  disarm_trigger(jvmti, control);
+  control.limit_reached = false;
+  control.started = std::chrono::steady_clock::now();
+  control.state = control_state::RUNNING;
+  control.stop_sequence = control.step_limit == 0
+    ? 0 : global.sequence + control.step_limit;
+  start_tracing(jvmti, jni, NULL);
+}
+
+// End a triggered region and write out its results. Call with the control
+// lock held.
+void end_trigger(jvmtiEnv *jvmti, JNIEnv *jni, control_state& control)
+{
+  stop_tracing(jvmti, jni, NULL);
+  control.stop_sequence = 0;
+  control.state = control_state::IDLE;
+}
+
+// Breakpoint on a trigger method.
+void fire_trigger(jvmtiEnv *jvmti, JNIEnv *jni, control_state& control)
+{
+  std::lock_guard<std::mutex> guard(control.lock);
+  if (control.state == control_state::ARMED) begin_trigger(jvmti, jni, control);
+}
+
+// Read and remove the control file, and act on the commands in it. Call
+// with the control lock held. Commands are `key=value` pairs separated by
+// commas or new lines:
+//   start[=<pattern>]    start tracing when a method matching the pattern
+//                        is entered, or right away without a pattern
+//   steps=<n>            stop after about n steps
+//   time=<ms>            stop after this many milliseconds
+//   stop                 stop tracing, or forget a trigger that hasn't
+//                        fired
+void read_control(jvmtiEnv *jvmti, JNIEnv *jni, control_state& control)
+{
+  FILE *file = std::fopen(control.path.c_str(), "rb");
+  if (file == NULL) return;
+  std::string commands;
+  char chunk[256];
+  size_t size;
+  while ((size = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+    commands.append(chunk, size);
+  std::fclose(file);
+  if (std::remove(control.path.c_str()) != 0) {
+    std::cerr
+      << "ERROR: jtrace: unable to remove " << control.path
+      << ", no longer watching it" << std::endl;
+    control.stopping = true;
+  }
+
+  std::replace(commands.begin(), commands.end(), '\n', ',');
+  std::replace(commands.begin(), commands.end(), '\r', ',');
+  std::unordered_map<std::string, std::string> options =
+    parse_options(commands.c_str());
+  auto start = options.find("start");
+  if (options.count("stop") || start != options.end()) {
+    if (control.state == control_state::RUNNING)
+      end_trigger(jvmti, jni, control);
+    else if (control.state == control_state::ARMED)
+      disarm_trigger(jvmti, control);
+  }
+  if (start == options.end()) return;
+
+  auto steps = options.find("steps");
+  control.step_limit = steps == options.end() ? 0 : parse_size(steps->second);
+  auto time = options.find("time");
+  control.time_limit = std::chrono::milliseconds(
+    time == options.end() ? 0 : parse_size(time->second)
+    );
+  if (start->second.empty()) begin_trigger(jvmti, jni, control);
+  else arm_trigger(jvmti, jni, control, start->second);
+}
+
+// Whether the current triggered region has hit its step or time limit.
+bool trigger_expired(const control_state& control)
+{
+  if (control.state != control_state::RUNNING) return false;
+  if (control.limit_reached) return true;
+  return control.time_limit.count() > 0
+    && std::chrono::steady_clock::now() - control.started
+      >= control.time_limit;
+}
+
+// Background thread that polls the control file and ends triggered regions
+// at their limits. It runs as a daemon Java thread so that it can call
+// into JVMTI and JNI.
+void control_watch(control_state *control)
+{
+  JNIEnv *jni = NULL;
+  jint res = control->jvm->AttachCurrentThreadAsDaemon((void **)&jni, NULL);
+  if (res != JNI_OK) {
+    std::cerr << "ERROR: jtrace: unable to attach control thread" << std::endl;
+    return;
+  }
+
+  std::unique_lock<std::mutex> guard(control->lock);
+  while (!control->stopping) {
+    control->wake.wait_for(guard, control->poll);
+    if (control->stopping) break;
+    if (trigger_expired(*control)) end_trigger(control->jvmti, jni, *control);
+    read_control(control->jvmti, jni, *control);
+  }
+  // Deliver whatever a region still running has recorded.
+  if (control->state == control_state::RUNNING)
+    end_trigger(control->jvmti, jni, *control);
+  guard.unlock();
+  control->jvm->DetachCurrentThread();
+}
+
+// Stop the control thread, ending any triggered region.
+void control_stop(control_state *control)
+{
+  {
+    std::lock_guard<std::mutex> guard(control->lock);
+    control->stopping = true;
+  }
+  control->wake.notify_one();
+  if (control->watcher.joinable()) control->watcher.join();
+}
+
+// Field modification callback that keeps shadow states up to date. Writes
+// through JNI are not reported, so they are missed.
+void JNICALL cb_field_modification(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  jthread thread,
+  jmethodID method,
+  jlocation location,
+  jclass field_klass,
+  jobject object,
+  jfieldID field,
+  char signature_type,
+  jvalue new_value
+  )
+{
+  if (!global.tracing) return;
+
+  field_reader reader;
+  {
+    std::shared_lock<std::shared_timed_mutex> guard(global.watched_fields_lock);
+    auto found = global.watched_fields.find(field);
+    if (found == global.watched_fields.end()) return;
+    reader = found->second;
+  }
+
+  // Only objects and classes that have a shadow are tagged, so the owner
+  // has none if it has no tag.
+  jlong tag = object ? existing_tag(jvmti, object) : 0;
+  jlong class_tag = reader.class_tag ? reader.class_tag
+    : existing_tag(jvmti, field_klass);
+  if ((object && tag == 0) || class_tag == 0) return;
+
+  // Shadows that don't exist yet will read the new value when they do.
+  shadow_key key(tag, class_tag);
+  shadow_shard& shard = get_shadow_shard(key);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  auto shadow = shard.shadows.find(key);
+  if (shadow == shard.shadows.end()) return;
+  java_value *var = find_var(shadow->second, reader.name);
+  if (!var) return;
+
+  java_value value;
+  value.name = reader.name;
+  value.signature = reader.signature;
+  value.type = reader.type;
+  switch (reader.type) {
+  case java_value::INT: value.value._int = new_value.i; break;
+  case java_value::LONG: value.value._long = new_value.j; break;
+  case java_value::FLOAT: value.value._float = new_value.f; break;
+  case java_value::DOUBLE: value.value._double = new_value.d; break;
+  case java_value::BOOLEAN: value.value._boolean = new_value.z; break;
+  case java_value::BYTE: value.value._byte = new_value.b; break;
+  case java_value::CHAR: value.value._char = new_value.c; break;
+  case java_value::SHORT: value.value._short = new_value.s; break;
+  default: value.value._tag = object_tag(jvmti, new_value.l);
+  }
+  *var = value;
+}
+
+// Breakpoint callback for the receiver's `start` and `end` methods and for
+// trigger methods, which are the only breakpoints we set.
+void JNICALL cb_breakpoint(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  jthread thread,
+  jmethodID method,
+  jlocation location
+  )
+{
+  if (global.control) {
+    if (is_trigger_method(*global.control, method)) {
+      fire_trigger(jvmti, jni, *global.control);
+      return;
+    }
+    // A triggered region owns tracing until it ends.
+    if (global.control->state == control_state::RUNNING) return;
+  }
+
+  bool start, end;
+  {
+    std::lock_guard<std::mutex> guard(global.receivers_lock);
+    start = std::find(
+      global.receiver_starts.begin(), global.receiver_starts.end(), method
+      ) != global.receiver_starts.end();
+    end = std::find(
+      global.receiver_ends.begin(), global.receiver_ends.end(), method
+      ) != global.receiver_ends.end();
+  }
+  if (!start && !end) return;
+
+  jvmtiError error;
+  jclass klass;
+  error = jvmti->GetMethodDeclaringClass(method, &klass);
+  check_jvmti_error(jvmti, error, "unable to get class");
+
+  if (start) start_tracing(jvmti, jni, klass);
+  else stop_tracing(jvmti, jni, klass);
+}
+
+// Method entry callback. When tracing calls, this records calls to traced
+// methods. Otherwise these are only enabled for threads that have suspended
+// single-stepping, and resume it if untraced code calls back into traced
+// code.
+void JNICALL cb_method_enter(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  jthread thread,
+  jmethodID method
+  )
+{
+  if (!global.tracing) return;
+  stat_timer timer(STAT_METHOD_ENTRY);
+  thread_buffer *buffer = get_thread_buffer(jvmti, thread);
+  const method_info *info = get_method_info(jvmti, jni, *buffer, method);
+  if (!info->traceable) return;
+
+  busy_guard busy(buffer);
+  if (!global.tracing) return;
+  if (global.call_mode) record_call(jvmti, jni, *buffer, thread, *info);
+  else set_stepping(jvmti, *buffer, thread, thread_buffer::STEP_ON);
+}
+
+// Method exit callback, only enabled when tracing calls.
+void JNICALL cb_method_exit(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  jthread thread,
+  jmethodID method,
+  jboolean was_popped_by_exception,
+  jvalue return_value
+  )
+{
+  if (!global.tracing) return;
+  stat_timer timer(STAT_METHOD_EXIT);
+  thread_buffer *buffer = get_thread_buffer(jvmti, thread);
+  const method_info *info = get_method_info(jvmti, jni, *buffer, method);
+  if (!info->traceable) return;
+
+  busy_guard busy(buffer);
+  if (global.tracing)
+    record_return(
+      jvmti, jni, *buffer, thread, *info, was_popped_by_exception,
+      return_value
+      );
+}
+
+// Set breakpoints on the `start` and `end` methods of a receiver class.
+void watch_receiver(jvmtiEnv *jvmti, jclass klass)
+{
+  jvmtiError error;
+  char *_class_signature = NULL;
+  error = jvmti->GetClassSignature(klass, &_class_signature, NULL);
+  check_jvmti_error(jvmti, error, "unable to get signature");
+  bool receiver = is_receiver_class(_class_signature);
+  jvmti->Deallocate((unsigned char *)_class_signature);
+  if (!receiver) return;
+
+  jint method_count = 0;
+  jmethodID *methods = NULL;
+  error = jvmti->GetClassMethods(klass, &method_count, &methods);
+  check_jvmti_error(jvmti, error, "unable to get class methods");
+  for (jint i = 0; i < method_count; ++i) {
+    char *_method_name = NULL;
+    error = jvmti->GetMethodName(methods[i], &_method_name, NULL, NULL);
+    check_jvmti_error(jvmti, error, "unable to get method name");
+    bool start = std::strcmp(_method_name, "start") == 0;
+    bool end = std::strcmp(_method_name, "end") == 0;
+    jvmti->Deallocate((unsigned char *)_method_name);
+    if (!start && !end) continue;
+
+    jlocation start_location, end_location;
+    error = jvmti->GetMethodLocation(
+      methods[i], &start_location, &end_location
+      );
+    check_jvmti_error(jvmti, error, "unable to get method location");
+    error = jvmti->SetBreakpoint(methods[i], start_location);
+    if (error == JVMTI_ERROR_DUPLICATE) continue;
+    check_jvmti_error(jvmti, error, "unable to set breakpoint");
+    std::lock_guard<std::mutex> guard(global.receivers_lock);
+    (start ? global.receiver_starts : global.receiver_ends).push_back(methods[i]);
+  }
+  jvmti->Deallocate((unsigned char *)methods);
+}
+
+// Class prepare callback that looks for receiver classes, or for trigger
+// methods while a trigger is armed.
+void JNICALL cb_class_prepare(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  jthread thread,
+  jclass klass
+  )
+{
+  if (!global.control) watch_receiver(jvmti, klass);
+  else if (global.control->state == control_state::ARMED) {
+    std::lock_guard<std::mutex> guard(global.control->methods_lock);
+    if (!global.control->pattern.empty())
+      arm_class(jvmti, *global.control, klass);
+  }
+}
+
+// Frame pop callback. The untraced frame that stopped single-stepping has
+// returned, so we step again until the next untraced method.
+void JNICALL cb_frame_pop(
+  jvmtiEnv *jvmti,
+  JNIEnv *jni,
+  jthread thread,
+  jmethodID method,
+  jboolean was_popped_by_exception
+  )
+{
+  thread_buffer *buffer = get_thread_buffer(jvmti, thread);
+  busy_guard busy(buffer);
+  if (global.tracing)
+    set_stepping(jvmti, *buffer, thread, thread_buffer::STEP_ON);
+}
+
+// Thread start callback that starts stepping threads created while
+// tracing. It is only enabled while tracing single steps, and the thread
+// gets its buffer from its first step.
+void JNICALL cb_thread_start(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread)
+{
+  if (!global.tracing || global.call_mode) return;
+  count(STAT_JVMTI_EVENT_MODE);
+  jvmtiError error = jvmti->SetEventNotificationMode(
+    JVMTI_ENABLE, JVMTI_EVENT_SINGLE_STEP, thread
+    );
+  check_jvmti_error(jvmti, error, "unable to set event notification");
+}
+
+// Thread end callback that lets go of the thread's buffer.
+void JNICALL cb_thread_end(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread)
+{
+  retire_thread_stats();
+  void *data = NULL;
+  jvmtiError error = jvmti->GetThreadLocalStorage(thread, &data);
+  check_jvmti_error(jvmti, error, "unable to get thread local storage");
+  if (data == NULL) return;
+
+  // Buffers that still hold steps are freed when tracing ends. Traces in
+  // shared memory end with their thread.
+  thread_buffer *buffer = (thread_buffer *)data;
+  if (global.shm) {
+    std::lock_guard<std::mutex> shm_guard(buffer->shm_lock);
+    shm_end(global.shm, *buffer);
+    shm_release(global.shm, *buffer);
+  }
+  std::lock_guard<std::mutex> guard(global.threads_lock);
+  if (!global.tracing && buffer->steps.records.empty()
+      && !global.collecting) {
+    global.threads.erase(
+      std::find(global.threads.begin(), global.threads.end(), buffer)
+      );
+    delete buffer;
+  } else {
+    buffer->finished = true;
+  }
+  jvmti->SetThreadLocalStorage(thread, NULL);
+}
+
+// Finish every open trace in shared memory and give back every ring, so
+// that jtrace-consume can write out the rest and exit.
+void shm_close(shm_sink *shm)
+{
+  // The VM is exiting, so don't wait for a consumer that may be gone.
+  shm->closing = true;
+  if (global.tracing) {
+    global.tracing = false;
+    collect_steps();
+  }
+  {
+    std::lock_guard<std::mutex> guard(global.threads_lock);
+    for (thread_buffer *buffer : global.threads) {
+      std::lock_guard<std::mutex> shm_guard(buffer->shm_lock);
+      shm_release(shm, *buffer);
+    }
+  }
+  shm->region.header()->closed.store(1, std::memory_order_release);
+  shm_unlink(shm->name.c_str());
+  if (shm->lost > 0)
+    std::cerr
+      << "WARNING: jtrace: lost " << shm->lost
+      << " steps because the shared memory consumer stopped reading"
+      << std::endl;
+}
+
+// VM start callback.
+void JNICALL cb_vm_start(jvmtiEnv *jvmti, JNIEnv *jni)
+{
+  global.jvm_started = true;
+}
+
+// Set breakpoints on the receiver classes that are already loaded.
+void watch_loaded_receivers(jvmtiEnv *jvmti, JNIEnv *jni)
+{
+  jint class_count = 0;
+  jclass *classes = NULL;
+  jvmtiError error = jvmti->GetLoadedClasses(&class_count, &classes);
+  check_jvmti_error(jvmti, error, "unable to get loaded classes");
+  for (jint i = 0; i < class_count; ++i) {
+    watch_receiver(jvmti, classes[i]);
+    jni->DeleteLocalRef(classes[i]);
+  }
+  jvmti->Deallocate((unsigned char *)classes);
+}
+
+// VM init callback. Receiver classes loaded before now didn't get a class
+// prepare event, and the control thread can only attach from now on.
+void JNICALL cb_vm_init(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread)
+{
+  // Deferred capabilities that the VM won't grant now never will be.
+  if (global.capabilities_pending && !tracing_capabilities_potential(jvmti))
+    std::cerr
+      << "ERROR: jtrace: this VM doesn't grant the capabilities tracing "
+      << "needs after startup; load the agent with capabilities=load"
+      << std::endl;
+  if (!global.control) watch_loaded_receivers(jvmti, jni);
+  if (global.control)
+    global.control->watcher = std::thread(control_watch, global.control);
+}
+
+// VM death callback.
+void JNICALL cb_vm_death(jvmtiEnv *jvmti, JNIEnv *jni)
+{
+  if (global.control) control_stop(global.control);
+  // Results still being delivered after `System.exit` or the like.
+  delivery_wait_at_exit(jni);
+  if (global.shm) shm_close(global.shm);
+  if (global.stream) {
+    stream_end(global.stream);
+    stream_stop(global.stream);
+  }
+  // Whatever happened since the last `end()`.
+  if (global.stats) report_stats(NULL, NULL);
+}
+
+// Set up the stream sink if the options ask for one. Options are:
+//   output=<path>        append traces to this file instead of sending them
+//                        to the receiver
+//   ring=<size>          size of the in-memory ring buffer (default 1m)
+//   full=<block|drop>    what to do with steps when the ring is full
+bool configure_stream(
+  const std::unordered_map<std::string, std::string>& options
+  )
+{
+  auto output = options.find("output");
+  if (output == options.end()) return true;
+
+  FILE *file = std::fopen(output->second.c_str(), "ab");
+  if (file == NULL) {
+    std::cerr << "unable to open " << output->second << std::endl;
+    return false;
+  }
+
+  stream_sink *stream = new stream_sink;
+  stream->file = file;
+
+  size_t ring_size = 1 << 20;
+  auto ring = options.find("ring");
+  if (ring != options.end()) ring_size = parse_size(ring->second);
+  if (ring_size == 0) {
+    std::cerr << "invalid ring size " << ring->second << std::endl;
+    return false;
+  }
+  stream->ring.resize(ring_size);
+
+  auto full = options.find("full");
+  if (full != options.end()) {
+    if (full->second == "drop") stream->policy = stream_sink::DROP;
+    else if (full->second == "block") stream->policy = stream_sink::BLOCK;
+    else {
+      std::cerr << "invalid full policy " << full->second << std::endl;
+      return false;
+    }
+  }
+
+  stream->writer = std::thread(stream_write, stream);
+  global.stream = stream;
+  return true;
+}
+
+// Set up the archive output if the options ask for it. Options are:
+//   archive=<path>       write each traced region to a seekable archive
+//                        instead of sending it to the receiver
+//   block=<size>         uncompressed size of archive blocks (default 64k)
+bool configure_archive(
+  const std::unordered_map<std::string, std::string>& options
+  )
+{
+  auto archive = options.find("archive");
+  if (archive == options.end()) return true;
+  if (global.stream) {
+    std::cerr << "archive and output can't be used together" << std::endl;
+    return false;
+  }
+  global.archive_path = archive->second;
+
+  auto block = options.find("block");
+  if (block != options.end())
+    global.archive_block_size = parse_size(block->second);
+  if (global.archive_block_size == 0) {
+    std::cerr << "invalid block size " << block->second << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Set up shared memory output if the options ask for it. Options are:
+//   shm=<name>           write each thread's traces to its own ring in this
+//                        POSIX shared memory object, for jtrace-consume to
+//                        write out, instead of sending them to the receiver
+//   rings=<n>            how many threads can record at once (default 64)
+//   ring=<size>          size of each ring (default 1m)
+//   full=<block|drop>    what to do with steps when a ring is full
+//   stall=<ms>           how long a write to a full ring waits once
+//                        jtrace-consume stops making progress, before the
+//                        step is dropped (default 1000)
+bool configure_shm(
+  const std::unordered_map<std::string, std::string>& options
+  )
+{
+  auto name = options.find("shm");
+  if (name == options.end()) return true;
+  if (global.stream || !global.archive_path.empty()) {
+    std::cerr << "shm can't be used with output or archive" << std::endl;
+    return false;
+  }
+
+  shm_sink *shm = new shm_sink;
+  shm->name = name->second;
+  if (shm->name.empty() || shm->name[0] != '/') shm->name = "/" + shm->name;
+
+  uint32_t ring_count = 64;
+  auto rings = options.find("rings");
+  if (rings != options.end()) ring_count = (uint32_t)parse_size(rings->second);
+  size_t ring_size = 1 << 20;
+  auto ring = options.find("ring");
+  if (ring != options.end()) ring_size = parse_size(ring->second);
+  if (ring_count == 0 || ring_size == 0) {
+    std::cerr << "invalid shared memory rings" << std::endl;
+    return false;
+  }
+
+  auto full = options.find("full");
+  if (full != options.end()) {
+    if (full->second == "drop") shm->block = false;
+    else if (full->second != "block") {
+      std::cerr << "invalid full policy " << full->second << std::endl;
+      return false;
+    }
+  }
+
+  auto stall = options.find("stall");
+  if (stall != options.end()) {
+    shm->stall = std::chrono::milliseconds(parse_size(stall->second));
+    if (shm->stall.count() == 0) {
+      std::cerr << "invalid stall time " << stall->second << std::endl;
+      return false;
+    }
+  }
+
+  if (!shm->region.create(shm->name, ring_count, ring_size)) {
+    std::cerr << shm->region.error() << std::endl;
+    return false;
+  }
+  global.shm = shm;
+  return true;
+}
+
+// Set up external triggers if the options ask for them. Options are:
+//   control=<path>       poll this file for commands that start and stop
+//                        tracing (see `read_control`)
+//   poll=<ms>            how often to poll it (default 100)
+// Triggered regions go to the stream, archive or shared memory, so one of
+// them is needed.
+bool configure_control(
+  const std::unordered_map<std::string, std::string>& options
+  )
+{
+  auto path = options.find("control");
+  if (path == options.end()) return true;
+  if (global.stream == NULL && global.archive_path.empty()
+      && global.shm == NULL) {
+    std::cerr << "control needs output, archive or shm" << std::endl;
+    return false;
+  }
+
+  control_state *control = new control_state;
+  control->path = path->second;
+  auto poll = options.find("poll");
+  if (poll != options.end())
+    control->poll = std::chrono::milliseconds(parse_size(poll->second));
+  if (control->poll.count() == 0) {
+    std::cerr << "invalid poll interval " << poll->second << std::endl;
+    return false;
+  }
+  global.control = control;
+  return true;
+}
+
+// Choose how state is captured. Options are:
+//   fields=<scan|watch>  read every field at every step (the default), or
+//                        keep shadow copies up to date by watching writes
+//   depth=<n>            how many references to follow when capturing
+//                        objects; arrays and strings need at least 1
+//                        (default 0)
+//   elements=<n>         how many elements of arrays and strings to capture
+//                        (default 1024)
+//   mode=<step|call>     record every step (the default), or only calls to
+//                        and returns from traced methods
+//   compare=<fingerprint|exact>
+//                        with `stateOnly`, drop steps whose state has the
+//                        same fingerprint as before (the default), or only
+//                        those whose state is really the same
+//   filter=<filter>      only capture steps that pass this filter, unless
+//                        the receiver has its own (see `filter_parser`)
+//   capabilities=<load|start>
+//                        add the capabilities that tracing needs when the
+//                        agent loads, or when tracing first starts
+//                        (default: when tracing starts unless the VM is
+//                        HotSpot)
+bool configure_capture(
+  const std::unordered_map<std::string, std::string>& options
+  )
+{
+  auto filter = options.find("filter");
+  if (filter != options.end()) {
+    filter_program program;
+    std::string error;
+    if (!compile_filter(filter->second, program, global.symbols, error)) {
+      std::cerr << "invalid filter: " << error << std::endl;
+      return false;
+    }
+    global.filter_option = filter->second;
+  }
+
+  auto compare = options.find("compare");
+  if (compare != options.end()) {
+    if (compare->second == "exact") global.exact_compare = true;
+    else if (compare->second != "fingerprint") {
+      std::cerr << "invalid comparison " << compare->second << std::endl;
+      return false;
+    }
+  }
+
+  auto capabilities = options.find("capabilities");
+  if (capabilities != options.end()) {
+    if (capabilities->second == "load")
+      global.capabilities = global_state::CAPABILITIES_LOAD;
+    else if (capabilities->second == "start")
+      global.capabilities = global_state::CAPABILITIES_START;
+    else {
+      std::cerr << "invalid capability policy " << capabilities->second
+                << std::endl;
+      return false;
+    }
+  }
+
+  auto mode = options.find("mode");
+  if (mode != options.end()) {
+    if (mode->second == "call") global.call_mode = true;
+    else if (mode->second != "step") {
+      std::cerr << "invalid tracing mode " << mode->second << std::endl;
+      return false;
+    }
+  }
+
+  auto fields = options.find("fields");
+  if (fields != options.end()) {
+    if (fields->second == "watch") global.watch_fields = true;
+    else if (fields->second != "scan") {
+      std::cerr << "invalid field capture mode " << fields->second << std::endl;
+      return false;
+    }
+  }
+
+  auto depth = options.find("depth");
+  if (depth != options.end())
+    global.capture_depth = std::atoi(depth->second.c_str());
+
+  auto elements = options.find("elements");
+  if (elements != options.end())
+    global.capture_elements = (jsize)parse_size(elements->second);
+
+  return true;
+}
+
+// Set up sampling of single steps. Options are:
+//   sample=<n>           record every nth step of each method
+//   rate=<n>             record at most n steps per second per thread
+//   cpu=<percent>        adapt how many steps are recorded to keep the time
+//                        each thread spends in the agent under this share
+// Steps that enter or leave a method, return, throw or leave a loop are
+// always recorded.
+bool configure_sampling(
+  const std::unordered_map<std::string, std::string>& options
+  )
+{
+  auto every = options.find("sample");
+  if (every != options.end())
+    global.sample_every = (uint32_t)parse_size(every->second);
+
+  auto rate = options.find("rate");
+  if (rate != options.end()) global.sample_rate = parse_size(rate->second);
+
+  auto cpu = options.find("cpu");
+  if (cpu != options.end()) {
+    global.sample_cpu = std::atof(cpu->second.c_str()) / 100;
+    if (global.sample_cpu <= 0 || global.sample_cpu > 1) {
+      std::cerr << "invalid cpu target " << cpu->second << std::endl;
+      return false;
+    }
+  }
+
+  global.sampling = global.sample_every > 1 || global.sample_rate > 0
+    || global.sample_cpu > 0;
+  return true;
+}
+
+// Turn on performance counters. Options are:
+//   stats[=<path>]       keep counters and latency histograms, and report
+//                        them at every `end()` and when the VM exits, to
+//                        this file (appended) and to the receiver's
+//                        `stats(String)` method if it has one
+void configure_stats(
+  const std::unordered_map<std::string, std::string>& options
+  )
+{
+  auto stats = options.find("stats");
+  if (stats == options.end()) return;
+  global.stats = true;
+  global.stats_path = stats->second;
+}
+
+// Set up chunked delivery, for receivers with the chunked `receive`.
+// Options are:
+//   chunk=<n>            about how many steps go in each chunk (default
+//                        16384)
+//   workers=<n>          how many threads encode chunks (default one per
+//                        core, up to 4)
+bool configure_delivery(
+  const std::unordered_map<std::string, std::string>& options
+  )
+{
+  auto chunk = options.find("chunk");
+  if (chunk != options.end()) {
+    global.chunk_steps = parse_size(chunk->second);
+    if (global.chunk_steps == 0) {
+      std::cerr << "invalid chunk size " << chunk->second << std::endl;
+      return false;
+    }
+  }
+
+  auto workers = options.find("workers");
+  if (workers != options.end()) {
+    global.chunk_workers = parse_size(workers->second);
+    if (global.chunk_workers == 0) {
+      std::cerr << "invalid worker count " << workers->second << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Set up the memory budget for recorded steps. Options are:
+//   budget=<size>           how much memory recorded steps may use (default
+//                           no limit)
+//   over=<spill|truncate>   whether to spill steps to a temporary file or
+//                           stop recording when over budget (default spill)
+bool configure_budget(
+  const std::unordered_map<std::string, std::string>& options
+  )
+{
+  auto budget = options.find("budget");
+  if (budget != options.end())
+    global.memory_budget = parse_size(budget->second);
+
+  auto over = options.find("over");
+  if (over != options.end()) {
+    if (over->second == "spill") global.over_budget = global_state::SPILL;
+    else if (over->second == "truncate")
+      global.over_budget = global_state::TRUNCATE;
+    else {
+      std::cerr << "invalid budget policy " << over->second << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Initialize everything. `live` is set when attaching to a running VM,
+// which won't send VM start and init events.
+jint start_agent(JavaVM *jvm, char *options, bool live)
+{
+  jvmtiEnv *jvmti = NULL;
+
+  std::unordered_map<std::string, std::string> agent_options =
+    parse_options(options);
+  if (!configure_stream(agent_options)) return JNI_ERR;
+  if (!configure_archive(agent_options)) return JNI_ERR;
+  if (!configure_shm(agent_options)) return JNI_ERR;
+  if (!configure_capture(agent_options)) return JNI_ERR;
+  if (!configure_budget(agent_options)) return JNI_ERR;
+  if (!configure_sampling(agent_options)) return JNI_ERR;
+  if (!configure_control(agent_options)) return JNI_ERR;
+  if (!configure_delivery(agent_options)) return JNI_ERR;
+  configure_stats(agent_options);
+
+  global.this_symbol = intern("this");
+  global.return_symbol = intern("return");
+
+  jint res = jvm->GetEnv((void **)&jvmti, JVMTI_VERSION_1_0);
+  if (res != JNI_OK || jvmti == NULL) {
     std::cerr << "unable to access JVMTI version 1.0" << std::endl;
     return JNI_ERR;
   }
 
+  // Watching for `start()` only needs breakpoints. The capabilities that
+  // tracing needs can keep the JIT from optimizing as well as it would, so
+  // they are added when tracing first starts if the VM can still grant
+  // them then (see `defer_capabilities`). An attached agent always waits,
+  // and checks that it can have them.
   jvmtiCapabilities capa;
   jvmtiError error;
   std::memset(&capa, 0, sizeof(capa));
 
-  capa.can_generate_single_step_events = 1;
-  capa.can_generate_method_entry_events = 1;
+  capa.can_generate_breakpoint_events = 1;
   capa.can_get_line_numbers = 1;
   capa.can_get_source_file_name = 1;
-  capa.can_access_local_variables = 1;
+  capa.can_tag_objects = 1;
+  if (global.sampling) capa.can_get_bytecodes = 1;
+  if (live) {
+    if (!tracing_capabilities_potential(jvmti)) {
+      std::cerr
+        << "unable to trace: this VM only grants the capabilities jtrace "
+        << "needs at startup" << std::endl;
+      return JNI_ERR;
+    }
+    global.capabilities_pending = true;
+  } else if (defer_capabilities(jvmti)) {
+    global.capabilities_pending = true;
+  } else {
+    add_tracing_capabilities(capa);
+  }
 
   error = jvmti->AddCapabilities(&capa);
   check_jvmti_error(
     jvmti, error, "unable to set necessary capabilities"
     );
+  if (error != JVMTI_ERROR_NONE && live) return JNI_ERR;
 
   jvmtiEventCallbacks callbacks;
   std::memset(&callbacks, 0, sizeof(callbacks));
@@ -604,18 +5397,76 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *jvm, char *options, void *reserved)
   callbacks.SingleStep = cb_single_step;
   callbacks.VMStart = cb_vm_start;
   callbacks.MethodEntry = cb_method_enter;
+  callbacks.MethodExit = cb_method_exit;
+  callbacks.Breakpoint = cb_breakpoint;
+  callbacks.ClassPrepare = cb_class_prepare;
+  callbacks.VMInit = cb_vm_init;
+  callbacks.VMDeath = cb_vm_death;
+  callbacks.ThreadStart = cb_thread_start;
+  callbacks.ThreadEnd = cb_thread_end;
+  callbacks.FramePop = cb_frame_pop;
+  callbacks.FieldModification = cb_field_modification;
 
   error = jvmti->SetEventCallbacks(&callbacks, (jint) sizeof(callbacks));
   check_jvmti_error(jvmti, error, "unable to set event callbacks");
 
+  // Method entry events stay off unless a thread is skipping untraced
+  // code, so an idle agent costs nothing per call.
+  error = jvmti->SetEventNotificationMode(
+    JVMTI_ENABLE, JVMTI_EVENT_BREAKPOINT, (jthread) NULL
+    );
+  check_jvmti_error(jvmti, error, "unable to set event notification");
+  // With a control file, class prepare events are only on while a trigger
+  // is armed. Otherwise they look for receiver classes.
+  if (!global.control) {
+    error = jvmti->SetEventNotificationMode(
+      JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, (jthread) NULL
+      );
+    check_jvmti_error(jvmti, error, "unable to set event notification");
+  }
   error = jvmti->SetEventNotificationMode(
-    JVMTI_ENABLE, JVMTI_EVENT_METHOD_ENTRY, (jthread) NULL
+    JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, (jthread) NULL
     );
   check_jvmti_error(jvmti, error, "unable to set event notification");
   error = jvmti->SetEventNotificationMode(
     JVMTI_ENABLE, JVMTI_EVENT_VM_START, (jthread) NULL
     );
   check_jvmti_error(jvmti, error, "unable to set event notification");
+  error = jvmti->SetEventNotificationMode(
+    JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, (jthread) NULL
+    );
+  check_jvmti_error(jvmti, error, "unable to set event notification");
 
+  if (global.control) {
+    global.control->jvm = jvm;
+    global.control->jvmti = jvmti;
+  }
+  if (!live) return JNI_OK;
+
+  // The VM is already running, so do what the VM start and init callbacks
+  // would have.
+  JNIEnv *jni = NULL;
+  res = jvm->GetEnv((void **)&jni, JNI_VERSION_1_6);
+  if (res != JNI_OK || jni == NULL) {
+    std::cerr << "unable to access JNI" << std::endl;
+    return JNI_ERR;
+  }
+  global.jvm_started = true;
+  if (!global.control) watch_loaded_receivers(jvmti, jni);
+  if (global.control)
+    global.control->watcher = std::thread(control_watch, global.control);
   return JNI_OK;
 }
+
+// 'OnLoad' callback, when the agent is loaded at startup.
+JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *jvm, char *options, void *reserved)
+{
+  return start_agent(jvm, options, false);
+}
+
+// 'OnAttach' callback, when the agent is loaded into a running VM, e.g.
+// with `jcmd <pid> JVMTI.agent_load <PATH TO JTRACE> <options>`.
+JNIEXPORT jint JNICALL Agent_OnAttach(JavaVM *jvm, char *options, void *reserved)
+{
+  return start_agent(jvm, options, true);
+}
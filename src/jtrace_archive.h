@@ -0,0 +1,439 @@
+// jtrace_archive.h
+//
+// Seekable trace archives: traces split into independently compressed
+// blocks, with an index at the end of the file that says which steps,
+// threads and times each block covers. Readers memory-map the file and only
+// decompress the blocks they need. Like jtrace_format.h, this does not
+// depend on JNI.
+//
+// An archive is laid out as follows (integers are LEB128 varints unless
+// noted otherwise):
+//
+//   archive := "JTRA" version block* index index_offset(8 bytes) "JTRA"
+//   block   := compressed bytes
+//   index   := count entry*
+//   entry   := offset compressed_size raw_size first_step step_count
+//              first_time last_time thread_count thread*
+//
+// Every block decompresses to a complete trace in the format of
+// jtrace_format.h, which defines all of the symbols it uses. Steps are
+// numbered across the whole archive, in sequence order. Times are the
+// nanoseconds since tracing started that steps carry.
+//
+// Blocks are compressed with a small LZ77 scheme so that archives can be
+// written and read without any outside library. A compressed block is a
+// series of sequences:
+//
+//   sequence := literal_count literal* (distance match_length)?
+//
+// where a match copies `match_length + 4` bytes from `distance` bytes back.
+// The last sequence has no match.
+
+#ifndef JTRACE_ARCHIVE_H
+#define JTRACE_ARCHIVE_H
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "jtrace_format.h"
+
+static const char archive_magic[4] = { 'J', 'T', 'R', 'A' };
+static const uint64_t archive_version = 1;
+static const size_t archive_min_match = 4;
+// No block is bigger than this, so a corrupt index can't make readers
+// allocate without bound.
+static const uint64_t archive_max_block = 1 << 30;
+
+// Where a block is and what it holds.
+struct archive_block
+{
+  uint64_t offset = 0;
+  uint64_t compressed_size = 0;
+  uint64_t raw_size = 0;
+  uint64_t first_step = 0;
+  uint64_t step_count = 0;
+  uint64_t first_time = 0;
+  uint64_t last_time = 0;
+  std::vector<uint64_t> threads;
+};
+
+inline uint32_t archive_read32(const uint8_t *p)
+{
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline void archive_compress(const std::string& in, std::string& out)
+{
+  static const int hash_bits = 14;
+  std::vector<int64_t> table(1 << hash_bits, -1);
+  const uint8_t *data = (const uint8_t *)in.data();
+  size_t size = in.size();
+  size_t literal_start = 0;
+  size_t pos = 0;
+
+  while (pos + archive_min_match <= size) {
+    uint32_t hash = (archive_read32(data + pos) * 2654435761u) >> (32 - hash_bits);
+    int64_t candidate = table[hash];
+    table[hash] = pos;
+    if (candidate < 0
+        || archive_read32(data + candidate) != archive_read32(data + pos)) {
+      ++pos;
+      continue;
+    }
+
+    size_t length = archive_min_match;
+    while (pos + length < size && data[candidate + length] == data[pos + length])
+      ++length;
+
+    trace_put_varint(out, pos - literal_start);
+    out.append(in, literal_start, pos - literal_start);
+    trace_put_varint(out, pos - candidate);
+    trace_put_varint(out, length - archive_min_match);
+    pos += length;
+    literal_start = pos;
+  }
+
+  trace_put_varint(out, size - literal_start);
+  out.append(in, literal_start, size - literal_start);
+}
+
+// Decompress a block that is known to be `raw_size` bytes long. Returns
+// false if it is malformed, including when it would grow past `raw_size` or
+// doesn't use all of `size` bytes.
+inline bool archive_decompress(
+  const uint8_t *data,
+  size_t size,
+  size_t raw_size,
+  std::string& out
+  )
+{
+  const uint8_t *limit = data + size;
+  auto get_varint = [&](uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (data >= limit) return false;
+      uint8_t byte = *data++;
+      value |= (uint64_t)(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+  };
+
+  out.clear();
+  if (raw_size > archive_max_block) return false;
+  out.reserve(raw_size);
+  // Every block ends with a sequence that has no match, even if it has no
+  // literals either.
+  while (true) {
+    uint64_t literals;
+    if (!get_varint(literals) || literals > (uint64_t)(limit - data)
+        || literals > raw_size - out.size())
+      return false;
+    out.append((const char *)data, literals);
+    data += literals;
+    if (out.size() >= raw_size) break;
+
+    uint64_t distance, length;
+    if (!get_varint(distance) || !get_varint(length)) return false;
+    length += archive_min_match;
+    if (length < archive_min_match || length > raw_size - out.size())
+      return false;
+    if (distance == 0 || distance > out.size()) return false;
+    // Matches may overlap what they produce, so copy byte by byte.
+    size_t from = out.size() - distance;
+    for (uint64_t i = 0; i < length; ++i) out.push_back(out[from + i]);
+  }
+  return out.size() == raw_size && data == limit;
+}
+
+// Writes an archive block by block. Callers encode steps into `encoder()`
+// and call `step` for each, and blocks are finished once they are big
+// enough.
+class archive_writer
+{
+public:
+  explicit archive_writer(FILE *file, size_t block_size = 64 << 10)
+    : file(file), block_size(block_size), offset(0), step_count(0)
+  {
+    std::string header(archive_magic, sizeof(archive_magic));
+    trace_put_varint(header, archive_version);
+    write(header);
+  }
+
+  // The encoder for the current block, starting a block if needed.
+  trace_encoder& encoder()
+  {
+    if (!block_encoder) start_block();
+    return *block_encoder;
+  }
+
+  // Account for a step that was just encoded, and finish the block if it is
+  // big enough.
+  void step(uint64_t thread, uint64_t time)
+  {
+    archive_block& block = blocks.back();
+    if (block.step_count++ == 0) block.first_time = time;
+    block.first_time = std::min(block.first_time, time);
+    block.last_time = std::max(block.last_time, time);
+    threads.insert(thread);
+    ++step_count;
+    if (raw.size() >= block_size) finish_block();
+  }
+
+  // Finish the last block and write the index. Returns false if any write
+  // failed.
+  bool close()
+  {
+    if (block_encoder) finish_block();
+    std::string index;
+    trace_put_varint(index, blocks.size());
+    for (const auto& block : blocks) {
+      trace_put_varint(index, block.offset);
+      trace_put_varint(index, block.compressed_size);
+      trace_put_varint(index, block.raw_size);
+      trace_put_varint(index, block.first_step);
+      trace_put_varint(index, block.step_count);
+      trace_put_varint(index, block.first_time);
+      trace_put_varint(index, block.last_time);
+      trace_put_varint(index, block.threads.size());
+      for (uint64_t thread : block.threads) trace_put_varint(index, thread);
+    }
+    trace_put_fixed(index, offset, 8);
+    index.append(archive_magic, sizeof(archive_magic));
+    write(index);
+    return !failed;
+  }
+
+private:
+  void write(const std::string& data)
+  {
+    if (std::fwrite(data.data(), 1, data.size(), file) != data.size())
+      failed = true;
+    offset += data.size();
+  }
+
+  void start_block()
+  {
+    raw.clear();
+    block_encoder.reset(new trace_encoder(raw));
+    threads.clear();
+    archive_block block;
+    block.first_step = step_count;
+    blocks.push_back(block);
+  }
+
+  void finish_block()
+  {
+    block_encoder->end();
+    block_encoder.reset();
+    std::string compressed;
+    archive_compress(raw, compressed);
+
+    archive_block& block = blocks.back();
+    block.offset = offset;
+    block.compressed_size = compressed.size();
+    block.raw_size = raw.size();
+    block.threads.assign(threads.begin(), threads.end());
+    write(compressed);
+  }
+
+  FILE *file;
+  size_t block_size;
+  uint64_t offset;
+  uint64_t step_count;
+  bool failed = false;
+  std::string raw;
+  std::unique_ptr<trace_encoder> block_encoder;
+  std::set<uint64_t> threads;
+  std::vector<archive_block> blocks;
+};
+
+// Reads an archive through a memory mapping.
+class archive_reader
+{
+public:
+  archive_reader() {}
+  archive_reader(const archive_reader&) = delete;
+  archive_reader& operator=(const archive_reader&) = delete;
+  ~archive_reader()
+  {
+    if (data != NULL) munmap((void *)data, size);
+  }
+
+  // Map a file and read its index. Returns false and sets `error()` if it
+  // isn't an archive.
+  bool open(const char *path)
+  {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return fail("unable to open archive");
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      ::close(fd);
+      return fail("unable to open archive");
+    }
+    size = info.st_size;
+    void *mapping = size > 0
+      ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (mapping == MAP_FAILED) return fail("unable to map archive");
+    data = (const uint8_t *)mapping;
+    return read_index();
+  }
+
+  const std::string& error() const { return error_message; }
+  const std::vector<archive_block>& blocks() const { return block_index; }
+
+  uint64_t step_count() const
+  {
+    if (block_index.empty()) return 0;
+    return block_index.back().first_step + block_index.back().step_count;
+  }
+
+  // The block that holds step `step`, or `blocks().size()` if there is none.
+  size_t find_step(uint64_t step) const
+  {
+    auto found = std::upper_bound(
+      block_index.begin(), block_index.end(), step,
+      [](uint64_t step, const archive_block& block) {
+        return step < block.first_step;
+      });
+    if (found == block_index.begin()) return block_index.size();
+    --found;
+    if (step >= found->first_step + found->step_count)
+      return block_index.size();
+    return found - block_index.begin();
+  }
+
+  // The blocks with steps between `begin` and `end` nanoseconds.
+  std::vector<size_t> find_time(uint64_t begin, uint64_t end) const
+  {
+    std::vector<size_t> result;
+    for (size_t i = 0; i < block_index.size(); ++i)
+      if (block_index[i].last_time >= begin && block_index[i].first_time <= end)
+        result.push_back(i);
+    return result;
+  }
+
+  // The blocks with steps from thread `thread`.
+  std::vector<size_t> find_thread(uint64_t thread) const
+  {
+    std::vector<size_t> result;
+    for (size_t i = 0; i < block_index.size(); ++i) {
+      const auto& threads = block_index[i].threads;
+      if (std::binary_search(threads.begin(), threads.end(), thread))
+        result.push_back(i);
+    }
+    return result;
+  }
+
+  // Decompress a block into a trace that `trace_decoder` can read.
+  bool read_block(size_t index, std::string& trace)
+  {
+    const archive_block& block = block_index[index];
+    if (!archive_decompress(
+          data + block.offset, block.compressed_size, block.raw_size, trace
+          ))
+      return fail("malformed block");
+    return true;
+  }
+
+  // Decode a single step by its number.
+  bool read_step(uint64_t step, decoded_step& result)
+  {
+    size_t index = find_step(step);
+    if (index == block_index.size()) return fail("no such step");
+    std::string trace;
+    if (!read_block(index, trace)) return false;
+    trace_decoder decoder((const uint8_t *)trace.data(), trace.size());
+    for (uint64_t i = block_index[index].first_step; i <= step; ++i)
+      if (!decoder.next(result))
+        return fail(decoder.error().empty() ? "truncated block" : "bad block");
+    return true;
+  }
+
+private:
+  bool fail(const char *message)
+  {
+    error_message = message;
+    return false;
+  }
+
+  bool read_index()
+  {
+    size_t trailer = 8 + sizeof(archive_magic);
+    if (size < sizeof(archive_magic) + trailer
+        || std::memcmp(data, archive_magic, sizeof(archive_magic)) != 0
+        || std::memcmp(
+          data + size - sizeof(archive_magic), archive_magic,
+          sizeof(archive_magic)
+          ) != 0)
+      return fail("not a jtrace archive");
+
+    uint64_t index_offset = 0;
+    for (int i = 0; i < 8; ++i)
+      index_offset |= (uint64_t)data[size - trailer + i] << (8 * i);
+    if (index_offset > size - trailer) return fail("malformed index");
+
+    pos = data + sizeof(archive_magic);
+    limit = data + index_offset;
+    uint64_t version;
+    if (!get_varint(version)) return false;
+    if (version != archive_version) return fail("unsupported archive version");
+
+    pos = data + index_offset;
+    limit = data + size - trailer;
+    uint64_t count;
+    if (!get_varint(count)) return false;
+    for (uint64_t i = 0; i < count; ++i) {
+      archive_block block;
+      uint64_t thread_count;
+      if (!get_varint(block.offset) || !get_varint(block.compressed_size)
+          || !get_varint(block.raw_size) || !get_varint(block.first_step)
+          || !get_varint(block.step_count) || !get_varint(block.first_time)
+          || !get_varint(block.last_time) || !get_varint(thread_count))
+        return false;
+      if (block.offset > index_offset
+          || block.compressed_size > index_offset - block.offset
+          || block.raw_size > archive_max_block)
+        return fail("malformed index");
+      // Every thread takes at least a byte.
+      if (thread_count > (uint64_t)(limit - pos))
+        return fail("truncated index");
+      block.threads.resize(thread_count);
+      for (auto& thread : block.threads)
+        if (!get_varint(thread)) return false;
+      block_index.push_back(block);
+    }
+    return true;
+  }
+
+  bool get_varint(uint64_t& value)
+  {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (pos >= limit) return fail("truncated index");
+      uint8_t byte = *pos++;
+      value |= (uint64_t)(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) return true;
+    }
+    return fail("malformed varint");
+  }
+
+  const uint8_t *data = NULL;
+  size_t size = 0;
+  const uint8_t *pos = NULL;
+  const uint8_t *limit = NULL;
+  std::vector<archive_block> block_index;
+  std::string error_message;
+};
+
+#endif
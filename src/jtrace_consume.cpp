@@ -0,0 +1,132 @@
+// jtrace_consume.cpp
+//
+// Reads the shared memory rings of a running jtrace agent and writes each
+// thread's traces to its own file, so that writing traces out happens
+// outside of the traced JVM.
+//
+// usage: jtrace-consume <shm name> <output prefix>
+//
+// The agent must be loaded with `shm=<name>`. The traces of thread n are
+// appended to `<prefix>.<n>.jtr`, one per traced region, and can be read
+// with jtrace-decode. If the agent had to cut one of them short, the
+// thread's later traces go to `<prefix>.<n>.1.jtr` and so on. This waits for the agent if it hasn't started yet,
+// and exits once the VM has exited and every ring is drained.
+
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include "jtrace_shm.h"
+
+int main(int argc, char **argv)
+{
+  if (argc != 3) {
+    std::cerr << "usage: jtrace-consume <shm name> <output prefix>" << std::endl;
+    return 2;
+  }
+  std::string name = argv[1];
+  if (name[0] != '/') name = "/" + name;
+  std::string prefix = argv[2];
+
+  shm_region region;
+  bool waiting = false;
+  while (!region.open(name)) {
+    if (!waiting) std::cerr << "waiting for " << name << std::endl;
+    waiting = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+
+  std::vector<FILE *> files(region.ring_count(), NULL);
+  // How many of each thread's traces were cut short. Traces that follow one
+  // go to a new file, `<prefix>.<thread>.<n>.jtr`.
+  std::unordered_map<uint32_t, uint32_t> broken;
+  std::string chunk;
+
+  // Free a ring once it is drained. A retired ring's last bytes were
+  // written before it was retired, so they have been read.
+  auto retire = [&](uint32_t i, uint32_t state) {
+    shm_ring& ring = region.ring(i);
+    if (files[i] != NULL) std::fclose(files[i]);
+    files[i] = NULL;
+    if (state == SHM_RING_BROKEN) {
+      std::cerr << "trace of thread " << ring.owner << " was cut short"
+                << std::endl;
+      ++broken[ring.owner];
+    }
+    ring.state.store(SHM_RING_FREE, std::memory_order_release);
+  };
+
+  // Append what a ring holds to its thread's file. Returns false if the
+  // file can't be written.
+  std::function<bool(uint32_t, bool&)> drain = [&](uint32_t i, bool& read) {
+    shm_ring& ring = region.ring(i);
+    chunk.clear();
+    read = shm_read(region, i, chunk) > 0;
+    if (!read) return true;
+    if (files[i] == NULL) {
+      // A broken ring of the same thread that we haven't freed yet was
+      // broken before this one was claimed, so it goes first.
+      for (uint32_t j = 0; j < region.ring_count(); ++j) {
+        shm_ring& other = region.ring(j);
+        if (j == i || other.owner != ring.owner
+            || other.state.load(std::memory_order_acquire) != SHM_RING_BROKEN)
+          continue;
+        std::string held;
+        held.swap(chunk);
+        bool other_read;
+        if (!drain(j, other_read)) return false;
+        retire(j, SHM_RING_BROKEN);
+        chunk.swap(held);
+      }
+
+      std::string path = prefix + "." + std::to_string(ring.owner);
+      auto cut = broken.find(ring.owner);
+      if (cut != broken.end()) path += "." + std::to_string(cut->second);
+      path += ".jtr";
+      files[i] = std::fopen(path.c_str(), "ab");
+      if (files[i] == NULL) {
+        std::cerr << "unable to open " << path << std::endl;
+        return false;
+      }
+    }
+    if (std::fwrite(chunk.data(), 1, chunk.size(), files[i]) != chunk.size()) {
+      std::cerr << "unable to write trace" << std::endl;
+      return false;
+    }
+    return true;
+  };
+
+  while (true) {
+    // Everything the agent wrote before closing is drained by this pass.
+    // The heartbeat tells the agent that we are still reading.
+    bool closed = region.header()->closed.load(std::memory_order_acquire);
+    region.header()->heartbeat.fetch_add(1, std::memory_order_release);
+    bool idle = true;
+
+    for (uint32_t i = 0; i < region.ring_count(); ++i) {
+      uint32_t state = region.ring(i).state.load(std::memory_order_acquire);
+      if (state == SHM_RING_FREE) continue;
+
+      bool read;
+      if (!drain(i, read)) return 1;
+      if (read) idle = false;
+      if (state == SHM_RING_RETIRED || state == SHM_RING_BROKEN)
+        retire(i, state);
+    }
+
+    if (closed) break;
+    if (idle) {
+      for (FILE *file : files)
+        if (file != NULL) std::fflush(file);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  for (FILE *file : files)
+    if (file != NULL) std::fclose(file);
+  return 0;
+}
@@ -0,0 +1,278 @@
+// jtrace_decode.cpp
+//
+// Converts binary traces and archives produced by the jtrace agent into
+// TOML.
+//
+// usage: jtrace-decode [--check] [--step <n>] <trace or archive file>
+//
+// With `--check`, the trace is also re-encoded and compared byte for byte
+// with the input, which is how the round-trip tests use this tool. Archives
+// are checked block by block. With `--step`, only step `n` of an archive is
+// printed, and only the block that holds it is decompressed.
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include "jtrace_archive.h"
+
+void write_state(
+  std::ostream& output,
+  const std::string& prefix,
+  const std::vector<decoded_var>& state
+  )
+{
+  for (const auto& var : state) {
+    output
+      << prefix << "."
+      << "\"" << var.name << "\".signature = "
+      << "\"" << var.signature << "\""
+      << std::endl
+      << prefix << "."
+      << "\"" << var.name << "\".value = ";
+    trace_write_value(output, var.value);
+    output << std::endl;
+  }
+}
+
+void encode_state(
+  trace_encoder& encoder,
+  const std::vector<decoded_var>& state
+  )
+{
+  encoder.begin_state(state.size());
+  for (const auto& var : state)
+    encoder.var(var.name_id, var.signature_id, var.value);
+}
+
+// Re-encode a step, defining symbols in the same order as the agent.
+void encode_step(trace_encoder& encoder, const decoded_step& step)
+{
+  encoder.symbol(step.class_id, step.class_name);
+  encoder.symbol(step.method_id, step.method_name);
+  encoder.symbol(step.method_signature_id, step.method_signature);
+  encoder.symbol(step.file_id, step.file_name);
+  for (const auto *state :
+         { &step.local_state, &step.instance_state, &step.class_state })
+    for (const auto& var : *state) {
+      encoder.symbol(var.name_id, var.name);
+      encoder.symbol(var.signature_id, var.signature);
+    }
+  for (const auto& object : step.objects) {
+    encoder.symbol(object.class_id, object.class_name);
+    for (const auto& var : object.fields) {
+      encoder.symbol(var.name_id, var.name);
+      encoder.symbol(var.signature_id, var.signature);
+    }
+  }
+
+  for (const auto& object : step.objects) {
+    if (object.is_array) {
+      encoder.array(
+        object.tag,
+        object.version,
+        object.class_id,
+        object.length,
+        object.element_type,
+        object.contents
+        );
+    } else {
+      encoder.object(object.tag, object.version, object.class_id);
+      encode_state(encoder, object.fields);
+    }
+  }
+
+  encoder.begin_step(
+    step.thread,
+    step.sequence,
+    step.time,
+    step.event,
+    step.skipped,
+    step.class_id,
+    step.method_id,
+    step.method_signature_id,
+    step.file_id,
+    step.line
+    );
+  encode_state(encoder, step.local_state);
+  encode_state(encoder, step.instance_state);
+  encode_state(encoder, step.class_state);
+}
+
+// Print a step, and the object versions that precede it, as TOML.
+void write_step(std::ostream& output, size_t index, const decoded_step& step)
+{
+  for (const auto& object : step.objects) {
+    output
+      << "[object." << object.tag << "." << object.version << "]"
+      << std::endl
+      << "class = \"" << object.class_name << "\"" << std::endl;
+    if (object.is_array)
+      trace_write_contents(
+        output,
+        object.length,
+        object.element_type,
+        object.contents,
+        object.class_name == "Ljava/lang/String;"
+        );
+    else write_state(output, "field", object.fields);
+  }
+  output
+    << "["
+    << "step" << index << "."
+    << "\"" << step.class_name << "\"."
+    << "\"" << step.method_name << "\""
+    << "]"
+    << std::endl
+    << "thread = " << step.thread << std::endl
+    << "sequence = " << step.sequence << std::endl
+    << "time = " << step.time << std::endl
+    << "event = \"" << trace_event_name(step.event) << "\"" << std::endl
+    << "signature = \"" << step.method_signature << "\"" << std::endl
+    << "file = \"" << step.file_name << "\"" << std::endl
+    << "line = " << step.line << std::endl;
+  if (step.skipped > 0) output << "skipped = " << step.skipped << std::endl;
+  write_state(output, "local", step.local_state);
+  write_state(output, "instance", step.instance_state);
+  write_state(output, "class", step.class_state);
+}
+
+// Print every trace in `input`, which may hold several back to back, and
+// re-encode them into `reencoded` if checking. Returns false on error.
+bool decode_traces(
+  const char *path,
+  const std::string& input,
+  bool check,
+  size_t& step_index,
+  std::string& reencoded
+  )
+{
+  size_t offset = 0;
+  while (offset < input.size()) {
+    trace_decoder decoder(
+      (const uint8_t *)input.data() + offset, input.size() - offset
+      );
+    trace_encoder encoder(reencoded);
+    decoded_step step;
+    while (decoder.next(step)) {
+      write_step(std::cout, step_index++, step);
+      if (check) encode_step(encoder, step);
+    }
+
+    if (!decoder.error().empty()) {
+      std::cerr << path << ": " << decoder.error() << std::endl;
+      return false;
+    }
+    if (decoder.dropped() > 0) {
+      std::cerr
+        << path << ": " << decoder.dropped() << " steps dropped" << std::endl;
+      encoder.dropped(decoder.dropped());
+    }
+    if (decoder.truncated() > 0) {
+      std::cerr
+        << path << ": " << decoder.truncated() << " steps truncated"
+        << std::endl;
+      encoder.truncated(decoder.truncated());
+    }
+    encoder.end();
+    offset += decoder.offset();
+  }
+  return true;
+}
+
+// Print an archive, or a single step of it.
+int decode_archive(const char *path, bool check, bool one_step, uint64_t step)
+{
+  archive_reader archive;
+  if (!archive.open(path)) {
+    std::cerr << path << ": " << archive.error() << std::endl;
+    return 1;
+  }
+
+  if (one_step) {
+    decoded_step result;
+    if (!archive.read_step(step, result)) {
+      std::cerr << path << ": " << archive.error() << std::endl;
+      return 1;
+    }
+    write_step(std::cout, step, result);
+    return 0;
+  }
+
+  size_t step_index = 0;
+  std::string block;
+  for (size_t i = 0; i < archive.blocks().size(); ++i) {
+    if (!archive.read_block(i, block)) {
+      std::cerr << path << ": " << archive.error() << std::endl;
+      return 1;
+    }
+    std::string reencoded;
+    if (!decode_traces(path, block, check, step_index, reencoded)) return 1;
+    if (check && reencoded != block) {
+      std::cerr << path << ": round trip mismatch in block " << i << std::endl;
+      return 1;
+    }
+  }
+  if (check) std::cerr << path << ": round trip ok" << std::endl;
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  bool check = false;
+  bool one_step = false;
+  uint64_t step = 0;
+  const char *path = NULL;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--check") == 0) check = true;
+    else if (std::strcmp(argv[i], "--step") == 0 && i + 1 < argc) {
+      one_step = true;
+      step = std::strtoull(argv[++i], NULL, 10);
+    }
+    else path = argv[i];
+  }
+  if (path == NULL) {
+    std::cerr
+      << "usage: jtrace-decode [--check] [--step <n>] <trace or archive file>"
+      << std::endl;
+    return 2;
+  }
+
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    std::cerr << "unable to open " << path << std::endl;
+    return 1;
+  }
+
+  // Archives are memory-mapped instead of read whole.
+  char magic[sizeof(archive_magic)] = {};
+  file.read(magic, sizeof(magic));
+  if (std::memcmp(magic, archive_magic, sizeof(magic)) == 0)
+    return decode_archive(path, check, one_step, step);
+  if (one_step) {
+    std::cerr << path << ": --step needs an archive" << std::endl;
+    return 2;
+  }
+
+  file.seekg(0);
+  std::string input(
+    (std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>()
+    );
+
+  // Streamed trace files hold one trace per traced region.
+  size_t step_index = 0;
+  std::string reencoded;
+  if (!decode_traces(path, input, check, step_index, reencoded)) return 1;
+
+  if (check) {
+    if (reencoded != input) {
+      std::cerr << path << ": round trip mismatch" << std::endl;
+      return 1;
+    }
+    std::cerr << path << ": round trip ok" << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,360 @@
+// jtrace_filter.h
+//
+// Step filters: the `filter` option and `Trace.filter`. This header holds
+// the symbol table filters intern variable names in, the compiled form of a
+// filter and its parser. Like jtrace_format.h, this does not depend on JNI,
+// so that the parser can be tested without a JDK. How filters are resolved
+// against methods and evaluated at steps is up to the agent.
+
+#ifndef JTRACE_FILTER_H
+#define JTRACE_FILTER_H
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Class, method and variable names and signatures are interned once and
+// referred to by id everywhere else.
+typedef uint32_t symbol_id;
+
+// The table is shared by all threads. Lookups only take a shared lock.
+struct symbol_table
+{
+  std::unordered_map<std::string, symbol_id> ids;
+  // A deque so that references to names stay valid as the table grows.
+  std::deque<std::string> names;
+  mutable std::shared_timed_mutex lock;
+
+  symbol_id intern(const std::string& name)
+  {
+    {
+      std::shared_lock<std::shared_timed_mutex> guard(lock);
+      auto found = ids.find(name);
+      if (found != ids.end()) return found->second;
+    }
+    std::lock_guard<std::shared_timed_mutex> guard(lock);
+    auto found = ids.find(name);
+    if (found != ids.end()) return found->second;
+    symbol_id id = (symbol_id)names.size();
+    names.push_back(name);
+    ids[name] = id;
+    return id;
+  }
+
+  const std::string& name(symbol_id id) const
+  {
+    std::shared_lock<std::shared_timed_mutex> guard(lock);
+    return names[id];
+  }
+};
+
+// A compiled filter. Expressions are trees of nodes kept in one vector,
+// which refer to their operands by index.
+struct filter_node
+{
+  enum kind_type
+  {
+    NUMBER,
+    NULL_VALUE,
+    // A local variable, or a field of the method's class if the method has
+    // no local by that name.
+    VARIABLE,
+    // An instance field of `this`.
+    THIS_FIELD,
+    // Whether the variable in `left` differs from when this thread last
+    // evaluated the node. Values are remembered in slot `slot`.
+    CHANGED,
+    NOT,
+    AND,
+    OR,
+    EQUAL,
+    NOT_EQUAL,
+    LESS,
+    LESS_EQUAL,
+    GREATER,
+    GREATER_EQUAL
+  };
+
+  kind_type kind = NUMBER;
+  // Number literals. Integral ones are compared exactly.
+  bool integral = true;
+  int64_t integer = 0;
+  double real = 0;
+  symbol_id name = 0;
+  uint32_t left = 0;
+  uint32_t right = 0;
+  uint32_t slot = 0;
+};
+
+// A filter rule holds for steps in methods matching `scope` (every method
+// if it is empty) at which its expression is true.
+struct filter_rule
+{
+  std::string scope;
+  uint32_t root = 0;
+};
+
+struct filter_program
+{
+  std::string source;
+  std::vector<filter_node> nodes;
+  std::vector<filter_rule> rules;
+  uint32_t changed_count = 0;
+};
+
+// Whether `text` matches `pattern`, where `*` matches any run of
+// characters.
+inline bool glob_match(const char *pattern, const char *text)
+{
+  const char *star = NULL;
+  const char *resume = NULL;
+  while (*text) {
+    if (*pattern == '*') {
+      star = pattern++;
+      resume = text;
+    } else if (*pattern == *text) {
+      ++pattern;
+      ++text;
+    } else if (star) {
+      pattern = star + 1;
+      text = ++resume;
+    } else {
+      return false;
+    }
+  }
+  while (*pattern == '*') ++pattern;
+  return *pattern == 0;
+}
+
+// Parses filters, which look like:
+//   filter  := rule (';' rule)*
+//   rule    := (pattern ':')? or
+//   or      := and ('||' and)*
+//   and     := unary ('&&' unary)*
+//   unary   := '!' unary | compare
+//   compare := operand (('==' | '!=' | '<' | '<=' | '>' | '>=') operand)?
+//   operand := number | 'true' | 'false' | 'null' | '(' or ')'
+//            | 'changed' '(' variable ')' | variable
+//   variable := ('this' '.')? name
+// Each method parses one level of the grammar and returns the index of the
+// node it built. Errors are recorded in `error`.
+struct filter_parser
+{
+  const std::string& text;
+  filter_program& program;
+  symbol_table& symbols;
+  size_t pos = 0;
+  std::string error;
+
+  filter_parser(
+    const std::string& text,
+    filter_program& program,
+    symbol_table& symbols
+    )
+    : text(text), program(program), symbols(symbols) {}
+
+  void skip_space()
+  {
+    while (pos < text.size() && std::isspace((unsigned char)text[pos])) ++pos;
+  }
+
+  bool accept(const char *token)
+  {
+    skip_space();
+    size_t size = std::strlen(token);
+    if (text.compare(pos, size, token) != 0) return false;
+    pos += size;
+    return true;
+  }
+
+  bool identifier(std::string& name)
+  {
+    skip_space();
+    size_t start = pos;
+    while (pos < text.size()
+           && (std::isalnum((unsigned char)text[pos]) || text[pos] == '_'
+               || text[pos] == '$'))
+      ++pos;
+    if (pos == start || std::isdigit((unsigned char)text[start])) {
+      pos = start;
+      return false;
+    }
+    name = text.substr(start, pos - start);
+    return true;
+  }
+
+  uint32_t add(const filter_node& node)
+  {
+    program.nodes.push_back(node);
+    return program.nodes.size() - 1;
+  }
+
+  uint32_t fail(const std::string& message)
+  {
+    if (error.empty())
+      error = message + (pos < text.size()
+                         ? " at `" + text.substr(pos, 16) + "`"
+                         : " at the end");
+    return 0;
+  }
+
+  uint32_t binary(filter_node::kind_type kind, uint32_t left, uint32_t right)
+  {
+    filter_node node;
+    node.kind = kind;
+    node.left = left;
+    node.right = right;
+    return add(node);
+  }
+
+  uint32_t parse_or()
+  {
+    uint32_t left = parse_and();
+    while (error.empty() && accept("||"))
+      left = binary(filter_node::OR, left, parse_and());
+    return left;
+  }
+
+  uint32_t parse_and()
+  {
+    uint32_t left = parse_unary();
+    while (error.empty() && accept("&&"))
+      left = binary(filter_node::AND, left, parse_unary());
+    return left;
+  }
+
+  uint32_t parse_unary()
+  {
+    skip_space();
+    if (text.compare(pos, 2, "!=") != 0 && accept("!"))
+      return binary(filter_node::NOT, parse_unary(), 0);
+    return parse_compare();
+  }
+
+  uint32_t parse_compare()
+  {
+    static const std::pair<const char *, filter_node::kind_type> operators[] = {
+      { "==", filter_node::EQUAL },
+      { "!=", filter_node::NOT_EQUAL },
+      { "<=", filter_node::LESS_EQUAL },
+      { ">=", filter_node::GREATER_EQUAL },
+      { "<", filter_node::LESS },
+      { ">", filter_node::GREATER }
+    };
+    uint32_t left = parse_operand();
+    if (!error.empty()) return left;
+    for (const auto& op : operators)
+      if (accept(op.first)) return binary(op.second, left, parse_operand());
+    return left;
+  }
+
+  uint32_t parse_variable()
+  {
+    std::string name;
+    if (!identifier(name)) return fail("expected a variable");
+    filter_node node;
+    node.kind = filter_node::VARIABLE;
+    if (name == "this" && accept(".")) {
+      if (!identifier(name)) return fail("expected a field");
+      node.kind = filter_node::THIS_FIELD;
+    }
+    node.name = symbols.intern(name);
+    return add(node);
+  }
+
+  uint32_t parse_operand()
+  {
+    skip_space();
+    if (accept("(")) {
+      uint32_t inner = parse_or();
+      if (error.empty() && !accept(")")) return fail("expected `)`");
+      return inner;
+    }
+
+    filter_node node;
+    const char *start = text.c_str() + pos;
+    char *end = NULL;
+    if (std::isdigit((unsigned char)*start)
+        || ((*start == '-' || *start == '.')
+            && std::isdigit((unsigned char)start[1]))) {
+      node.real = std::strtod(start, &end);
+      std::string literal(start, (const char *)end);
+      node.integral = literal.find_first_of(".eE") == std::string::npos;
+      node.integer = node.integral ? std::strtoll(start, NULL, 10) : 0;
+      pos += end - start;
+      return add(node);
+    }
+
+    size_t before = pos;
+    std::string word;
+    if (!identifier(word)) return fail("expected a value");
+    if (word == "true" || word == "false") {
+      node.integer = word == "true";
+      node.real = node.integer;
+      return add(node);
+    }
+    if (word == "null") {
+      node.kind = filter_node::NULL_VALUE;
+      return add(node);
+    }
+    if (word == "changed" && accept("(")) {
+      node.kind = filter_node::CHANGED;
+      node.left = parse_variable();
+      node.slot = program.changed_count++;
+      if (error.empty() && !accept(")")) return fail("expected `)`");
+      return add(node);
+    }
+    pos = before;
+    return parse_variable();
+  }
+};
+
+// Compile a filter, interning variable names in `symbols`. Returns false,
+// with a message in `error`, if it is malformed.
+inline bool compile_filter(
+  const std::string& source,
+  filter_program& program,
+  symbol_table& symbols,
+  std::string& error
+  )
+{
+  program.source = source;
+  std::istringstream input(source);
+  std::string text;
+  while (std::getline(input, text, ';')) {
+    filter_rule rule;
+    size_t colon = text.find(':');
+    if (colon != std::string::npos) {
+      std::istringstream scope(text.substr(0, colon));
+      scope >> rule.scope;
+      text = text.substr(colon + 1);
+    }
+    if (text.find_first_not_of(" \t\r\n") == std::string::npos) continue;
+
+    filter_parser parser(text, program, symbols);
+    rule.root = parser.parse_or();
+    parser.skip_space();
+    if (parser.error.empty() && parser.pos != text.size())
+      parser.fail("unexpected input");
+    if (!parser.error.empty()) {
+      error = parser.error;
+      return false;
+    }
+    program.rules.push_back(rule);
+  }
+  if (program.rules.empty()) {
+    error = "no rules";
+    return false;
+  }
+  return true;
+}
+
+#endif
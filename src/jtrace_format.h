@@ -0,0 +1,659 @@
+// jtrace_format.h
+//
+// The binary trace format produced by the jtrace agent, and a small
+// encoder/decoder pair for it. This header does not depend on JNI so that
+// tools which read traces can be built without a JDK.
+//
+// A trace is laid out as follows (all integers are LEB128 varints unless
+// noted otherwise):
+//
+//   trace  := "JTRC" version record*
+//   record := SYMBOL id length byte*
+//           | STEP thread sequence time event skipped class method
+//                  signature file line
+//                  state(local) state(instance) state(class)
+//           | OBJECT_VERSION tag version class state(fields)
+//           | ARRAY_VERSION tag version class length type(1 byte)
+//                           size byte*
+//           | DROPPED count
+//           | TRUNCATED count
+//           | END step_count
+//   state  := count entry*
+//   entry  := name signature type(1 byte) value
+//
+// Names and signatures are interned: a SYMBOL record assigns an id to a
+// string before the first record that refers to it. Ids are the agent's own
+// symbol ids, so they are not necessarily dense within one trace. Integral
+// values are zigzag-encoded, floats and doubles are stored as their
+// little-endian bit patterns and objects as unsigned varints: the object's
+// tag, or 0 for null.
+//
+// Steps carry the id of the thread that executed them and a sequence number
+// that orders steps across threads, the time they were recorded at in
+// nanoseconds since tracing started, and the source file (a symbol) and
+// line they are on. Lines are 0 if unknown.
+//
+// Most steps are single bytecodes (or lines). When tracing calls instead,
+// steps are CALL events, whose locals are the method's arguments, and RETURN
+// events, whose only local is the return value, named `return` (absent for
+// void methods and exceptions). Methods are identified by their class, name
+// and signature.
+//
+// When the agent samples steps, `skipped` is the number of steps of the same
+// thread that were left out right before this one. It is 0 otherwise.
+//
+// OBJECT_VERSION records hold a new version of the contents of an object,
+// and come right before the step that first saw that version. Tags identify
+// objects for the whole trace.
+//
+// ARRAY_VERSION records do the same for arrays and strings. `length` is the
+// full length, but only the first elements may be captured. Elements of
+// primitive arrays are stored as their little-endian bit patterns, elements
+// of object arrays as a sequence of varint tags, and strings (type CHAR) as
+// modified UTF-8.
+//
+// A DROPPED record reports steps that were recorded but never made it into
+// the trace. A TRUNCATED record reports steps that weren't recorded at all
+// because the agent ran out of memory budget. Streamed trace files may hold
+// several traces back to back.
+
+#ifndef JTRACE_FORMAT_H
+#define JTRACE_FORMAT_H
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static const char trace_magic[4] = { 'J', 'T', 'R', 'C' };
+static const uint64_t trace_version = 9;
+
+// Record tags.
+enum trace_record : uint8_t
+{
+  TRACE_END = 0,
+  TRACE_SYMBOL = 1,
+  TRACE_STEP = 2,
+  TRACE_DROPPED = 3,
+  TRACE_OBJECT_VERSION = 4,
+  TRACE_ARRAY_VERSION = 5,
+  TRACE_TRUNCATED = 6
+};
+
+// What a step records.
+enum trace_event : uint8_t
+{
+  TRACE_EVENT_STEP = 0,
+  TRACE_EVENT_CALL = 1,
+  TRACE_EVENT_RETURN = 2
+};
+
+// Value type tags. These are in the same order as `java_value::java_type`.
+enum trace_type : uint8_t
+{
+  TRACE_INT,
+  TRACE_LONG,
+  TRACE_DOUBLE,
+  TRACE_FLOAT,
+  TRACE_SHORT,
+  TRACE_CHAR,
+  TRACE_BYTE,
+  TRACE_BOOLEAN,
+  TRACE_OBJECT
+};
+
+// A value as it appears in the trace: a type tag and the raw bits of the
+// value. Integral values are sign-extended to 64 bits.
+struct trace_value
+{
+  trace_type type;
+  uint64_t bits;
+  trace_value() : type(TRACE_INT), bits(0) {}
+};
+
+// A named value within a decoded step. Symbols are decoded both as ids and
+// as strings.
+struct decoded_var
+{
+  uint64_t name_id;
+  uint64_t signature_id;
+  std::string name;
+  std::string signature;
+  trace_value value;
+};
+
+// A version of an object's contents. Arrays and strings have `contents`
+// instead of fields.
+struct decoded_object
+{
+  uint64_t tag;
+  uint64_t version;
+  uint64_t class_id;
+  std::string class_name;
+  std::vector<decoded_var> fields;
+  bool is_array = false;
+  uint64_t length = 0;
+  trace_type element_type = TRACE_INT;
+  std::string contents;
+};
+
+// A fully decoded execution step, with the object versions that precede it.
+struct decoded_step
+{
+  uint64_t thread;
+  uint64_t sequence;
+  uint64_t time;
+  trace_event event;
+  uint64_t skipped;
+  uint64_t class_id;
+  uint64_t method_id;
+  uint64_t method_signature_id;
+  uint64_t file_id;
+  uint64_t line;
+  std::string class_name;
+  std::string method_name;
+  std::string method_signature;
+  std::string file_name;
+  std::vector<decoded_var> local_state;
+  std::vector<decoded_var> instance_state;
+  std::vector<decoded_var> class_state;
+  std::vector<decoded_object> objects;
+};
+
+inline void trace_put_varint(std::string& out, uint64_t value)
+{
+  while (value >= 0x80) {
+    out.push_back((char)(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back((char)value);
+}
+
+inline uint64_t trace_zigzag(int64_t value)
+{
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+inline int64_t trace_unzigzag(uint64_t value)
+{
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+inline void trace_put_fixed(std::string& out, uint64_t value, int bytes)
+{
+  for (int i = 0; i < bytes; ++i)
+    out.push_back((char)(value >> (8 * i)));
+}
+
+inline void trace_put_value(std::string& out, const trace_value& value)
+{
+  out.push_back((char)value.type);
+  switch (value.type) {
+  case TRACE_FLOAT: trace_put_fixed(out, value.bits, 4); break;
+  case TRACE_DOUBLE: trace_put_fixed(out, value.bits, 8); break;
+  case TRACE_OBJECT: trace_put_varint(out, value.bits); break;
+  default: trace_put_varint(out, trace_zigzag((int64_t)value.bits));
+  }
+}
+
+// The size in bytes of one element of a primitive array.
+inline int trace_element_size(trace_type type)
+{
+  switch (type) {
+  case TRACE_LONG: case TRACE_DOUBLE: return 8;
+  case TRACE_INT: case TRACE_FLOAT: return 4;
+  case TRACE_SHORT: case TRACE_CHAR: return 2;
+  default: return 1;
+  }
+}
+
+// Split the contents of an array into values. Returns false if they are
+// malformed.
+inline bool trace_array_values(
+  trace_type type,
+  const std::string& contents,
+  std::vector<trace_value>& values
+  )
+{
+  values.clear();
+  const uint8_t *pos = (const uint8_t *)contents.data();
+  const uint8_t *limit = pos + contents.size();
+  while (pos < limit) {
+    trace_value value;
+    value.type = type;
+    if (type == TRACE_OBJECT) {
+      int shift = 0;
+      for (;;) {
+        if (pos >= limit || shift >= 64) return false;
+        uint8_t byte = *pos++;
+        value.bits |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) break;
+        shift += 7;
+      }
+    } else {
+      int size = trace_element_size(type);
+      if (limit - pos < size) return false;
+      for (int i = 0; i < size; ++i) value.bits |= (uint64_t)pos[i] << (8 * i);
+      pos += size;
+      // Integral values are sign-extended like everywhere else.
+      if (type == TRACE_INT) value.bits = (uint64_t)(int64_t)(int32_t)value.bits;
+      else if (type == TRACE_SHORT)
+        value.bits = (uint64_t)(int64_t)(int16_t)value.bits;
+      else if (type == TRACE_BYTE)
+        value.bits = (uint64_t)(int64_t)(int8_t)value.bits;
+    }
+    values.push_back(value);
+  }
+  return true;
+}
+
+// The name of a step event in TOML.
+inline const char *trace_event_name(trace_event event)
+{
+  switch (event) {
+  case TRACE_EVENT_CALL: return "call";
+  case TRACE_EVENT_RETURN: return "return";
+  default: return "step";
+  }
+}
+
+// Print a value as TOML.
+inline void trace_write_value(std::ostream& output, const trace_value& value)
+{
+  switch (value.type) {
+  case TRACE_FLOAT: {
+    uint32_t bits = (uint32_t)value.bits;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    output << f;
+    break;
+  }
+  case TRACE_DOUBLE: {
+    double d;
+    std::memcpy(&d, &value.bits, sizeof(d));
+    output << d;
+    break;
+  }
+  default: output << (int64_t)value.bits;
+  }
+}
+
+// Print the contents of an array or string as TOML.
+inline void trace_write_contents(
+  std::ostream& output,
+  uint64_t length,
+  trace_type type,
+  const std::string& contents,
+  bool is_string
+  )
+{
+  output << "length = " << length << std::endl;
+  if (is_string) {
+    output << "value = \"";
+    static const char hex[] = "0123456789abcdef";
+    for (char c : contents) {
+      if (c == '"' || c == '\\') output << '\\' << c;
+      else if ((uint8_t)c < 0x20)
+        output << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+      else output << c;
+    }
+    output << "\"" << std::endl;
+    return;
+  }
+
+  std::vector<trace_value> values;
+  trace_array_values(type, contents, values);
+  output << "elements = [";
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (i > 0) output << ", ";
+    trace_write_value(output, values[i]);
+  }
+  output << "]" << std::endl;
+}
+
+// The state of an encoder at some point, used to undo partially written
+// records.
+struct trace_mark
+{
+  size_t size;
+  size_t symbol_count;
+  uint64_t step_count;
+};
+
+// Incrementally builds a trace into a byte string. The caller owns symbol
+// ids; the encoder emits a SYMBOL record the first time each id is used.
+class trace_encoder
+{
+public:
+  explicit trace_encoder(std::string& out) : out(out), step_count(0)
+  {
+    out.append(trace_magic, sizeof(trace_magic));
+    trace_put_varint(out, trace_version);
+  }
+
+  // Streaming writers take the output away after every record, so `mark`
+  // and `rollback` are relative to whatever is currently in `out`.
+  trace_mark mark() const
+  {
+    trace_mark m = { out.size(), defined_order.size(), step_count };
+    return m;
+  }
+
+  // Forget everything written since `m`, including symbol definitions, so
+  // that later records define those symbols again.
+  void rollback(const trace_mark& m)
+  {
+    out.resize(m.size);
+    while (defined_order.size() > m.symbol_count) {
+      defined[defined_order.back()] = false;
+      defined_order.pop_back();
+    }
+    step_count = m.step_count;
+  }
+
+  void symbol(uint64_t id, const std::string& name)
+  {
+    if (id < defined.size() && defined[id]) return;
+    if (id >= defined.size()) defined.resize(id + 1);
+    defined[id] = true;
+    defined_order.push_back(id);
+    out.push_back((char)TRACE_SYMBOL);
+    trace_put_varint(out, id);
+    trace_put_varint(out, name.size());
+    out.append(name);
+  }
+
+  // Steps are written as `begin_step`, then three `begin_state`s (local,
+  // instance and class) each followed by exactly `count` calls to `var`.
+  // Every symbol used by a step must be interned before `begin_step`.
+  void begin_step(
+    uint64_t thread,
+    uint64_t sequence,
+    uint64_t time,
+    trace_event event,
+    uint64_t skipped,
+    uint64_t class_name,
+    uint64_t method_name,
+    uint64_t method_signature,
+    uint64_t file_name,
+    uint64_t line
+    )
+  {
+    out.push_back((char)TRACE_STEP);
+    trace_put_varint(out, thread);
+    trace_put_varint(out, sequence);
+    trace_put_varint(out, time);
+    out.push_back((char)event);
+    trace_put_varint(out, skipped);
+    trace_put_varint(out, class_name);
+    trace_put_varint(out, method_name);
+    trace_put_varint(out, method_signature);
+    trace_put_varint(out, file_name);
+    trace_put_varint(out, line);
+    ++step_count;
+  }
+
+  void begin_state(uint64_t count) { trace_put_varint(out, count); }
+
+  // Objects are written as `object` followed by one state of fields, before
+  // the step they belong to.
+  void object(uint64_t tag, uint64_t version, uint64_t class_name)
+  {
+    out.push_back((char)TRACE_OBJECT_VERSION);
+    trace_put_varint(out, tag);
+    trace_put_varint(out, version);
+    trace_put_varint(out, class_name);
+  }
+
+  void array(
+    uint64_t tag,
+    uint64_t version,
+    uint64_t class_name,
+    uint64_t length,
+    trace_type type,
+    const std::string& contents
+    )
+  {
+    out.push_back((char)TRACE_ARRAY_VERSION);
+    trace_put_varint(out, tag);
+    trace_put_varint(out, version);
+    trace_put_varint(out, class_name);
+    trace_put_varint(out, length);
+    out.push_back((char)type);
+    trace_put_varint(out, contents.size());
+    out.append(contents);
+  }
+
+  void var(uint64_t name, uint64_t signature, const trace_value& value)
+  {
+    trace_put_varint(out, name);
+    trace_put_varint(out, signature);
+    trace_put_value(out, value);
+  }
+
+  void dropped(uint64_t count)
+  {
+    out.push_back((char)TRACE_DROPPED);
+    trace_put_varint(out, count);
+  }
+
+  void truncated(uint64_t count)
+  {
+    out.push_back((char)TRACE_TRUNCATED);
+    trace_put_varint(out, count);
+  }
+
+  void end()
+  {
+    out.push_back((char)TRACE_END);
+    trace_put_varint(out, step_count);
+  }
+
+private:
+  std::string& out;
+  std::vector<bool> defined;
+  std::vector<uint64_t> defined_order;
+  uint64_t step_count;
+};
+
+// Reads steps back out of an encoded trace.
+class trace_decoder
+{
+public:
+  trace_decoder(const uint8_t *data, size_t size)
+    : start(data), pos(data), limit(data + size),
+      step_count(0), dropped_count(0), truncated_count(0), finished(false)
+  {
+    if (size < sizeof(trace_magic)
+        || std::memcmp(data, trace_magic, sizeof(trace_magic)) != 0) {
+      fail("not a jtrace trace");
+      return;
+    }
+    pos += sizeof(trace_magic);
+    uint64_t version = 0;
+    if (!get_varint(version)) return;
+    if (version != trace_version) fail("unsupported trace version");
+  }
+
+  // Decode the next step. Returns false at the end of the trace or on
+  // error; `error()` distinguishes the two.
+  bool next(decoded_step& step)
+  {
+    while (error_message.empty() && !finished) {
+      if (pos >= limit) return fail("truncated trace");
+      uint8_t tag = *pos++;
+      switch (tag) {
+      case TRACE_SYMBOL: {
+        uint64_t id, length;
+        if (!get_varint(id) || !get_varint(length)) return false;
+        if (length > (uint64_t)(limit - pos)) return fail("truncated symbol");
+        symbols[id].assign((const char *)pos, length);
+        pos += length;
+        break;
+      }
+      case TRACE_STEP:
+        if (!get_varint(step.thread) || !get_varint(step.sequence)
+            || !get_varint(step.time))
+          return false;
+        if (pos >= limit) return fail("truncated step");
+        if (*pos > TRACE_EVENT_RETURN) return fail("unknown step event");
+        step.event = (trace_event)*pos++;
+        if (!get_varint(step.skipped)) return false;
+        if (!get_symbol(step.class_id, step.class_name)) return false;
+        if (!get_symbol(step.method_id, step.method_name)) return false;
+        if (!get_symbol(step.method_signature_id, step.method_signature))
+          return false;
+        if (!get_symbol(step.file_id, step.file_name)) return false;
+        if (!get_varint(step.line)) return false;
+        if (!get_state(step.local_state)) return false;
+        if (!get_state(step.instance_state)) return false;
+        if (!get_state(step.class_state)) return false;
+        step.objects.swap(objects);
+        objects.clear();
+        ++step_count;
+        return true;
+      case TRACE_OBJECT_VERSION: {
+        decoded_object object;
+        if (!get_varint(object.tag) || !get_varint(object.version))
+          return false;
+        if (!get_symbol(object.class_id, object.class_name)) return false;
+        if (!get_state(object.fields)) return false;
+        objects.push_back(std::move(object));
+        break;
+      }
+      case TRACE_ARRAY_VERSION: {
+        decoded_object object;
+        object.is_array = true;
+        uint64_t size;
+        if (!get_varint(object.tag) || !get_varint(object.version))
+          return false;
+        if (!get_symbol(object.class_id, object.class_name)) return false;
+        if (!get_varint(object.length)) return false;
+        if (pos >= limit) return fail("truncated array");
+        if (*pos > TRACE_OBJECT) return fail("unknown value type");
+        object.element_type = (trace_type)*pos++;
+        if (!get_varint(size)) return false;
+        if (size > (uint64_t)(limit - pos)) return fail("truncated array");
+        object.contents.assign((const char *)pos, size);
+        pos += size;
+        objects.push_back(std::move(object));
+        break;
+      }
+      case TRACE_DROPPED: {
+        uint64_t count;
+        if (!get_varint(count)) return false;
+        dropped_count += count;
+        break;
+      }
+      case TRACE_TRUNCATED: {
+        uint64_t count;
+        if (!get_varint(count)) return false;
+        truncated_count += count;
+        break;
+      }
+      case TRACE_END: {
+        uint64_t declared_count;
+        if (!get_varint(declared_count)) return false;
+        if (declared_count != step_count) return fail("step count mismatch");
+        if (!objects.empty()) return fail("object without step");
+        finished = true;
+        break;
+      }
+      default:
+        return fail("unknown record tag");
+      }
+    }
+    return false;
+  }
+
+  const std::string& error() const { return error_message; }
+  bool done() const { return finished; }
+  uint64_t dropped() const { return dropped_count; }
+  uint64_t truncated() const { return truncated_count; }
+
+  // The number of bytes consumed so far. Once the trace is `done`, this is
+  // where the next trace in a stream begins.
+  size_t offset() const { return pos - start; }
+
+private:
+  bool fail(const char *message)
+  {
+    if (error_message.empty()) error_message = message;
+    return false;
+  }
+
+  bool get_varint(uint64_t& value)
+  {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (pos >= limit) return fail("truncated varint");
+      uint8_t byte = *pos++;
+      value |= (uint64_t)(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) return true;
+    }
+    return fail("malformed varint");
+  }
+
+  bool get_fixed(uint64_t& value, int bytes)
+  {
+    if (limit - pos < bytes) return fail("truncated value");
+    value = 0;
+    for (int i = 0; i < bytes; ++i)
+      value |= (uint64_t)pos[i] << (8 * i);
+    pos += bytes;
+    return true;
+  }
+
+  bool get_symbol(uint64_t& id, std::string& name)
+  {
+    if (!get_varint(id)) return false;
+    auto found = symbols.find(id);
+    if (found == symbols.end()) return fail("undefined symbol");
+    name = found->second;
+    return true;
+  }
+
+  bool get_state(std::vector<decoded_var>& state)
+  {
+    uint64_t count;
+    if (!get_varint(count)) return false;
+    // Every variable takes at least four bytes.
+    if (count > (uint64_t)(limit - pos) / 4) return fail("truncated state");
+    state.resize(count);
+    for (auto& var : state) {
+      if (!get_symbol(var.name_id, var.name)) return false;
+      if (!get_symbol(var.signature_id, var.signature)) return false;
+      if (pos >= limit) return fail("truncated value");
+      uint8_t type = *pos++;
+      if (type > TRACE_OBJECT) return fail("unknown value type");
+      var.value.type = (trace_type)type;
+      uint64_t bits;
+      switch (var.value.type) {
+      case TRACE_FLOAT: if (!get_fixed(bits, 4)) return false; break;
+      case TRACE_DOUBLE: if (!get_fixed(bits, 8)) return false; break;
+      case TRACE_OBJECT: if (!get_varint(bits)) return false; break;
+      default:
+        if (!get_varint(bits)) return false;
+        bits = (uint64_t)trace_unzigzag(bits);
+      }
+      var.value.bits = bits;
+    }
+    return true;
+  }
+
+  const uint8_t *start;
+  const uint8_t *pos;
+  const uint8_t *limit;
+  std::unordered_map<uint64_t, std::string> symbols;
+  // Objects read since the last step.
+  std::vector<decoded_object> objects;
+  uint64_t step_count;
+  uint64_t dropped_count;
+  uint64_t truncated_count;
+  bool finished;
+  std::string error_message;
+};
+
+#endif
@@ -0,0 +1,251 @@
+// jtrace_shm.h
+//
+// The shared memory transport between the agent and jtrace-consume. The
+// agent creates a POSIX shared memory object that holds a header and a
+// fixed number of rings:
+//
+//   region := header(64 bytes) ring*
+//   ring   := head(64 bytes) tail(64 bytes) state owner(64 bytes) byte*
+//
+// Each traced thread claims a free ring and is the only one that writes to
+// it, and jtrace-consume is the only reader of every ring, so rings need no
+// locks. `head` and `tail` count the bytes ever written and read, so the
+// ring is empty when they are equal. Each thread writes its traces to its
+// ring as a plain byte stream in the format of jtrace_format.h, one trace
+// per traced region, and `owner` is the thread's id. A thread gives its
+// ring back when it exits by marking it retired, and the consumer frees it
+// once it is drained. A thread that can't finish a trace marks its ring
+// broken instead, and writes its next trace to a new ring, which the
+// consumer doesn't append to the broken trace. The header's `closed` flag is set when the agent will
+// write nothing more, and the consumer bumps its `heartbeat` on every pass
+// over the rings, so that producers can tell whether it is still there.
+//
+// Like jtrace_format.h, this does not depend on JNI.
+
+#ifndef JTRACE_SHM_H
+#define JTRACE_SHM_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char shm_magic[4] = { 'J', 'T', 'R', 'S' };
+static const uint32_t shm_version = 3;
+static const size_t shm_line = 64;
+
+static_assert(
+  ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+  "rings need lock-free atomics to be shared between processes"
+  );
+
+// Ring states.
+enum shm_ring_state : uint32_t
+{
+  SHM_RING_FREE = 0,
+  SHM_RING_ACTIVE = 1,
+  SHM_RING_RETIRED = 2,
+  // Retired with its last trace cut short.
+  SHM_RING_BROKEN = 3
+};
+
+struct shm_header
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t ring_count;
+  uint32_t padding;
+  uint64_t ring_size;
+  std::atomic<uint32_t> closed;
+  uint32_t padding2;
+  std::atomic<uint64_t> heartbeat;
+};
+
+// The producer and consumer positions are on separate cache lines so that
+// the two sides don't contend for them.
+struct shm_ring
+{
+  alignas(shm_line) std::atomic<uint64_t> head;
+  alignas(shm_line) std::atomic<uint64_t> tail;
+  alignas(shm_line) std::atomic<uint32_t> state;
+  uint32_t owner;
+};
+
+static_assert(sizeof(shm_header) <= shm_line, "header must fit in a line");
+static_assert(sizeof(shm_ring) == 3 * shm_line, "unexpected ring layout");
+
+// A mapped shared memory region.
+class shm_region
+{
+public:
+  ~shm_region() { close(); }
+
+  // Create the region, replacing any left over under the same name. Ring
+  // sizes are rounded up to whole cache lines.
+  bool create(const std::string& name, uint32_t ring_count, uint64_t ring_size)
+  {
+    ring_size = (ring_size + shm_line - 1) / shm_line * shm_line;
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) return fail("unable to create " + name);
+    size_t size = shm_line + ring_count * (sizeof(shm_ring) + ring_size);
+    if (ftruncate(fd, size) != 0) {
+      ::close(fd);
+      shm_unlink(name.c_str());
+      return fail("unable to size " + name);
+    }
+    if (!map(fd, size)) {
+      shm_unlink(name.c_str());
+      return false;
+    }
+
+    // The object starts out zeroed, which is a valid state for all of the
+    // atomics.
+    shm_header *h = header();
+    std::memcpy(h->magic, shm_magic, sizeof(shm_magic));
+    h->version = shm_version;
+    h->ring_count = ring_count;
+    h->ring_size = ring_size;
+    return true;
+  }
+
+  // Map a region created by the agent.
+  bool open(const std::string& name)
+  {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) return fail("unable to open " + name);
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < shm_line) {
+      ::close(fd);
+      return fail(name + " is not a jtrace region");
+    }
+    if (!map(fd, info.st_size)) return false;
+
+    const shm_header *h = header();
+    if (std::memcmp(h->magic, shm_magic, sizeof(shm_magic)) != 0)
+      return fail(name + " is not a jtrace region");
+    if (h->version != shm_version)
+      return fail(name + " has an unsupported version");
+    if (shm_line + h->ring_count * (sizeof(shm_ring) + h->ring_size) > size)
+      return fail(name + " is truncated");
+    return true;
+  }
+
+  void close()
+  {
+    if (base != NULL) munmap(base, size);
+    base = NULL;
+    size = 0;
+  }
+
+  shm_header *header() const { return (shm_header *)base; }
+  uint32_t ring_count() const { return header()->ring_count; }
+  uint64_t ring_size() const { return header()->ring_size; }
+
+  shm_ring& ring(uint32_t index) const
+  {
+    uint8_t *p = base + shm_line + index * (sizeof(shm_ring) + ring_size());
+    return *(shm_ring *)p;
+  }
+
+  uint8_t *data(uint32_t index) const
+  {
+    return (uint8_t *)&ring(index) + sizeof(shm_ring);
+  }
+
+  const std::string& error() const { return error_message; }
+
+private:
+  uint8_t *base = NULL;
+  size_t size = 0;
+  std::string error_message;
+
+  bool map(int fd, size_t map_size)
+  {
+    void *p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return fail("unable to map shared memory");
+    base = (uint8_t *)p;
+    size = map_size;
+    return true;
+  }
+
+  bool fail(const std::string& message)
+  {
+    error_message = message;
+    return false;
+  }
+};
+
+// Append bytes to a ring, as its producer. If the ring is full, wait for
+// the consumer to make room for as long as it keeps making passes over the
+// rings. Gives up and returns false once its heartbeat hasn't moved for
+// `stall`, or right away if `stall` is zero.
+inline bool shm_write(
+  const shm_region& region,
+  uint32_t index,
+  const char *bytes,
+  size_t count,
+  std::chrono::nanoseconds stall
+  )
+{
+  shm_ring& ring = region.ring(index);
+  uint64_t capacity = region.ring_size();
+  if (count > capacity) return false;
+
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  if (capacity - (head - ring.tail.load(std::memory_order_acquire)) < count) {
+    if (stall.count() == 0) return false;
+    std::atomic<uint64_t>& heartbeat = region.header()->heartbeat;
+    uint64_t beat = heartbeat.load(std::memory_order_acquire);
+    auto last_beat = std::chrono::steady_clock::now();
+    while (capacity - (head - ring.tail.load(std::memory_order_acquire)) < count) {
+      std::this_thread::yield();
+      uint64_t next_beat = heartbeat.load(std::memory_order_acquire);
+      auto now = std::chrono::steady_clock::now();
+      if (next_beat != beat) {
+        beat = next_beat;
+        last_beat = now;
+      } else if (now - last_beat >= stall) {
+        return false;
+      }
+    }
+  }
+
+  uint8_t *data = region.data(index);
+  size_t offset = head % capacity;
+  size_t first = std::min<size_t>(count, capacity - offset);
+  std::memcpy(data + offset, bytes, first);
+  std::memcpy(data, bytes + first, count - first);
+  ring.head.store(head + count, std::memory_order_release);
+  return true;
+}
+
+// Take everything that is in a ring, as its consumer, and append it to
+// `out`. Returns the number of bytes taken.
+inline size_t shm_read(const shm_region& region, uint32_t index, std::string& out)
+{
+  shm_ring& ring = region.ring(index);
+  uint64_t capacity = region.ring_size();
+  uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+  uint64_t head = ring.head.load(std::memory_order_acquire);
+  size_t count = head - tail;
+  if (count == 0) return 0;
+
+  const uint8_t *data = region.data(index);
+  size_t offset = tail % capacity;
+  size_t first = std::min<size_t>(count, capacity - offset);
+  out.append((const char *)data + offset, first);
+  out.append((const char *)data, count - first);
+  ring.tail.store(head, std::memory_order_release);
+  return count;
+}
+
+#endif
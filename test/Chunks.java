@@ -0,0 +1,64 @@
+import java.nio.ByteBuffer;
+import java.util.concurrent.CountDownLatch;
+import java.util.concurrent.TimeUnit;
+
+// Run with the agent option chunk=1000. Checks that chunks arrive in order,
+// that only the last one is marked last, and that there are as many as the
+// steps they hold call for.
+class Chunks {
+    static final int CHUNK_STEPS = 1000;
+
+    static class JTraceReceiver {
+        static int chunks = 0;
+        static long steps = 0;
+        static String error = null;
+        static final CountDownLatch done = new CountDownLatch(1);
+
+        public static void start() {}
+        public static void end() {}
+        public static void receive(ByteBuffer chunk, int n, int index, boolean last) {
+            System.out.println(
+                "chunk " + index + ": " + n + " steps, " + chunk.remaining()
+                + " bytes" + (last ? " (last)" : "")
+            );
+            if (index != chunks && error == null)
+                error = "chunk " + index + " arrived as chunk " + chunks;
+            if (n <= 0 && error == null) error = "chunk " + index + " is empty";
+            ++chunks;
+            steps += n;
+            // Tracing can't start again while results are delivered, so
+            // these are ignored.
+            if (index == 0) {
+                start();
+                end();
+            }
+            if (last) done.countDown();
+        }
+    }
+
+    public static void main(String[] args) throws InterruptedException {
+        JTraceReceiver.start();
+        int sum = 0;
+        for (int i = 0; i < 100000; ++i) sum += i % 7;
+        JTraceReceiver.end();
+        System.out.println("end returned, sum " + sum);
+
+        if (!JTraceReceiver.done.await(60, TimeUnit.SECONDS)) {
+            System.out.println("FAIL: no last chunk");
+            System.exit(1);
+        }
+        long expected = Math.max(
+            1, (JTraceReceiver.steps + CHUNK_STEPS - 1) / CHUNK_STEPS
+        );
+        if (JTraceReceiver.error == null && JTraceReceiver.chunks != expected)
+            JTraceReceiver.error = JTraceReceiver.chunks + " chunks for "
+                + JTraceReceiver.steps + " steps, expected " + expected;
+        if (JTraceReceiver.error != null) {
+            System.out.println("FAIL: " + JTraceReceiver.error);
+            System.exit(1);
+        }
+        System.out.println(
+            JTraceReceiver.chunks + " chunks, " + JTraceReceiver.steps + " steps"
+        );
+    }
+}
@@ -0,0 +1,32 @@
+class Predicate {
+    static class JTraceReceiver {
+        public static String filter = null;
+
+        public static void start() {}
+        public static void end() {}
+        public static void receive(String s, int n) {
+            System.out.println("filter: " + filter);
+            System.out.println("steps: " + n);
+            System.out.println(s);
+        }
+    }
+
+    int count = 0;
+
+    void bump(int i) {
+        if (i % 3 == 0) ++count;
+    }
+
+    public static void main(String[] args) {
+        JTraceReceiver.filter = "i > 7";
+        JTraceReceiver.start();
+        for (int i = 0; i < 10; ++i);
+        JTraceReceiver.end();
+
+        Predicate p = new Predicate();
+        JTraceReceiver.filter = "Predicate.bump: changed(this.count)";
+        JTraceReceiver.start();
+        for (int i = 0; i < 10; ++i) p.bump(i);
+        JTraceReceiver.end();
+    }
+}
@@ -0,0 +1,29 @@
+# Test.awk
+#
+# Checks the decoded trace of test/Test.java for steps with known content:
+# `Test.main` on line 47, with `f` and `local` set by the lines before it,
+# and a step on line 60 in each of the two calls of `Test.square(3)`, which
+# `stateOnly` must not mistake for one another.
+
+/^\[step/ {
+  in_main = index($0, "\"LTest;\".\"main\"") > 0
+  in_square = index($0, "\"LTest;\".\"square\"") > 0
+  on_line = f = local = 0
+}
+in_main && /^line = 47$/ { on_line = 1 }
+in_main && /^local\."f"\.value = 12$/ { f = 1 }
+in_main && /^local\."local"\.value = 42$/ { local = 1 }
+on_line && f && local { found = 1 }
+in_square && /^line = 60$/ { ++square_steps }
+END {
+  if (!found) {
+    print "no step on line 47 of Test.main with f = 12 and local = 42" \
+      > "/dev/stderr"
+    exit 1
+  }
+  if (square_steps < 2) {
+    print "expected a step on line 60 in both calls of Test.square" \
+      > "/dev/stderr"
+    exit 1
+  }
+}
@@ -1,4 +1,8 @@
 
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.nio.ByteBuffer;
+
 public class Test {
     private static boolean staticState = false;
     private int instanceState = 1;
@@ -14,11 +18,23 @@ public class Test {
 
     static class JTraceReceiver {
         public static boolean stateOnly = true;
+        public static boolean toml = System.getProperty("jtrace.out") == null;
         public static void start() {}
         public static void end() {}
         public static void receive(String info, int stepCount) {
             System.out.println(stepCount + " steps:\n" + info);
         }
+        public static void receive(ByteBuffer trace, int stepCount) {
+            System.out.println(stepCount + " steps");
+            byte[] bytes = new byte[trace.remaining()];
+            trace.get(bytes);
+            try (FileOutputStream out =
+                     new FileOutputStream(System.getProperty("jtrace.out"))) {
+                out.write(bytes);
+            } catch (IOException e) {
+                throw new RuntimeException(e);
+            }
+        }
     }
 
     public static void main(String[] args) {
@@ -34,6 +50,14 @@ public class Test {
             System.out.println(a);
             myObject = null;
         }
+        // Two calls with the same state, which are both recorded.
+        int first = square(3);
+        int second = square(3);
         JTraceReceiver.end();
     }
+
+    static int square(int x) {
+        int result = x * x;
+        return result;
+    }
 }
@@ -0,0 +1,72 @@
+import java.util.HashSet;
+import java.util.Set;
+
+// Several threads update objects of their own while being traced. Each
+// thread's object has to reach its final value in the trace, and no object
+// version may be recorded twice. Exits with status 1 otherwise.
+class ThreadObjects {
+    static final int THREADS = 4;
+    static final int ROUNDS = 200;
+    static String failure = "no results";
+
+    static class JTraceReceiver {
+        public static void start() {}
+        public static void end() {}
+        public static void receive(String s, int n) {
+            Set<String> versions = new HashSet<>();
+            Set<String> finished = new HashSet<>();
+            Set<String> threads = new HashSet<>();
+            String object = null;
+            for (String line : s.split("\n")) {
+                if (line.startsWith("[object.")) {
+                    if (!versions.add(line)) {
+                        failure = "version recorded twice: " + line;
+                        return;
+                    }
+                    object = line.substring(0, line.lastIndexOf('.'));
+                } else if (line.startsWith("[step")) {
+                    object = null;
+                } else if (line.startsWith("thread = ")) {
+                    threads.add(line);
+                } else if (object != null
+                           && line.equals("field.\"count\".value = " + ROUNDS)) {
+                    finished.add(object);
+                }
+            }
+            if (threads.size() < THREADS) failure = threads.size() + " threads";
+            else if (finished.size() < THREADS)
+                failure = finished.size() + " counters finished";
+            else failure = null;
+        }
+    }
+
+    static class Counter {
+        int count = 0;
+
+        void bump() {
+            ++count;
+        }
+    }
+
+    static void run() {
+        Counter counter = new Counter();
+        for (int i = 0; i < ROUNDS; ++i) counter.bump();
+    }
+
+    public static void main(String[] args) throws InterruptedException {
+        Thread[] workers = new Thread[THREADS];
+        JTraceReceiver.start();
+        for (int i = 0; i < THREADS; ++i) {
+            workers[i] = new Thread(ThreadObjects::run);
+            workers[i].start();
+        }
+        for (Thread worker : workers) worker.join();
+        JTraceReceiver.end();
+
+        if (failure != null) {
+            System.out.println("ThreadObjects: " + failure);
+            System.exit(1);
+        }
+        System.out.println("ThreadObjects: ok");
+    }
+}
@@ -0,0 +1,25 @@
+class Threads {
+    static class JTraceReceiver {
+        public static boolean stateOnly = true;
+        public static void start() {}
+        public static void end() {}
+        public static void receive(String s, int n) {
+            System.out.println(n + " steps:\n" + s);
+        }
+    }
+
+    static int count(int limit) {
+        int total = 0;
+        for (int i = 0; i < limit; ++i) total += i;
+        return total;
+    }
+
+    public static void main(String[] args) throws InterruptedException {
+        JTraceReceiver.start();
+        Thread worker = new Thread(() -> count(5));
+        worker.start();
+        count(5);
+        worker.join();
+        JTraceReceiver.end();
+    }
+}
@@ -0,0 +1,77 @@
+// Native tests for the block compression in jtrace_archive.h: random input
+// round-trips, and truncated or corrupt blocks are rejected without reading
+// or writing out of bounds.
+
+#include <cassert>
+#include <cstdio>
+#include <random>
+#include "../src/jtrace_archive.h"
+
+static bool decompress(const std::string& compressed, size_t raw_size, std::string& out)
+{
+  return archive_decompress(
+    (const uint8_t *)compressed.data(), compressed.size(), raw_size, out
+    );
+}
+
+// Random bytes from a small alphabet with repeated runs, so that both
+// literals and matches are exercised.
+static std::string random_input(std::mt19937& random, size_t size)
+{
+  std::string result;
+  while (result.size() < size) {
+    if (!result.empty() && random() % 3 == 0) {
+      size_t from = random() % result.size();
+      size_t length = 1 + random() % 64;
+      for (size_t i = 0; i < length && result.size() < size; ++i)
+        result.push_back(result[from + i]);
+    } else {
+      result.push_back((char)('a' + random() % 8));
+    }
+  }
+  return result;
+}
+
+int main()
+{
+  std::mt19937 random(1);
+  for (int round = 0; round < 200; ++round) {
+    std::string input = random_input(random, random() % 20000);
+    std::string compressed, output;
+    archive_compress(input, compressed);
+    assert(decompress(compressed, input.size(), output));
+    assert(output == input);
+
+    // Every truncation fails rather than reading past the end.
+    for (size_t size = 0; size < compressed.size(); size += 1 + size / 8)
+      assert(!decompress(compressed.substr(0, size), input.size(), output)
+             || input.empty());
+
+    // A block can't decompress to more than its raw size.
+    if (input.size() > 1)
+      assert(!decompress(compressed, input.size() - 1, output));
+
+    // Corrupt bytes may decode to something else, but never overrun.
+    for (int i = 0; i < 20 && !compressed.empty(); ++i) {
+      std::string corrupt = compressed;
+      corrupt[random() % corrupt.size()] = (char)random();
+      if (decompress(corrupt, input.size(), output))
+        assert(output.size() == input.size());
+    }
+  }
+
+  // A match longer than what is left of the block.
+  std::string overlong;
+  trace_put_varint(overlong, 1);
+  overlong.push_back('x');
+  trace_put_varint(overlong, 1);
+  trace_put_varint(overlong, UINT64_MAX - 1);
+  std::string output;
+  assert(!decompress(overlong, 100, output));
+
+  // A raw size no block can have.
+  assert(!decompress(overlong, (size_t)archive_max_block + 1, output));
+
+  std::puts("archive_test: ok");
+  return 0;
+}
@@ -0,0 +1,130 @@
+// Native tests for the filter parser in jtrace_filter.h: operators bind as
+// the grammar says, rules and scopes are split correctly, and malformed
+// filters are rejected with a message.
+
+#include <cassert>
+#include <cstdio>
+#include "../src/jtrace_filter.h"
+
+static symbol_table symbols;
+
+// Render the expression rooted at `index` with explicit parentheses.
+static std::string render(const filter_program& program, uint32_t index)
+{
+  static const char *operators[] = {
+    "", "", "", "", "", "!", "&&", "||", "==", "!=", "<", "<=", ">", ">="
+  };
+  const filter_node& node = program.nodes[index];
+  switch (node.kind) {
+  case filter_node::NUMBER:
+    return node.integral ? std::to_string(node.integer)
+                         : std::to_string(node.real);
+  case filter_node::NULL_VALUE:
+    return "null";
+  case filter_node::VARIABLE:
+    return symbols.name(node.name);
+  case filter_node::THIS_FIELD:
+    return "this." + symbols.name(node.name);
+  case filter_node::CHANGED:
+    return "changed(" + render(program, node.left) + ")";
+  case filter_node::NOT:
+    return "!" + render(program, node.left);
+  default:
+    return "(" + render(program, node.left) + " " + operators[node.kind] + " "
+      + render(program, node.right) + ")";
+  }
+}
+
+// The first rule of `source`, rendered.
+static std::string parse(const std::string& source)
+{
+  filter_program program;
+  std::string error;
+  if (!compile_filter(source, program, symbols, error)) {
+    std::fprintf(stderr, "%s: %s\n", source.c_str(), error.c_str());
+    return "error";
+  }
+  return render(program, program.rules[0].root);
+}
+
+static bool rejects(const std::string& source)
+{
+  filter_program program;
+  std::string error;
+  return !compile_filter(source, program, symbols, error) && !error.empty();
+}
+
+int main()
+{
+  // Precedence, loosest first: ||, &&, !, comparisons.
+  assert(parse("a || b && c") == "(a || (b && c))");
+  assert(parse("a && b || c") == "((a && b) || c)");
+  assert(parse("(a || b) && c") == "((a || b) && c)");
+  assert(parse("a == 1 && b != 2") == "((a == 1) && (b != 2))");
+  assert(parse("!a == b") == "!(a == b)");
+  assert(parse("!!a && b") == "(!!a && b)");
+  assert(parse("a != b") == "(a != b)");
+  assert(parse("a<=b") == "(a <= b)");
+  assert(parse("a >= b") == "(a >= b)");
+  assert(parse("a < b") == "(a < b)");
+  assert(parse("a > b") == "(a > b)");
+  // || and && associate to the left.
+  assert(parse("a || b || c") == "((a || b) || c)");
+  assert(parse("a && b && c") == "((a && b) && c)");
+
+  // Operands.
+  assert(parse("x == -3") == "(x == -3)");
+  assert(parse("x < 2.5") == "(x < 2.500000)");
+  assert(parse("x == true") == "(x == 1)");
+  assert(parse("x != null") == "(x != null)");
+  assert(parse("this.count > 0") == "(this.count > 0)");
+  assert(parse("changed(this.count)") == "changed(this.count)");
+  assert(parse("changed && x") == "(changed && x)");
+  assert(parse("  $x_1  ") == "$x_1");
+
+  // Rules, scopes and the slots of `changed`.
+  {
+    filter_program program;
+    std::string error;
+    assert(compile_filter(
+      "com.example.*.run: changed(x) ; ; y > 1; *.get: changed(y)",
+      program, symbols, error
+      ));
+    assert(program.rules.size() == 3);
+    assert(program.rules[0].scope == "com.example.*.run");
+    assert(program.rules[1].scope.empty());
+    assert(program.rules[2].scope == "*.get");
+    assert(render(program, program.rules[1].root) == "(y > 1)");
+    assert(program.changed_count == 2);
+    assert(program.nodes[program.rules[2].root].slot == 1);
+  }
+
+  // Malformed filters.
+  assert(rejects(""));
+  assert(rejects(" ; "));
+  assert(rejects("Foo.bar:"));
+  assert(rejects("a &&"));
+  assert(rejects("|| a"));
+  assert(rejects("(a"));
+  assert(rejects("a)"));
+  assert(rejects("()"));
+  assert(rejects("a =="));
+  assert(rejects("a = b"));
+  assert(rejects("a b"));
+  assert(rejects("a == b == c"));
+  assert(rejects("1x"));
+  assert(rejects("this."));
+  assert(rejects("changed(a"));
+  assert(rejects("changed(1)"));
+  assert(rejects("a; b &&"));
+
+  // Scopes are globs over `package.Class.method`.
+  assert(glob_match("*", ""));
+  assert(glob_match("com.*.run", "com.example.Server.run"));
+  assert(!glob_match("com.*.run", "com.example.Server.runs"));
+  assert(glob_match("*Server*", "com.example.Server.run"));
+  assert(!glob_match("Server", "com.example.Server"));
+
+  std::printf("filter_test: ok\n");
+  return 0;
+}
@@ -0,0 +1,65 @@
+// Native tests for the shared memory rings in jtrace_shm.h: bytes come out
+// in order as writes and reads wrap around the end of a ring, and a full
+// ring only holds up a producer while the consumer keeps its heartbeat.
+
+#include <cassert>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <unistd.h>
+#include "../src/jtrace_shm.h"
+
+int main()
+{
+  std::string name = "/jtrace_shm_test." + std::to_string(getpid());
+  shm_region region;
+  assert(region.create(name, 2, 100));
+  shm_unlink(name.c_str());
+  uint64_t capacity = region.ring_size();
+  assert(capacity == 128);
+
+  // Writes of every size up to the capacity, read back at odd offsets, so
+  // that both sides wrap around many times.
+  std::mt19937 random(1);
+  std::string written, read;
+  for (int round = 0; round < 2000; ++round) {
+    size_t count = 1 + random() % capacity;
+    std::string bytes;
+    for (size_t i = 0; i < count; ++i) bytes.push_back((char)random());
+    if (shm_write(region, 1, bytes.data(), count, std::chrono::nanoseconds(0)))
+      written += bytes;
+    else
+      assert(region.ring(1).head - region.ring(1).tail + count > capacity);
+    if (random() % 2) shm_read(region, 1, read);
+  }
+  shm_read(region, 1, read);
+  assert(read == written);
+  assert(region.ring(0).head == 0);
+
+  // A write that can never fit.
+  std::string big(capacity + 1, 'x');
+  assert(!shm_write(region, 0, big.data(), big.size(), std::chrono::seconds(1)));
+
+  // Without a consumer, a full ring gives up once the heartbeat has been
+  // still for the stall time.
+  std::string full(capacity, 'y');
+  assert(shm_write(region, 0, full.data(), full.size(), std::chrono::nanoseconds(0)));
+  auto start = std::chrono::steady_clock::now();
+  assert(!shm_write(region, 0, "z", 1, std::chrono::milliseconds(20)));
+  assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+
+  // A consumer that keeps beating but only drains later is waited for.
+  std::thread consumer([&] {
+    for (int i = 0; i < 50; ++i) {
+      region.header()->heartbeat.fetch_add(1);
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    std::string drained;
+    shm_read(region, 0, drained);
+  });
+  assert(shm_write(region, 0, "z", 1, std::chrono::milliseconds(20)));
+  consumer.join();
+
+  std::puts("shm_test: ok");
+  return 0;
+}